@@ -0,0 +1,120 @@
+#
+# shelfman_lib.py -- ctypes binding of libshelfman.so, the renderer of shelfman-qrcode.
+#
+# Build the library with 'make -C src libshelfman.so'. It is searched in
+# $SHELFMAN_LIB, next to this file, in src/, then in the system library path.
+#
+# (C) 2025, distribute under GPLv1
+
+import os, ctypes
+
+PAYLOAD_LEN = 24    # SFM-<letter>-xxxxxxxx-xxxx-xxxx
+UID_LEN = 18        # xxxxxxxx-xxxx-xxxx
+
+
+def _load():
+    here = os.path.dirname(os.path.abspath(__file__))
+    for path in (os.environ.get("SHELFMAN_LIB"), os.path.join(here, "libshelfman.so"),
+                 os.path.join(here, "src", "libshelfman.so")):
+        if path and os.path.exists(path):
+            return ctypes.CDLL(path)
+    return ctypes.CDLL("libshelfman.so")
+
+
+_lib = _load()
+_p, _u, _s = ctypes.c_void_p, ctypes.c_uint, ctypes.c_char_p
+_pu = ctypes.POINTER(ctypes.c_uint)
+for name, res, args in (
+        ("sfm_lib_new",          _p,   []),
+        ("sfm_lib_free",         None, [_p]),
+        ("sfm_lib_set",          ctypes.c_int, [_p, _s, _s]),
+        ("sfm_lib_render",       _p,   [_p, _s, _s, _s]),
+        ("sfm_lib_render_batch", ctypes.c_int, [_p, _s, _u, _s, ctypes.POINTER(_p), _s]),
+        ("sfm_lib_img_info",     None, [_p, _pu, _pu, _pu, _pu]),
+        ("sfm_lib_img_data",     _p,   [_p]),
+        ("sfm_lib_img_free",     None, [_p]),
+        ("sfm_lib_thumbnail",    _p,   [_p, _u]),
+        ("sfm_lib_save",         None, [_p, _s]),
+        ("sfm_lib_ptouch",       _u,   [_p, _s])):
+    f = getattr(_lib, name)
+    f.restype, f.argtypes = res, args
+
+
+class Label:
+    """One rendered label. 1 bit per pixel, MSB first, rows not padded, 1 is white.
+    With bits_per_val 8 one byte per pixel, 255 is white."""
+
+    def __init__(self, img, payload):
+        self._img = img
+        self.payload = payload
+        w, h, bits, n = ctypes.c_uint(), ctypes.c_uint(), ctypes.c_uint(), ctypes.c_uint()
+        _lib.sfm_lib_img_info(img, w, h, bits, n)
+        self.width, self.height, self.bits_per_val, self._len = w.value, h.value, bits.value, n.value
+
+    def __del__(self):
+        if self._img:
+            _lib.sfm_lib_img_free(self._img)
+            self._img = None
+
+    @property
+    def data(self):
+        return ctypes.string_at(_lib.sfm_lib_img_data(self._img), self._len)
+
+    def save(self, filename):
+        """Writes the same file as shelfman-qrcode."""
+        _lib.sfm_lib_save(self._img, filename.encode())
+
+    def thumbnail(self, height):
+        """A box filtered grayscale Label of height pixels, for previews."""
+        img = _lib.sfm_lib_thumbnail(self._img, height)
+        if not img:
+            raise ValueError(height)
+        return Label(img, self.payload)
+
+    def ptouch(self):
+        """The Brother P-touch raster stream, e.g. for /dev/usb/lp0."""
+        buf = ctypes.create_string_buffer(_lib.sfm_lib_ptouch(self._img, None))
+        n = _lib.sfm_lib_ptouch(self._img, buf)
+        return buf.raw[:n]
+
+
+class Renderer:
+    """Config names as in sfm_lib_set(): title, label_pre, max_height, tape (mm), dpi, qr_upper,
+    symbology (qr, dm or auto), verify, bits_per_val (1, or 8 for grayscale), hspace, vspace,
+    big_font_size, small_font_size."""
+
+    def __init__(self, **config):
+        self._lib = _lib.sfm_lib_new()
+        for name, value in config.items():
+            if _lib.sfm_lib_set(self._lib, name.encode(), str(value).encode()):
+                raise KeyError(name)
+
+    def __del__(self):
+        if self._lib:
+            _lib.sfm_lib_free(self._lib)
+            self._lib = None
+
+    def render(self, letter="X", uid=None):
+        """uid: xxxxxxxx-xxxx-xxxx, or None for a random one."""
+        payload = ctypes.create_string_buffer(PAYLOAD_LEN + 1)
+        img = _lib.sfm_lib_render(self._lib, letter.encode(), uid.encode() if uid else None, payload)
+        if not img:
+            raise RuntimeError(f"cannot render {payload.value.decode()}")
+        return Label(img, payload.value.decode())
+
+    def render_batch(self, letter="X", count=1, uids=None):
+        """count labels with random uids, or one per uid."""
+        if uids is not None:
+            count = len(uids)
+            uids = b"".join(u.encode().ljust(UID_LEN + 1, b"\0") for u in uids)
+        imgs = (ctypes.c_void_p * count)()
+        payloads = ctypes.create_string_buffer(count * (PAYLOAD_LEN + 1))
+        failed = _lib.sfm_lib_render_batch(self._lib, letter.encode(), count, uids, imgs, payloads)
+        labels = []
+        for i in range(count):
+            payload = payloads.raw[i * (PAYLOAD_LEN + 1):(i + 1) * (PAYLOAD_LEN + 1)].rstrip(b"\0").decode()
+            if imgs[i]:
+                labels.append(Label(imgs[i], payload))
+        if failed:
+            raise RuntimeError(f"{failed} of {count} labels failed to render")
+        return labels
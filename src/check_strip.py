@@ -0,0 +1,45 @@
+#! /usr/bin/python3
+#
+# check_strip.py -- every label pbm must be found in the strip pbm, at the same x in all its rows.
+# Used by 'make check': the labels are reprinted from the archive of the strip.
+#
+# Usage: check_strip.py strip.pbm label.pbm ...
+
+import sys
+
+
+# the rows of a P1 pbm as strings of '0' and '1', as img_save() writes them.
+def load_p1(path):
+    tok = open(path).read().split(None, 3)
+    if tok[0] != "P1":
+        sys.exit(f"ERROR: {path} is not a P1 pbm")
+    w, h = int(tok[1]), int(tok[2])
+    bits = "".join(tok[3].split())
+    if len(bits) != w * h:
+        sys.exit(f"ERROR: {path} has {len(bits)} pixels, expected {w}x{h}")
+    return [bits[y * w:(y + 1) * w] for y in range(h)]
+
+
+def positions(row, part):
+    found, x = set(), row.find(part)
+    while x >= 0:
+        found.add(x)
+        x = row.find(part, x + 1)
+    return found
+
+
+strip = load_p1(sys.argv[1])
+failed = 0
+for path in sys.argv[2:]:
+    label = load_p1(path)
+    xs = None
+    if len(label) == len(strip):
+        for row, part in zip(strip, label):
+            xs = positions(row, part) if xs is None else xs & positions(row, part)
+            if not xs:
+                break
+    if not xs:
+        print(f"ERROR: {path} is not in {sys.argv[1]}")
+        failed += 1
+print(f"# {len(sys.argv) - 2 - failed} of {len(sys.argv) - 2} labels found in the {len(strip[0])}x{len(strip)} strip")
+sys.exit(1 if failed else 0)
@@ -0,0 +1,169 @@
+/*
+ * fontpack.c -- packs the Adafruit GFX fonts into sfm_fonts.h, in the format
+ * of sfm_font.h. Runs on the build host: make sfm_fonts.h
+ *
+ * Each packed glyph is decoded again and compared with the original bitmap.
+ */
+
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <stdint.h>
+
+#include "sfm_font.h"
+
+#define PROGMEM		/* NOOP */
+#define _ADAFRUIT_GFX_H	/* so that nothing else gets included */
+#include "gfxfont.h"
+#include "Fonts/FreeSans9pt7b.h"
+#include "Fonts/FreeSans12pt7b.h"
+#include "Fonts/FreeSans18pt7b.h"
+#include "Fonts/FreeSans24pt7b.h"
+// #include "Fonts/FreeSansBold12pt7b.h"
+// #include "Fonts/FreeSansBold18pt7b.h"
+// #include "Fonts/FreeSansBold24pt7b.h"
+// #include "Fonts/FreeSansBold9pt7b.h"
+
+static const struct {
+	const char *name;
+	const GFXfont *f;
+} fonts[] = {
+	{ "FreeSans9pt7b",  &FreeSans9pt7b },
+	{ "FreeSans12pt7b", &FreeSans12pt7b },
+	{ "FreeSans18pt7b", &FreeSans18pt7b },
+	{ "FreeSans24pt7b", &FreeSans24pt7b },
+};
+
+#define PACK_MAX	(64 * 1024)	// sfm_glyph.offset is 16 bits
+
+static uint8_t out[PACK_MAX];
+static uint32_t out_bit;
+
+
+static void put_bit(unsigned b)
+{
+	if (out_bit >= 8 * PACK_MAX)
+	{
+		fprintf(stderr, "ERROR: packed font is larger than %u bytes\n", PACK_MAX);
+		exit(1);
+	}
+	if (b)
+		out[out_bit >> 3] |= 0x80 >> (out_bit & 7);
+	out_bit++;
+}
+
+
+static void put_gamma(unsigned n)
+{
+	unsigned v = n + 1, k = 0;
+	while ((v >> k) > 1)
+		k++;
+	for (unsigned i = 0; i < k; i++)
+		put_bit(0);
+	for (int i = k; i >= 0; i--)
+		put_bit((v >> i) & 1);
+}
+
+
+static unsigned gfx_bit(const GFXfont *f, const GFXglyph *g, unsigned pos)
+{
+	const uint8_t *p = f->bitmap + g->bitmapOffset;
+	return (p[pos / 8] >> (7 - pos % 8)) & 1;
+}
+
+
+static void pack_glyph(const GFXfont *f, const GFXglyph *g)
+{
+	unsigned w = g->width, h = g->height;
+	unsigned val = 0, run = 0;
+
+	// runs of the rows XORed with the row above.
+	for (unsigned pos = 0; pos < w * h; pos++)
+	{
+		unsigned b = gfx_bit(f, g, pos) ^ ((pos >= w) ? gfx_bit(f, g, pos - w) : 0);
+		if (b == val)
+			run++;
+		else
+		{
+			put_gamma(run);
+			val = b;
+			run = 1;
+		}
+	}
+	put_gamma(run);
+}
+
+
+static int check_glyph(const GFXfont *f, const GFXglyph *g, const struct sfm_font *pf, const struct sfm_glyph *pg)
+{
+	struct sfm_glyph_reader r;
+	if (!g->width || !g->height)
+		return 0;
+	sfm_glyph_start(&r, pf, pg);
+	for (unsigned y = 0; y < g->height; y++)
+	{
+		uint64_t row = sfm_glyph_row(&r);
+		for (unsigned x = 0; x < g->width; x++)
+			if (((row >> (63 - x)) & 1) != gfx_bit(f, g, y * g->width + x))
+				return -1;
+	}
+	return 0;
+}
+
+
+int main(void)
+{
+	printf("// generated by fontpack.c from the Adafruit GFX fonts, do not edit.\n");
+	for (unsigned i = 0; i < sizeof(fonts) / sizeof(fonts[0]); i++)
+	{
+		const GFXfont *f = fonts[i].f;
+		unsigned n = f->last - f->first + 1, raw = 0;
+		struct sfm_glyph *glyphs = (struct sfm_glyph *)calloc(n, sizeof(struct sfm_glyph));
+
+		memset(out, 0, sizeof(out));
+		out_bit = 0;
+		for (unsigned c = 0; c < n; c++)
+		{
+			const GFXglyph *g = f->glyph + c;
+			if (g->width > SFM_FONT_MAX_WIDTH)
+			{
+				fprintf(stderr, "ERROR: %s: glyph 0x%02x is wider than %u\n", fonts[i].name, f->first + c, SFM_FONT_MAX_WIDTH);
+				return 1;
+			}
+			out_bit = (out_bit + 7) & ~7u;
+			glyphs[c].offset = out_bit / 8;
+			glyphs[c].width = g->width;
+			glyphs[c].height = g->height;
+			glyphs[c].xAdvance = g->xAdvance;
+			glyphs[c].xOffset = g->xOffset;
+			glyphs[c].yOffset = g->yOffset;
+			pack_glyph(f, g);
+			raw += (g->width * g->height + 7) / 8;
+		}
+		unsigned len = (out_bit + 7) / 8;
+
+		struct sfm_font pf = { out, glyphs, (uint8_t)f->first, (uint8_t)f->last, f->yAdvance, (uint16_t)len };
+		for (unsigned c = 0; c < n; c++)
+		{
+			if (check_glyph(f, f->glyph + c, &pf, glyphs + c))
+			{
+				fprintf(stderr, "ERROR: %s: glyph 0x%02x does not decode\n", fonts[i].name, f->first + c);
+				return 1;
+			}
+		}
+
+		printf("\n// %u bytes, raw bitmap %u bytes\n", len, raw);
+		printf("static const uint8_t %sPacked[] = {", fonts[i].name);
+		for (unsigned k = 0; k < len; k++)
+			printf("%s0x%02x,", (k % 16) ? " " : "\n\t", out[k]);
+		printf("\n};\n\nstatic const struct sfm_glyph %sGlyphs[] = {\n", fonts[i].name);
+		for (unsigned c = 0; c < n; c++)
+			printf("\t{ %5u, %3u, %3u, %3u, %4d, %4d },\t// 0x%02x\n", glyphs[c].offset, glyphs[c].width,
+				glyphs[c].height, glyphs[c].xAdvance, glyphs[c].xOffset, glyphs[c].yOffset, f->first + c);
+		printf("};\n\nstatic const struct sfm_font %s = { %sPacked, %sGlyphs, 0x%02x, 0x%02x, %u, %u };\n",
+			fonts[i].name, fonts[i].name, fonts[i].name, f->first, f->last, f->yAdvance, len);
+		fprintf(stderr, "%s: %u bytes, raw %u bytes\n", fonts[i].name, len, raw);
+		free(glyphs);
+	}
+	return 0;
+}
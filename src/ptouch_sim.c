@@ -0,0 +1,487 @@
+/*
+ * ptouch_sim.c -- a simulated P-touch printer behind the API of
+ * ptouch_rp2040.c, so that the print path can be load tested and checked
+ * without a D410 attached. shelfman-qrcode -D sim[:options] prints on it.
+ *
+ * ptouch_write() feeds a parser of the raster command stream: ESC @,
+ * ESC i a/M/K/A/d/z, M, the raster lines G (PackBits), g and Z, the status
+ * request ESC i S and the print commands FF and ^Z. The raster lines are
+ * decoded into the bitmap the print head would print, saved with out=.
+ *
+ * Timing: a write takes what its bytes take on the usb, a label what its
+ * lines take at the print speed. As on the printer, the printed reply comes
+ * when the label is done, and the next label waits for it. The status
+ * replies are those of sfm_ptouch.h, with phase changes, and a tape out once
+ * the tape of labels= labels is used up. With fail= a label fails while it
+ * prints, as if the cover was opened: an error reply instead of the printed
+ * one, and the printer stays in error.
+ *
+ * Options of ptouch_sim_config(), colon separated:
+ *	tape=mm		tape width in the status, default 18
+ *	labels=n	tape for n labels, default 0: endless
+ *	fail=n		label n fails in print, the cover is open from then on. Default 0: none
+ *	mmps=n		print speed in mm/s, default 20. 0: no delay
+ *	usb=kB		usb transfer in kB/s, default 1000. 0: no delay
+ *	out=file.pbm	save each label as file-0001.pbm, ...
+ * ptouch_close() reports bytes/s and lines/s.
+ */
+
+#include "ptouch_sim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SIM_DPI		180
+#define SIM_QUEUE	8		// status replies not yet read
+#define SIM_MAX_ERRORS	10		// reported, the rest are only counted
+
+static struct {
+	// options
+	unsigned tape_mm, tape_labels, fail_label, mmps, usb_kb;
+	char out[256];
+
+	bool ready;
+	uint8_t *pend;			// bytes of an incomplete command
+	unsigned npend, pend_size;
+	unsigned compression;		// of the G lines, 2: PackBits
+	uint8_t *lines;			// raster lines of the label
+	unsigned nlines, lines_size;
+
+	struct ptouch_status status;	// the last reply read
+	bool status_valid;
+	struct ptouch_status queue[SIM_QUEUE];
+	unsigned qhead, qcount;
+	bool printing;			// the printed reply of the last label is due at print_end
+	bool failing;			// the label in print is fail=
+	bool cover_open;
+	int print_result;		// of the last label, see ptouch_printed()
+	double print_end;
+
+	double t_open, head_busy;
+	unsigned long long bytes, total_lines;
+	unsigned labels, errors;
+} sim;
+
+
+static double sim_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static void sim_sleep(double s)
+{
+	if (s <= 0)
+		return;
+	struct timespec ts;
+	ts.tv_sec = (time_t)s;
+	ts.tv_nsec = (long)((s - ts.tv_sec) * 1e9);
+	nanosleep(&ts, NULL);
+}
+
+
+static void sim_error(const char *what, unsigned v)
+{
+	if (sim.errors++ < SIM_MAX_ERRORS)
+		printf("# sim: %s 0x%02x at byte %llu\n", what, v, sim.bytes);
+}
+
+
+static bool sim_tape_out(void)
+{
+	return sim.tape_labels && sim.labels >= sim.tape_labels;
+}
+
+
+// queues a status reply, the oldest is dropped if nobody reads them.
+static void sim_reply(uint8_t type)
+{
+	struct ptouch_status *s = sim.queue + (sim.qhead + sim.qcount) % SIM_QUEUE;
+	if (sim.qcount == SIM_QUEUE)
+		sim.qhead = (sim.qhead + 1) % SIM_QUEUE;
+	else
+		sim.qcount++;
+	memset(s, 0, sizeof(*s));
+	s->head_mark = 0x80;
+	s->size = PTOUCH_STATUS_LEN;
+	s->brother = 'B';
+	s->series = '0';
+	s->media_width = sim.tape_mm;
+	s->media_type = 0x01;		// laminated
+	s->error1 = sim_tape_out() ? PTOUCH_E1_END_OF_MEDIA : 0;
+	s->error2 = sim.cover_open ? PTOUCH_E2_COVER_OPEN : 0;
+	s->status_type = type;
+	s->phase_type = sim.printing ? PTOUCH_PHASE_PRINT : PTOUCH_PHASE_EDIT;
+	s->tape_color = 0x01;		// white
+	s->text_color = 0x08;		// black
+}
+
+
+// the printed reply, once the label is through the print head. Or the error of fail=.
+static void sim_advance(void)
+{
+	if (!sim.printing || sim_now() < sim.print_end)
+		return;
+	sim.printing = false;
+	sim.cover_open |= sim.failing;
+	sim.print_result = sim.failing ? PTOUCH_E_PRINTER : 0;
+	sim_reply(sim.failing ? PTOUCH_ST_ERROR : PTOUCH_ST_PRINTED);
+	sim_reply(PTOUCH_ST_PHASE);
+}
+
+
+// the next reply into sim.status. Returns 0 if none is due.
+static int sim_take(void)
+{
+	sim_advance();
+	if (!sim.qcount)
+		return 0;
+	sim.status = sim.queue[sim.qhead];
+	sim.qhead = (sim.qhead + 1) % SIM_QUEUE;
+	sim.qcount--;
+	sim.status_valid = true;
+	return 1;
+}
+
+
+// one raster line, decoded as the printer does. Short lines are padded, as the printer would.
+static void sim_line(const uint8_t *d, unsigned n, bool packed)
+{
+	uint8_t line[PTOUCH_LINE_BYTES];
+	unsigned o = 0;
+
+	memset(line, 0, sizeof(line));
+	for (unsigned i = 0; i < n; )
+	{
+		unsigned c = packed ? d[i++] : 127;
+		if (!packed || c < 128)
+		{
+			unsigned k = packed ? c + 1 : n;
+			if (i + k > n || o + k > PTOUCH_LINE_BYTES)
+				break;
+			memcpy(line + o, d + i, k);
+			i += k;
+			o += k;
+		}
+		else if (c > 128)
+		{
+			unsigned k = 257 - c;
+			if (i >= n || o + k > PTOUCH_LINE_BYTES)
+				break;
+			memset(line + o, d[i++], k);
+			o += k;
+		}
+	}
+	if (o != PTOUCH_LINE_BYTES && n)
+		sim_error("bad raster line, bytes", o);
+
+	if (sim.nlines == sim.lines_size)
+	{
+		sim.lines_size = sim.lines_size ? 2 * sim.lines_size : 1024;
+		sim.lines = (uint8_t *)realloc(sim.lines, sim.lines_size * PTOUCH_LINE_BYTES);
+	}
+	memcpy(sim.lines + sim.nlines++ * PTOUCH_LINE_BYTES, line, PTOUCH_LINE_BYTES);
+}
+
+
+// the label as the print head prints it: one column per raster line, pin 0 on top, as pbm.
+static void sim_save(void)
+{
+	char name[300];
+	const char *dot = strrchr(sim.out, '.');
+	if (!dot || strchr(dot, '/'))
+		snprintf(name, sizeof(name), "%s-%04u", sim.out, sim.labels);
+	else
+		snprintf(name, sizeof(name), "%.*s-%04u%s", (int)(dot - sim.out), sim.out, sim.labels, dot);
+	FILE *fp = fopen(name, "w");
+	if (!fp)
+	{
+		printf("ERROR: cannot write %s\n", name);
+		return;
+	}
+	fprintf(fp, "P1\n%u %u\n", sim.nlines, PTOUCH_PINS);
+	for (unsigned y = 0; y < PTOUCH_PINS; y++)
+	{
+		for (unsigned x = 0; x < sim.nlines; x++)
+			fputc((sim.lines[x * PTOUCH_LINE_BYTES + y / 8] >> (7 - y % 8)) & 1 ? '1' : '0', fp);
+		fputc('\n', fp);
+	}
+	fclose(fp);
+}
+
+
+// FF or ^Z: the label goes to the print head, after the one before it.
+static void sim_print(void)
+{
+	if (sim.printing)
+	{
+		sim_sleep(sim.print_end - sim_now());
+		sim_advance();
+	}
+	if (sim_tape_out() || sim.cover_open)
+	{
+		sim.print_result = PTOUCH_E_PRINTER;
+		sim_reply(PTOUCH_ST_ERROR);
+		sim.nlines = 0;
+		return;
+	}
+	sim.labels++;
+	sim.failing = (sim.labels == sim.fail_label);
+	if (sim.out[0] && !sim.failing)
+		sim_save();
+	double t = sim.mmps ? sim.nlines * 25.4 / SIM_DPI / sim.mmps : 0;
+	sim.printing = true;
+	sim.print_end = sim_now() + t;
+	sim.head_busy += t;
+	sim.total_lines += sim.nlines;
+	sim.nlines = 0;
+	sim_reply(PTOUCH_ST_PHASE);
+}
+
+
+// bytes of the command at c, 0 if more are needed.
+static unsigned sim_cmd_len(const uint8_t *c, unsigned left)
+{
+	switch (c[0])
+	{
+	case 0x1b:
+		if (left < 3)
+			return (left == 2 && c[1] != 'i') ? 2 : 0;
+		if (c[1] != 'i')
+			return 2;
+		switch (c[2])
+		{
+		case 'a': case 'M': case 'K': case 'A':	return 4;
+		case 'd':				return 5;
+		case 'z':				return 13;
+		default:				return 3;
+		}
+	case 'M':
+		return (left >= 2) ? 2 : 0;
+	case 'G':
+		return (left >= 3 && left >= 3u + (c[1] | c[2] << 8)) ? 3 + (c[1] | c[2] << 8) : 0;
+	case 'g':
+		return (left >= 3 && left >= 3u + c[2]) ? 3 + c[2] : 0;
+	default:
+		return 1;
+	}
+}
+
+
+static void sim_cmd(const uint8_t *c, unsigned len)
+{
+	switch (c[0])
+	{
+	case 0x00:			// invalidate, padding
+		break;
+	case 0x1b:
+		if (c[1] == '@')
+		{
+			sim.nlines = 0;
+			sim.compression = 0;
+		}
+		else if (c[1] != 'i')
+			sim_error("unknown command ESC", c[1]);
+		else if (c[2] == 'S')
+			sim_reply(PTOUCH_ST_REPLY);
+		else if (!strchr("aMKAdz", c[2]))
+			sim_error("unknown command ESC i", c[2]);
+		break;
+	case 'M':
+		sim.compression = c[1];
+		break;
+	case 'G':
+		sim_line(c + 3, len - 3, sim.compression == 2);
+		break;
+	case 'g':
+		sim_line(c + 3, len - 3, false);
+		break;
+	case 'Z':
+		sim_line(c, 0, false);
+		break;
+	case 0x0c:			// print, the next label follows
+	case 0x1a:			// print and feed
+		sim_print();
+		break;
+	default:
+		sim_error("unknown command", c[0]);
+		break;
+	}
+}
+
+
+// parses what is complete, keeps the rest for the next write.
+static void sim_parse(void)
+{
+	unsigned i = 0, len;
+	while (i < sim.npend && (len = sim_cmd_len(sim.pend + i, sim.npend - i)))
+	{
+		sim_cmd(sim.pend + i, len);
+		i += len;
+		sim.bytes += len;
+	}
+	memmove(sim.pend, sim.pend + i, sim.npend - i);
+	sim.npend -= i;
+}
+
+
+// the printer comes up, with the defaults of the options.
+void ptouch_init(void)
+{
+	free(sim.pend);
+	free(sim.lines);
+	memset(&sim, 0, sizeof(sim));
+	sim.tape_mm = 18;
+	sim.mmps = 20;
+	sim.usb_kb = 1000;
+	sim.ready = true;
+}
+
+
+// the options, see above. Returns 0, or -1 for an unknown one.
+int ptouch_sim_config(const char *spec)
+{
+	char buf[512];
+	char *save = NULL;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	for (char *o = strtok_r(buf, ":", &save); o; o = strtok_r(NULL, ":", &save))
+	{
+		if (!strncmp(o, "out=", 4))
+			snprintf(sim.out, sizeof(sim.out), "%s", o + 4);
+		else if (sscanf(o, "tape=%u", &sim.tape_mm) != 1 && sscanf(o, "labels=%u", &sim.tape_labels) != 1 &&
+			 sscanf(o, "fail=%u", &sim.fail_label) != 1 &&
+			 sscanf(o, "mmps=%u", &sim.mmps) != 1 && sscanf(o, "usb=%u", &sim.usb_kb) != 1)
+		{
+			printf("ERROR: unknown option of the simulated printer: %s\n", o);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+int ptouch_open(void)
+{
+	if (!sim.ready)
+		return PTOUCH_E_NO_PRINTER;
+	sim.t_open = sim_now();
+	return ptouch_status(NULL);
+}
+
+
+bool ptouch_ready(void)
+{
+	return sim.ready;
+}
+
+
+// reads the replies of the last label, it is printed then.
+void ptouch_poll(void)
+{
+	while (sim_take())
+		;
+}
+
+
+static void print_wait(void)
+{
+	while (sim.printing)
+	{
+		sim_sleep(sim.print_end - sim_now());
+		ptouch_poll();
+	}
+}
+
+
+int ptouch_write(const void *buf, uint32_t len)
+{
+	if (!sim.ready)
+		return PTOUCH_E_NO_PRINTER;
+	if (sim.usb_kb)
+		sim_sleep(len / (sim.usb_kb * 1000.0));
+	if (sim.npend + len > sim.pend_size)
+	{
+		sim.pend_size = sim.npend + len + 4096;
+		sim.pend = (uint8_t *)realloc(sim.pend, sim.pend_size);
+	}
+	memcpy(sim.pend + sim.npend, buf, len);
+	sim.npend += len;
+	sim_parse();
+	return (int)len;
+}
+
+
+// as ptouch_rp2040.c: 0, PTOUCH_E_PRINTER if the printer reports an error, or PTOUCH_E_TIMEOUT.
+int ptouch_status(struct ptouch_status *st)
+{
+	if (!sim.ready)
+		return PTOUCH_E_NO_PRINTER;
+	print_wait();
+	ptouch_write(ptouch_status_request, sizeof(ptouch_status_request));
+	for (;;)
+	{
+		if (!sim_take())
+			return PTOUCH_E_TIMEOUT;
+		if (sim.status.status_type == PTOUCH_ST_REPLY)
+			break;
+	}
+	if (st)
+		*st = sim.status;
+	return ptouch_status_error(&sim.status) ? PTOUCH_E_PRINTER : 0;
+}
+
+
+const struct ptouch_status *ptouch_last_status(void)
+{
+	return sim.status_valid ? &sim.status : NULL;
+}
+
+
+// as ptouch_rp2040.c: asks for the status first, then sends the label. Returns 0 or PTOUCH_E_*.
+int ptouch_print(const uint8_t *stream, uint32_t len)
+{
+	int ret;
+	if (!sim.ready)
+		return PTOUCH_E_NO_PRINTER;
+	if ((ret = ptouch_status(NULL)))
+		return ret;
+	if ((ret = ptouch_write(stream, len)) != (int)len)
+		return (ret < 0) ? ret : PTOUCH_E_TIMEOUT;
+	return 0;
+}
+
+
+// as ptouch_rp2040.c: waits until the last label is printed. Returns 0, or PTOUCH_E_PRINTER if it failed in print.
+int ptouch_printed(void)
+{
+	if (!sim.ready)
+		return PTOUCH_E_NO_PRINTER;
+	print_wait();
+	return sim.print_result;
+}
+
+
+// waits for the last label and reports the throughput.
+void ptouch_close(void)
+{
+	if (!sim.ready)
+		return;
+	print_wait();
+	double t = sim_now() - sim.t_open;
+	printf("# sim: %u labels, %llu lines, %llu bytes in %.2fs: %.0f bytes/s, %.0f lines/s, print head busy %.0f%%\n",
+		sim.labels, sim.total_lines, sim.bytes, t, t > 0 ? sim.bytes / t : 0, t > 0 ? sim.total_lines / t : 0,
+		t > 0 ? 100 * sim.head_busy / t : 0);
+	if (sim.nlines || sim.npend)
+		printf("# sim: %u raster lines and %u bytes not printed\n", sim.nlines, sim.npend);
+	if (sim.errors)
+		printf("# sim: %u protocol errors\n", sim.errors);
+	free(sim.pend);
+	free(sim.lines);
+	sim.pend = sim.lines = NULL;
+	sim.npend = sim.pend_size = sim.nlines = sim.lines_size = 0;
+	sim.ready = false;
+}
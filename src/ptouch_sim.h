@@ -0,0 +1,25 @@
+/*
+ * ptouch_sim.h -- the API of ptouch_rp2040.h, backed by a simulated printer on linux, see ptouch_sim.c
+ */
+#ifndef PTOUCH_SIM_H
+#define PTOUCH_SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>	// NULL, for sfm_ptouch.h
+#include "sfm_ptouch.h"
+
+void ptouch_init(void);
+int ptouch_open(void);
+bool ptouch_ready(void);
+int ptouch_write(const void *buf, uint32_t len);
+int ptouch_status(struct ptouch_status *st);
+int ptouch_print(const uint8_t *stream, uint32_t len);
+int ptouch_printed(void);
+void ptouch_poll(void);
+const struct ptouch_status *ptouch_last_status(void);
+void ptouch_close(void);
+
+int ptouch_sim_config(const char *spec);
+
+#endif // PTOUCH_SIM_H
@@ -22,22 +22,58 @@
  *
  * Code:
  * stdio_init_all();  // printf() → UART1 (115200 baud)
+ *
+ * The printer interface has a bulk OUT endpoint for the raster stream and a
+ * bulk IN endpoint for the 32 byte status replies, see sfm_ptouch.h.
+ * ptouch_print() uses them for flow control: one label at a time, at the
+ * pace the printer reports, and an error aborts before data is sent.
  */
 
 
 #include "ptouch_rp2040.h"	// Includes tusb_config.h via tusb.h
+#include "pico/stdlib.h"	// to_ms_since_boot()
+#include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
 
-#define PTOUCH_VID   0x04F9   // Brother
-#define PTOUCH_PID   0x20DF   // PT-D410 (from libptouch.c)
+#define PTOUCH_PID   0x20DF   // PT-D410 (from libptouch.c), PTOUCH_VID is in sfm_ptouch.h
+#define LANGUAGE_ID  0x0409   // English (US)
+#define PTOUCH_CHUNK	4096	// bytes per bulk OUT transfer
+#define PTOUCH_OUT_MS	2000	// per chunk, the printer NAKs while its buffer is full.
 
 static uint8_t  g_dev_addr = 0;
 static uint8_t  g_if_num   = 0;
 static uint8_t  g_ep_out   = 0x00;   // bulk OUT endpoint address
+static uint8_t  g_ep_in    = 0x00;   // bulk IN endpoint address, status replies
 static bool     g_ready    = false;
 
+/*
+ * Status back-channel: the printer answers ESC i S with 32 bytes (sfm_ptouch.h)
+ * and reports unasked when a label is printed or an error occurs.
+ * The rp2040 host port shares one hardware endpoint between all bulk
+ * transfers, and the printer NAKs an IN until it has something to say. So a
+ * read is only posted when a reply is due: after a status request, and after
+ * the print command of a label, until its printed or error reply is in.
+ * Nothing is sent meanwhile, the next label waits for the last one to be
+ * printed, that is the printer's pace.
+ */
+static struct ptouch_status g_status;		// the last reply
+static bool g_status_valid = false;
+static volatile bool g_in_busy = false;		// a read is posted
+static volatile bool g_in_done = false;		// and completed, result in g_in_ok, g_in_len
+static volatile bool g_in_ok = false;
+static volatile uint32_t g_in_len = 0;
+static bool g_printing = false;			// the printed reply of the last label is due
+static uint32_t g_print_start = 0;
+static int g_print_result = 0;				// of the last label, see ptouch_printed()
+
+
+static inline uint32_t ms_now(void)
+{
+	return to_ms_since_boot(get_absolute_time());
+}
+
 
 //--------------------------------------------------------------------+
 // String Descriptor Helper
@@ -101,6 +137,11 @@ CFG_TUH_MEM_SECTION struct {
   TUH_EPBUF_DEF(buf, 128*sizeof(uint16_t));
 } desc;
 
+CFG_TUH_MEM_SECTION struct {
+  TUH_EPBUF_DEF(in, 64);		// one full speed packet, a status reply is 32 bytes.
+  TUH_EPBUF_DEF(req, sizeof(ptouch_status_request));
+} xbuf;
+
 
 // TinyUSB host callbacks
 void tuh_mount_cb(uint8_t dev_addr)
@@ -110,7 +151,7 @@ void tuh_mount_cb(uint8_t dev_addr)
     // Get Device Descriptor
     uint8_t xfer_result = tuh_descriptor_get_device_sync(dev_addr, d, sizeof(*d));
     if (XFER_RESULT_SUCCESS != xfer_result) {
-		printf("tuh_mount_cb(%d): tuh_descriptor_get_device_sync() failed\n");
+		printf("tuh_mount_cb(%d): tuh_descriptor_get_device_sync() failed\n", dev_addr);
         return;
     }
 
@@ -145,14 +186,14 @@ void tuh_mount_cb(uint8_t dev_addr)
     // Get String descriptor using Sync API
 
     printf("  iManufacturer       %u     ", desc.device.iManufacturer);
-    xfer_result = tuh_descriptor_get_manufacturer_string_sync(daddr, LANGUAGE_ID, desc.buf, sizeof(desc.buf));
+    xfer_result = tuh_descriptor_get_manufacturer_string_sync(dev_addr, LANGUAGE_ID, desc.buf, sizeof(desc.buf));
     if (XFER_RESULT_SUCCESS == xfer_result) {
         print_utf16((uint16_t*)(uintptr_t) desc.buf, sizeof(desc.buf)/2);
     }
     printf("\r\n");
 
     printf("  iProduct            %u     ", desc.device.iProduct);
-    xfer_result = tuh_descriptor_get_product_string_sync(daddr, LANGUAGE_ID, desc.buf, sizeof(desc.buf));
+    xfer_result = tuh_descriptor_get_product_string_sync(dev_addr, LANGUAGE_ID, desc.buf, sizeof(desc.buf));
     if (XFER_RESULT_SUCCESS == xfer_result) {
         print_utf16((uint16_t*)(uintptr_t) desc.buf, sizeof(desc.buf)/2);
     }
@@ -163,44 +204,57 @@ void tuh_mount_cb(uint8_t dev_addr)
 
     printf("  bNumConfigurations  %u\r\n", desc.device.bNumConfigurations);
 
-	// TODO: find interface number and configuraiton number for the bulk endpoint.
-
-//     if (d->idVendor == PTOUCH_VID)
-// 	{
-//         uint8_t cfg[256];
-//         uint16_t len = tuh_descriptor_get_configuration(dev_addr, 0, cfg, sizeof(cfg));
-//         if (!len) return;
-//
-//         uint8_t const *p = cfg + sizeof(tusb_desc_configuration_t);
-//         uint8_t const *end = cfg + len;
-//
-//         while (p < end) {
-//             uint8_t const dlen  = p[0];
-//             uint8_t const dtype = p[1];
-//
-//             if (dtype == TUSB_DESC_INTERFACE) {
-//                 tusb_desc_interface_t const *itf = (tusb_desc_interface_t const *)p;
-//                 g_if_num = itf->bInterfaceNumber;
-// #if DEBUG > 1
-// 				printf("tuh_mount_cb(%d): found bInterfaceNumber = %d\n", dev_addr, g_if_num);
-// #endif
-//             } else if (dtype == TUSB_DESC_ENDPOINT) {
-//                 tusb_desc_endpoint_t const *ep = (tusb_desc_endpoint_t const *)p;
-//                 if ( (ep->bmAttributes & TUSB_XFER_BULK) &&
-//                      !(ep->bEndpointAddress & TUSB_DIR_IN) ) {
-//                     g_ep_out = ep->bEndpointAddress;  // bulk OUT
-// #if DEBUG > 1
-// 					printf("Found bulk OUT bEndpointAddress = %d\n", g_ep_out);
-// #endif
-//                 }
-//             }
-//
-//             p += dlen;
-//         }
-//
-//         g_dev_addr = dev_addr;
-//         g_ready    = (g_ep_out != 0);
-//     }
+	if (d->idVendor != PTOUCH_VID)
+		return;
+
+	// the printer interface (class 7): bulk OUT for the raster data, bulk IN for the status replies.
+	xfer_result = tuh_descriptor_get_configuration_sync(dev_addr, 0, desc.buf, sizeof(desc.buf));
+	if (XFER_RESULT_SUCCESS != xfer_result) {
+		printf("tuh_mount_cb(%d): tuh_descriptor_get_configuration_sync() failed\n", dev_addr);
+		return;
+	}
+	tusb_desc_configuration_t const *c = (tusb_desc_configuration_t const *)desc.buf;
+	uint8_t const *p = desc.buf + sizeof(tusb_desc_configuration_t);
+	uint8_t const *end = desc.buf + tu_min16(c->wTotalLength, sizeof(desc.buf));
+	bool printer_if = false;
+
+	g_ep_out = g_ep_in = 0;
+	while (p + 2 <= end && p[0])
+	{
+		if (tu_desc_type(p) == TUSB_DESC_INTERFACE)
+		{
+			tusb_desc_interface_t const *itf = (tusb_desc_interface_t const *)p;
+			printer_if = (itf->bInterfaceClass == TUSB_CLASS_PRINTER && itf->bAlternateSetting == 0);
+			if (printer_if)
+				g_if_num = itf->bInterfaceNumber;
+#if DEBUG > 1
+			printf("tuh_mount_cb(%d): bInterfaceNumber = %d, class %d\n", dev_addr, itf->bInterfaceNumber, itf->bInterfaceClass);
+#endif
+		}
+		else if (printer_if && tu_desc_type(p) == TUSB_DESC_ENDPOINT)
+		{
+			tusb_desc_endpoint_t const *ep = (tusb_desc_endpoint_t const *)p;
+			if (ep->bmAttributes.xfer == TUSB_XFER_BULK && tuh_edpt_open(dev_addr, ep))
+			{
+				if (tu_edpt_dir(ep->bEndpointAddress) == TUSB_DIR_IN)
+					g_ep_in = ep->bEndpointAddress;
+				else
+					g_ep_out = ep->bEndpointAddress;
+#if DEBUG > 1
+				printf("tuh_mount_cb(%d): bulk %s bEndpointAddress = 0x%02x\n", dev_addr,
+					(ep->bEndpointAddress & TUSB_DIR_IN_MASK) ? "IN" : "OUT", ep->bEndpointAddress);
+#endif
+			}
+		}
+		p = tu_desc_next(p);
+	}
+
+	g_dev_addr = dev_addr;
+	g_status_valid = false;
+	g_in_busy = g_in_done = g_printing = false;
+	g_ready = (g_ep_out != 0);
+	if (!g_ep_in)
+		printf("WARNING: printer without status endpoint, no flow control\n");
 }
 
 void tuh_umount_cb(uint8_t dev_addr)
@@ -209,83 +263,277 @@ void tuh_umount_cb(uint8_t dev_addr)
         g_dev_addr = 0;
         g_ready    = false;
         g_ep_out   = 0;
+        g_ep_in    = 0;
+        g_in_busy  = false;
+        g_printing = false;
+        g_status_valid = false;
     }
 #if DEBUG > 1
 	printf("tuh_umount_cb(%d)\n", dev_addr);
 #endif
 }
 
+
+static void out_done_cb(tuh_xfer_t *x)
+{
+	volatile int *res = (volatile int *)x->user_data;
+	*res = (x->result == XFER_RESULT_SUCCESS) ? 1 : -1;
+}
+
 // Synchronous-ish bulk OUT helper
 static bool bulk_out_sync(const void *buf, uint32_t len, uint32_t timeout_ms)
 {
     if (!g_ready) return false;
 
-    volatile bool done = false;
-    volatile bool ok   = false;
-
-    usbh_xfer_t xfer =
+    volatile int res = 0;	// 1: done, -1: failed
+    tuh_xfer_t xfer =
     {
-        .daddr   = g_dev_addr,
-        .ep_addr = g_ep_out,
-        .buf     = (void *)buf,
-        .total_len = len,
-        .complete_cb = [](usbh_xfer_t *x)
-        {
-            volatile bool *p_done = (volatile bool *)x->user_data;
-            volatile bool *p_ok   = (volatile bool *)((uintptr_t)x->user_data + sizeof(bool));
-            *p_ok   = (x->result == XFER_RESULT_SUCCESS);
-            *p_done = true;
-        },
-        .user_data = NULL,
+        .daddr     = g_dev_addr,
+        .ep_addr   = g_ep_out,
+        .buflen    = len,
+        .buffer    = (uint8_t *)buf,
+        .complete_cb = out_done_cb,
+        .user_data = (uintptr_t)&res,
     };
 
-    // Simple trick: pack pointers to flags into user_data
-    struct {
-        volatile bool *done;
-        volatile bool *ok;
-    } ctx = { &done, &ok };
-    xfer.user_data = &ctx;
-
     if (!tuh_edpt_xfer(&xfer)) return false;
 
-    uint32_t start = board_millis();
-    while (!done) {
+    uint32_t start = ms_now();
+    while (!res) {
         tuh_task(); // must call frequently
-        if ((board_millis() - start) > timeout_ms) {
+        if ((ms_now() - start) > timeout_ms) {
+            tuh_edpt_abort_xfer(g_dev_addr, g_ep_out);
             return false; // timeout
         }
     }
-    return ok;
+    return res > 0;
+}
+
+
+static void in_done_cb(tuh_xfer_t *x)
+{
+	g_in_ok = (x->result == XFER_RESULT_SUCCESS);
+	g_in_len = x->actual_len;
+	g_in_busy = false;
+	g_in_done = true;
+}
+
+// posts a read for the next status reply, see above.
+static bool status_read_start(void)
+{
+	if (!g_ep_in || g_in_busy)
+		return false;
+	tuh_xfer_t xfer =
+	{
+		.daddr     = g_dev_addr,
+		.ep_addr   = g_ep_in,
+		.buflen    = sizeof(xbuf.in),
+		.buffer    = xbuf.in,
+		.complete_cb = in_done_cb,
+		.user_data = 0,
+	};
+	g_in_done = false;
+	g_in_busy = true;
+	if (!tuh_edpt_xfer(&xfer))
+	{
+		g_in_busy = false;
+		return false;
+	}
+	return true;
+}
+
+static void status_read_abort(void)
+{
+	if (g_in_busy)
+		tuh_edpt_abort_xfer(g_dev_addr, g_ep_in);
+	g_in_busy = g_in_done = false;
+}
+
+// 1: a new status in g_status, 0: nothing yet, -1: the read failed or was no status.
+static int status_read_take(void)
+{
+	if (!g_in_done)
+		return 0;
+	g_in_done = false;
+	if (!g_in_ok || g_in_len < PTOUCH_STATUS_LEN)
+		return -1;
+	memcpy(&g_status, xbuf.in, sizeof(g_status));
+	if (!ptouch_status_valid(&g_status))
+		return -1;
+	g_status_valid = true;
+#if DEBUG > 1
+	printf("ptouch status: type %u phase %u errors %02x %02x, %u mm tape\n", g_status.status_type,
+		g_status.phase_type, g_status.error1, g_status.error2, g_status.media_width);
+#endif
+	return 1;
 }
 
 // Public “ptouch” API for reuse by the original code
 
+// starts the TinyUSB host, the printer is found in tuh_mount_cb() when tuh_task() runs.
+void ptouch_init(void)
+{
+    tuh_init(0);
+}
+
+bool ptouch_ready(void)
+{
+    return g_ready;
+}
+
 int ptouch_open(void)
 {
-    // TinyUSB host is usually started in main() with tuh_init();
     // Here we just wait for the PT-D410 to appear.
-    uint32_t start = board_millis();
+    uint32_t start = ms_now();
     while (!g_ready) {
         tuh_task();
-        if (board_millis() - start > 5000) {
-            return -1; // no printer found within 5s
+        if (ms_now() - start > 5000) {
+            return PTOUCH_E_NO_PRINTER; // no printer found within 5s
         }
     }
-    return 0;
+    return g_ep_in ? ptouch_status(NULL) : 0;
+}
+
+// advances the status of the label in print. Called from the main loop, and while waiting.
+void ptouch_poll(void)
+{
+	if (!g_printing)
+		return;
+	if (status_read_take() > 0)
+	{
+		if (g_status.status_type == PTOUCH_ST_PRINTED)
+		{
+			g_printing = false;
+			g_print_result = 0;
+			return;
+		}
+		if (g_status.status_type == PTOUCH_ST_ERROR || ptouch_status_error(&g_status))
+		{
+			g_printing = false;	// the error stays in g_status for the next label.
+			g_print_result = PTOUCH_E_PRINTER;
+			return;
+		}
+		// phase changes and notifications, wait on.
+	}
+	if (ms_now() - g_print_start > PTOUCH_PRINT_MS)
+	{
+		printf("WARNING: no printed reply from the printer\n");
+		status_read_abort();
+		g_printing = false;
+		g_print_result = PTOUCH_E_TIMEOUT;
+		return;
+	}
+	if (!g_in_busy && !g_in_done)
+		status_read_start();
+}
+
+// waits until the last label is printed, or failed.
+static void print_wait(void)
+{
+	while (g_printing && g_ready)
+	{
+		tuh_task();
+		ptouch_poll();
+	}
+}
+
+// waits until the last label is printed. Returns 0, PTOUCH_E_PRINTER if it failed in print, e.g. tape out
+// or cover opened, or another PTOUCH_E_*. Without a status endpoint, a label counts as printed when sent.
+int ptouch_printed(void)
+{
+	print_wait();
+	return g_printing ? PTOUCH_E_NO_PRINTER : g_print_result;
+}
+
+// asks the printer for its status. Returns 0, PTOUCH_E_PRINTER if it reports an error, or another PTOUCH_E_*.
+int ptouch_status(struct ptouch_status *st)
+{
+	if (!g_ready)
+		return PTOUCH_E_NO_PRINTER;
+	if (!g_ep_in)
+		return PTOUCH_E_TIMEOUT;
+	print_wait();		// the read of the printed reply is done now.
+	memcpy(xbuf.req, ptouch_status_request, sizeof(ptouch_status_request));
+	if (!bulk_out_sync(xbuf.req, sizeof(ptouch_status_request), PTOUCH_STATUS_MS))
+		return PTOUCH_E_TIMEOUT;
+
+	// unasked replies may come first.
+	uint32_t start = ms_now();
+	status_read_start();
+	for (;;)
+	{
+		tuh_task();
+		int r = status_read_take();
+		if (r > 0 && g_status.status_type == PTOUCH_ST_REPLY)
+			break;
+		if (r != 0)
+			status_read_start();
+		if (ms_now() - start > PTOUCH_STATUS_MS)
+		{
+			status_read_abort();
+			return PTOUCH_E_TIMEOUT;
+		}
+	}
+	if (st)
+		*st = g_status;
+	return ptouch_status_error(&g_status) ? PTOUCH_E_PRINTER : 0;
+}
+
+// the status of the last reply, NULL if there was none yet.
+const struct ptouch_status *ptouch_last_status(void)
+{
+	return g_status_valid ? &g_status : NULL;
 }
 
 int ptouch_write(const void *buf, uint32_t len)
 {
-    // You can chunk to 64 bytes if desired, but TinyUSB will do it internally.
-    if (!bulk_out_sync(buf, len, 2000)) {
-        return -1;
+    // in chunks, a stalled printer is noticed after PTOUCH_OUT_MS, not at the end of a long label.
+    if (!g_ready)
+        return PTOUCH_E_NO_PRINTER;
+    for (uint32_t o = 0; o < len; o += PTOUCH_CHUNK) {
+        uint32_t n = (len - o > PTOUCH_CHUNK) ? PTOUCH_CHUNK : len - o;
+        if (!bulk_out_sync((const uint8_t *)buf + o, n, PTOUCH_OUT_MS))
+            return PTOUCH_E_TIMEOUT;
     }
     return (int)len;
 }
 
+/*
+ * prints one label stream of ptouch_encode(). Waits for the last label to be
+ * printed, then asks for the status first, so that a tape out or an open
+ * cover stops the job before anything is sent. Returns 0 when the label is
+ * sent, its printed reply is collected by ptouch_poll(), ptouch_printed()
+ * waits for it. Else PTOUCH_E_*.
+ */
+int ptouch_print(const uint8_t *stream, uint32_t len)
+{
+	int ret;
+	if (!g_ready)
+		return PTOUCH_E_NO_PRINTER;
+	if (g_ep_in && (ret = ptouch_status(NULL)))
+		return ret;
+	if ((ret = ptouch_write(stream, len)) != (int)len)
+	{
+		// the printer stops taking data on an error, find out which.
+		if (g_ep_in && ptouch_status(NULL) == PTOUCH_E_PRINTER)
+			return PTOUCH_E_PRINTER;
+		return (ret < 0) ? ret : PTOUCH_E_TIMEOUT;
+	}
+	g_print_result = 0;
+	if (g_ep_in)
+	{
+		g_printing = true;
+		g_print_start = ms_now();
+		status_read_start();
+	}
+	return 0;
+}
+
 void ptouch_close(void)
 {
     // Optional: you can force a reset or just leave it to USB unplug.
+    print_wait();
+    status_read_abort();
 }
 
 /*
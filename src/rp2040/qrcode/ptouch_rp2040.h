@@ -0,0 +1,26 @@
+/*
+ * ptouch_rp2040.h -- libptouch-like API of the TinyUSB host backend, see ptouch_rp2040.c
+ */
+#ifndef PTOUCH_RP2040_H
+#define PTOUCH_RP2040_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "tusb.h"		// Includes tusb_config.h
+#include "../../sfm_ptouch.h"
+
+#define PTOUCH_STATUS_MS	500	// answer to ESC i S
+#define PTOUCH_PRINT_MS		15000	// printed reply after the print command, a long label takes a while.
+
+void ptouch_init(void);
+int ptouch_open(void);
+bool ptouch_ready(void);
+int ptouch_write(const void *buf, uint32_t len);
+int ptouch_status(struct ptouch_status *st);
+int ptouch_print(const uint8_t *stream, uint32_t len);
+int ptouch_printed(void);
+void ptouch_poll(void);
+const struct ptouch_status *ptouch_last_status(void);
+void ptouch_close(void);
+
+#endif // PTOUCH_RP2040_H
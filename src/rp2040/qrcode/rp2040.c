@@ -1,4 +1,12 @@
 #include "rp2040.h"
+#include "hardware/clocks.h"
+#include "hardware/vreg.h"
+
+#define SYS_KHZ		125000		// clk_sys of the SDK
+
+#if SFM_BOOST_KHZ > 250000
+# error "SFM_BOOST_KHZ: the flash runs at clk_sys / 2, it takes at most 133 MHz"
+#endif
 
 // compatibility layer
 int32_t getrandom(uint32_t *r, size_t n, int _unused)
@@ -34,3 +42,36 @@ bool __no_inline_not_in_flash_func(get_bootsel_button)() {
     restore_interrupts(flags);
     return button_state;
 }
+
+
+/*
+ * Clock boost while a label is rendered, SFM_BOOST_KHZ. clk_peri runs from
+ * pll_usb at 48 MHz, not from clk_sys, so that the uarts keep their baud rate
+ * when clk_sys changes. Called before the uarts are set up. USB, the timer and
+ * sleep_ms() do not depend on clk_sys.
+ */
+void rp2040_clock_init(void)
+{
+#if SFM_BOOST_KHZ
+	if (SFM_BOOST_KHZ > 200000)
+	{
+		vreg_set_voltage(VREG_VOLTAGE_1_15);
+		sleep_ms(1);
+	}
+	clock_configure(clk_peri, 0, CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB, 48 * MHZ, 48 * MHZ);
+#endif
+}
+
+
+// clk_sys to SFM_BOOST_KHZ, or back to SYS_KHZ. The pll relocks, see the timing of button_label().
+void rp2040_boost(bool on)
+{
+#if SFM_BOOST_KHZ
+	set_sys_clock_khz(on ? SFM_BOOST_KHZ : SYS_KHZ, true);
+	// depending on the SDK version, set_sys_clock_khz() takes clk_peri along.
+	if (clock_get_hz(clk_peri) != 48 * MHZ)
+		clock_configure(clk_peri, 0, CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB, 48 * MHZ, 48 * MHZ);
+#else
+	(void)on;
+#endif
+}
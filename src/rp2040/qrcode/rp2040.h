@@ -8,3 +8,14 @@ int32_t getrandom(uint32_t *r, size_t n, int flags);
 
 bool get_bootsel_button();
 
+// build options, see CMakeLists.txt
+#ifndef SFM_SRAM
+# define SFM_SRAM	0		// render loops and fonts in SRAM
+#endif
+#ifndef SFM_BOOST_KHZ
+# define SFM_BOOST_KHZ	0		// clk_sys while rendering, 0: no boost
+#endif
+
+void rp2040_clock_init(void);
+void rp2040_boost(bool on);
+
@@ -0,0 +1,99 @@
+/*
+ * station_uart.c -- DMA driven uart for the binary job protocol (sfm_station.h)
+ *
+ * Receive: one DMA channel copies every byte from the uart into a ring buffer,
+ * the write address wraps in hardware. The cpu only compares the DMA write
+ * address with its read position, no interrupt per byte, and nothing is lost
+ * while a label is rendered, as long as the host respects the queue window.
+ *
+ * Transmit: two buffers, a frame is copied into the idle one and sent by DMA
+ * while the next frame is built. Raster dumps go out at full baud.
+ */
+
+#include "station_uart.h"
+#include "pico/stdlib.h"
+#include "hardware/uart.h"
+#include "hardware/dma.h"
+#include <string.h>
+
+#define STATION_TX_BUF	512
+
+static uint8_t rx_ring[STATION_RING_SIZE] __attribute__((aligned(STATION_RING_SIZE)));
+static unsigned rx_pos = 0;
+static int rx_chan = -1, tx_chan = -1;
+static uint8_t tx_buf[2][STATION_TX_BUF];
+static unsigned tx_idx = 0;
+
+
+// wr: where the next byte goes.
+static void rx_start(uint8_t *wr)
+{
+	dma_channel_config c = dma_channel_get_default_config(rx_chan);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+	channel_config_set_read_increment(&c, false);
+	channel_config_set_write_increment(&c, true);
+	channel_config_set_ring(&c, true, STATION_RING_BITS);	// wrap the write address
+	channel_config_set_dreq(&c, uart_get_dreq(STATION_UART, false));
+	dma_channel_configure(rx_chan, &c, wr, &uart_get_hw(STATION_UART)->dr, 0xffffffff, true);
+}
+
+
+void station_uart_init(void)
+{
+	gpio_set_function(STATION_TX_PIN, GPIO_FUNC_UART);
+	gpio_set_function(STATION_RX_PIN, GPIO_FUNC_UART);
+	uart_init(STATION_UART, STATION_BAUD);
+	uart_set_hw_flow(STATION_UART, false, false);
+	uart_set_format(STATION_UART, 8, 1, UART_PARITY_NONE);
+	uart_set_fifo_enabled(STATION_UART, true);
+
+	rx_chan = dma_claim_unused_channel(true);
+	tx_chan = dma_claim_unused_channel(true);
+	rx_start(rx_ring);
+}
+
+
+// copies what arrived since the last call, at most max bytes.
+unsigned station_uart_read(uint8_t *buf, unsigned max)
+{
+	// 2^32 bytes are 13 hours at 921600 baud, then the channel stops. The uart fifo covers the restart.
+	// It continues at its last write address, the bytes from rx_pos up to there are not read yet.
+	if (!dma_channel_is_busy(rx_chan))
+		rx_start((uint8_t *)(uintptr_t)dma_channel_hw_addr(rx_chan)->write_addr);
+
+	unsigned wr = (uintptr_t)dma_channel_hw_addr(rx_chan)->write_addr - (uintptr_t)rx_ring;
+	unsigned n = 0;
+	while (rx_pos != wr && n < max)
+	{
+		unsigned chunk = ((wr > rx_pos) ? wr : STATION_RING_SIZE) - rx_pos;
+		if (chunk > max - n)
+			chunk = max - n;
+		memcpy(buf + n, rx_ring + rx_pos, chunk);
+		n += chunk;
+		rx_pos = (rx_pos + chunk) & (STATION_RING_SIZE - 1);
+	}
+	return n;
+}
+
+
+// the copy into the idle buffer overlaps with the transfer of the previous frame.
+void station_uart_write(const void *buf, unsigned len)
+{
+	while (len)
+	{
+		unsigned chunk = (len > STATION_TX_BUF) ? STATION_TX_BUF : len;
+		memcpy(tx_buf[tx_idx], buf, chunk);
+		dma_channel_wait_for_finish_blocking(tx_chan);
+
+		dma_channel_config c = dma_channel_get_default_config(tx_chan);
+		channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+		channel_config_set_read_increment(&c, true);
+		channel_config_set_write_increment(&c, false);
+		channel_config_set_dreq(&c, uart_get_dreq(STATION_UART, true));
+		dma_channel_configure(tx_chan, &c, &uart_get_hw(STATION_UART)->dr, tx_buf[tx_idx], chunk, true);
+
+		tx_idx ^= 1;
+		buf = (const uint8_t *)buf + chunk;
+		len -= chunk;
+	}
+}
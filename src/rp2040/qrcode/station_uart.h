@@ -0,0 +1,23 @@
+#ifndef STATION_UART_H
+#define STATION_UART_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// uart0 on GP0 (TX, pin 1) and GP1 (RX, pin 2), stdio stays on uart1.
+#ifndef STATION_UART
+# define STATION_UART		uart0
+# define STATION_TX_PIN		0
+# define STATION_RX_PIN		1
+#endif
+#ifndef STATION_BAUD
+# define STATION_BAUD		921600
+#endif
+#define STATION_RING_BITS	14	// 16k receive ring, holds a full job queue.
+#define STATION_RING_SIZE	(1u << STATION_RING_BITS)
+
+void station_uart_init(void);
+unsigned station_uart_read(uint8_t *buf, unsigned max);
+void station_uart_write(const void *buf, unsigned len);
+
+#endif // STATION_UART_H
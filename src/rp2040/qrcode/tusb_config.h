@@ -30,6 +30,10 @@
 
 // Buffer sizes
 #define CFG_TUH_HUB                 0
+
+// the printer endpoints are opened by ptouch_rp2040.c itself, no class driver.
+#define CFG_TUH_API_EDPT_XFER       1
+#define CFG_TUH_ENUMERATION_BUFSIZE 256	// room for the configuration descriptor
 #define CFG_TUSB_HOST_HID_MAX_REPORT 64
 
 // Memory optimization
@@ -0,0 +1,202 @@
+/*
+ * uid_pool.c -- pre-generated uids in flash, for the label station.
+ *
+ * Two banks of 64k at the end of flash, the one with the valid header and the
+ * higher generation is active. An upload erases the other bank, programs the
+ * uids page by page and writes the header last, so that a power loss during
+ * an upload leaves the old pool active.
+ *
+ * Bank layout:
+ *	page 0		struct pool_hdr
+ *	pages 1..	bitmap of used uids, bit i of the bitmap is cleared when uid i is taken
+ *	sector 1..15	the uids, 8 bytes each
+ *
+ * Flash bits can go from 1 to 0 without an erase, so taking a uid programs
+ * one page that clears one bit. The bitmap is only erased with its bank, on
+ * the next upload, and the banks take turns. The bit is cleared before the
+ * label is rendered: after a power loss the next free uid is found again
+ * from the bitmap, a uid may get lost, but none is printed twice.
+ */
+
+#include "uid_pool.h"
+#include "../../sfm_station.h"
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include <stddef.h>	// offsetof
+#include <stdio.h>
+#include <string.h>
+
+#define POOL_MAGIC		"SFMPOOL1"
+#define POOL_BANK_SIZE		(64 * 1024)
+#define POOL_FLASH_OFFS		(PICO_FLASH_SIZE_BYTES - 2 * POOL_BANK_SIZE)
+#define POOL_BITMAP_OFFS	FLASH_PAGE_SIZE
+#define POOL_UID_OFFS		FLASH_SECTOR_SIZE
+#define POOL_MAX		((POOL_BANK_SIZE - POOL_UID_OFFS) / 8)
+
+_Static_assert(POOL_MAX == STATION_POOL_MAX, "STATION_POOL_MAX does not match the flash layout");
+_Static_assert(POOL_BITMAP_OFFS + POOL_MAX / 8 <= POOL_UID_OFFS, "the bitmap does not fit");
+_Static_assert(STATION_POOL_CHUNK * 8 == FLASH_PAGE_SIZE, "POOL_DATA must be one flash page");
+
+struct pool_hdr {
+	char magic[8];
+	uint32_t generation;
+	uint32_t count;
+	uint16_t crc;			// of the uids
+	uint16_t hdr_crc;		// of the fields above
+};
+
+extern char __flash_binary_end;		// from the linker script
+
+static uint32_t active_offs = 0;	// 0: no pool
+static uint32_t active_count = 0, active_used = 0, active_gen = 0;
+static uint32_t load_offs = 0, load_count = 0, load_next = 0;	// load_offs 0: no upload
+
+
+static inline const uint8_t *pool_ptr(uint32_t offs)
+{
+	return (const uint8_t *)(XIP_BASE + offs);
+}
+
+
+static uint16_t pool_hdr_crc(const struct pool_hdr *h)
+{
+	return station_crc16(0xffff, (const uint8_t *)h, offsetof(struct pool_hdr, hdr_crc));
+}
+
+
+static void pool_program(uint32_t offs, const uint8_t *page)
+{
+	uint32_t flags = save_and_disable_interrupts();
+	flash_range_program(offs, page, FLASH_PAGE_SIZE);
+	restore_interrupts(flags);
+}
+
+
+// returns the generation of a valid bank, or 0.
+static uint32_t pool_check(uint32_t offs)
+{
+	const struct pool_hdr *h = (const struct pool_hdr *)pool_ptr(offs);
+	if (memcmp(h->magic, POOL_MAGIC, sizeof(h->magic)) || h->count > POOL_MAX || h->hdr_crc != pool_hdr_crc(h))
+		return 0;
+	if (h->crc != station_crc16(0xffff, pool_ptr(offs + POOL_UID_OFFS), h->count * 8))
+		return 0;
+	return h->generation;
+}
+
+
+void uid_pool_init(void)
+{
+	if ((uintptr_t)&__flash_binary_end > XIP_BASE + POOL_FLASH_OFFS)
+	{
+		printf("ERROR: the firmware overlaps the uid pool, no pool.\n");
+		return;
+	}
+	uint32_t g0 = pool_check(POOL_FLASH_OFFS);
+	uint32_t g1 = pool_check(POOL_FLASH_OFFS + POOL_BANK_SIZE);
+	if (!g0 && !g1)
+		return;
+	active_offs = POOL_FLASH_OFFS + ((g1 > g0) ? POOL_BANK_SIZE : 0);
+	active_gen = (g1 > g0) ? g1 : g0;
+	active_count = ((const struct pool_hdr *)pool_ptr(active_offs))->count;
+
+	// the used uids are a run of cleared bits from the start of the bitmap.
+	const uint8_t *bm = pool_ptr(active_offs + POOL_BITMAP_OFFS);
+	unsigned i = 0;
+	while (i < POOL_MAX / 8 && bm[i] == 0)
+		i++;
+	active_used = i * 8 + ((i < POOL_MAX / 8) ? __builtin_ctz(bm[i]) : 0);
+	if (active_used > active_count)
+		active_used = active_count;
+#if DEBUG > 0
+	printf("uid pool: generation %u, %u of %u used\n", active_gen, active_used, active_count);
+#endif
+}
+
+
+// Returns 0 with the next uid, 1 if there is no pool, -1 if all its uids are used.
+int uid_pool_take(uint64_t *uid)
+{
+	uint8_t page[FLASH_PAGE_SIZE];
+
+	if (!active_offs)
+		return 1;
+	if (active_used >= active_count)
+		return -1;
+	uint32_t byte = active_used / 8;
+	memset(page, 0xff, sizeof(page));
+	page[byte % FLASH_PAGE_SIZE] = ~(1u << (active_used % 8));
+	pool_program(active_offs + POOL_BITMAP_OFFS + byte / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE, page);
+
+	memcpy(uid, pool_ptr(active_offs + POOL_UID_OFFS) + active_used * 8, 8);
+	active_used++;
+	return 0;
+}
+
+
+void uid_pool_status(uint32_t *count, uint32_t *used)
+{
+	*count = active_count;
+	*used = active_used;
+}
+
+
+// erases the spare bank. Takes a while, the host waits for the ACK.
+int uid_pool_begin(uint32_t count)
+{
+	if (!count || count > POOL_MAX || (uintptr_t)&__flash_binary_end > XIP_BASE + POOL_FLASH_OFFS)
+		return -1;
+	load_offs = (active_offs == POOL_FLASH_OFFS) ? POOL_FLASH_OFFS + POOL_BANK_SIZE : POOL_FLASH_OFFS;
+	load_count = count;
+	load_next = 0;
+	uint32_t flags = save_and_disable_interrupts();
+	flash_range_erase(load_offs, POOL_BANK_SIZE);
+	restore_interrupts(flags);
+	return 0;
+}
+
+
+// chunks come in order. A repeated chunk, when our ACK got lost, is accepted again.
+int uid_pool_data(uint32_t index, const uint64_t *uids, unsigned n)
+{
+	uint8_t page[FLASH_PAGE_SIZE];
+
+	if (!load_offs || index % STATION_POOL_CHUNK || n > STATION_POOL_CHUNK || index + n > load_count)
+		return -1;
+	if (index + n <= load_next)
+		return 0;
+	if (index != load_next || (n < STATION_POOL_CHUNK && index + n != load_count))
+		return -1;
+	memset(page, 0xff, sizeof(page));
+	memcpy(page, uids, n * 8);
+	pool_program(load_offs + POOL_UID_OFFS + index * 8, page);
+	load_next += n;
+	return 0;
+}
+
+
+int uid_pool_commit(uint16_t crc)
+{
+	uint8_t page[FLASH_PAGE_SIZE];
+	struct pool_hdr h;
+
+	if (!load_offs || load_next != load_count ||
+	    crc != station_crc16(0xffff, pool_ptr(load_offs + POOL_UID_OFFS), load_count * 8))
+		return -1;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, POOL_MAGIC, sizeof(h.magic));
+	h.generation = active_gen + 1;
+	h.count = load_count;
+	h.crc = crc;
+	h.hdr_crc = pool_hdr_crc(&h);
+	memset(page, 0xff, sizeof(page));
+	memcpy(page, &h, sizeof(h));
+	pool_program(load_offs, page);
+
+	active_offs = load_offs;
+	active_gen = h.generation;
+	active_count = load_count;
+	active_used = 0;
+	load_offs = 0;
+	return 0;
+}
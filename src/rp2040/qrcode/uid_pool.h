@@ -0,0 +1,10 @@
+#include <stdint.h>
+
+// uids uploaded from the host registry, kept in the last 128k of flash. See uid_pool.c
+void uid_pool_init(void);
+int uid_pool_take(uint64_t *uid);
+void uid_pool_status(uint32_t *count, uint32_t *used);
+
+int uid_pool_begin(uint32_t count);
+int uid_pool_data(uint32_t index, const uint64_t *uids, unsigned n);
+int uid_pool_commit(uint16_t crc);
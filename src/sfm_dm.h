@@ -0,0 +1,414 @@
+/*
+ * sfm_dm.h -- Data Matrix ECC 200 geometry, shared by the encoder and the
+ * raster verification in shelfman-qrcode. Follows ISO/IEC 16022.
+ *
+ * Only the symbols with a single Reed-Solomon block, up to 44x44 modules, and
+ * the ASCII and C40 encodations. Our upper case payloads need 21 codewords at
+ * most, a 12x36 rectangle fits on 6 mm tape.
+ *
+ * dm_init() prepares the order of the data modules and the Reed-Solomon
+ * generator of one symbol in the static df. Module arrays are rows * cols
+ * bytes, row by row, 1 = dark, finder patterns included.
+ */
+#ifndef SFM_DM_H
+#define SFM_DM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define DM_MAX_ROWS		44
+#define DM_MAX_COLS		48
+#define DM_MAX_MAPPING		(40 * 40)	// data modules of the largest symbol
+#define DM_MAX_CODEWORDS	200
+#define DM_MAX_ECC		56
+
+#define DM_PAD			129
+#define DM_LATCH_C40		230
+#define DM_UNLATCH		254
+
+#ifndef QF_STORAGE
+# define QF_STORAGE static
+#endif
+
+struct dm_symbol {
+	uint8_t rows, cols;			// modules, finder patterns included
+	uint8_t region_rows, region_cols;	// data modules of one region
+	uint8_t data_cw, ecc_cw;
+};
+
+// ascending by data codewords.
+static const struct dm_symbol dm_symbols[] = {
+	{ 10, 10,  8,  8,   3,  5 },
+	{ 12, 12, 10, 10,   5,  7 },
+	{  8, 18,  6, 16,   5,  7 },
+	{ 14, 14, 12, 12,   8, 10 },
+	{  8, 32,  6, 14,  10, 11 },
+	{ 16, 16, 14, 14,  12, 12 },
+	{ 12, 26, 10, 24,  16, 14 },
+	{ 18, 18, 16, 16,  18, 14 },
+	{ 20, 20, 18, 18,  22, 18 },
+	{ 12, 36, 10, 16,  22, 18 },
+	{ 22, 22, 20, 20,  30, 20 },
+	{ 16, 36, 14, 16,  32, 24 },
+	{ 24, 24, 22, 22,  36, 24 },
+	{ 26, 26, 24, 24,  44, 28 },
+	{ 16, 48, 14, 22,  49, 28 },
+	{ 32, 32, 14, 14,  62, 36 },
+	{ 36, 36, 16, 16,  86, 42 },
+	{ 40, 40, 18, 18, 114, 48 },
+	{ 44, 44, 20, 20, 144, 56 },
+};
+#define DM_NUM_SYMBOLS	(sizeof(dm_symbols) / sizeof(dm_symbols[0]))
+
+QF_STORAGE struct {
+	const struct dm_symbol *sym;		// NULL: not initialized
+	unsigned nrow, ncol;			// mapping matrix, the data regions without finder patterns
+	unsigned corner;			// the 4 modules at the bottom right are not used, fixed pattern.
+	uint8_t rs_gen[DM_MAX_ECC];
+	uint16_t order[DM_MAX_CODEWORDS * 8];	// mapping matrix index of each data bit
+} df;
+
+
+// GF(256) with the Data Matrix polynomial x^8 + x^5 + x^3 + x^2 + 1
+static inline uint8_t dm_gf_mul(uint8_t x, uint8_t y)
+{
+	uint8_t z = 0;
+	for (int i = 7; i >= 0; i--)
+	{
+		z = (uint8_t)((z << 1) ^ ((z >> 7) * 0x12D));
+		z ^= ((y >> i) & 1) * x;
+	}
+	return z;
+}
+
+
+// the ecc codewords of the data, df.sym->ecc_cw of them.
+static inline void dm_rs_remainder(const uint8_t *dat, unsigned len, uint8_t *ecc)
+{
+	unsigned n = df.sym->ecc_cw;
+	memset(ecc, 0, n);
+	for (unsigned j = 0; j < len; j++)
+	{
+		uint8_t factor = dat[j] ^ ecc[0];
+		memmove(ecc, ecc + 1, n - 1);
+		ecc[n - 1] = 0;
+		for (unsigned l = 0; l < n; l++)
+			ecc[l] ^= dm_gf_mul(df.rs_gen[l], factor);
+	}
+}
+
+
+// placement of the codeword bits, ISO/IEC 16022 annex F. Bit 0 is the MSB.
+static inline void dm_module(uint16_t *m, int row, int col, unsigned cw, unsigned bit)
+{
+	int nrow = df.nrow, ncol = df.ncol;
+	if (row < 0)
+	{
+		row += nrow;
+		col += 4 - ((nrow + 4) % 8);
+	}
+	if (col < 0)
+	{
+		col += ncol;
+		row += 4 - ((ncol + 4) % 8);
+	}
+	m[row * ncol + col] = cw * 8 + bit + 1;
+}
+
+
+static inline void dm_utah(uint16_t *m, int r, int c, unsigned cw)
+{
+	static const int8_t d[8][2] = { {-2,-2}, {-2,-1}, {-1,-2}, {-1,-1}, {-1,0}, {0,-2}, {0,-1}, {0,0} };
+	for (unsigned b = 0; b < 8; b++)
+		dm_module(m, r + d[b][0], c + d[b][1], cw, b);
+}
+
+
+// the 4 corner cases, positions relative to nrow and ncol when negative.
+static inline void dm_corner(uint16_t *m, unsigned which, unsigned cw)
+{
+	static const int8_t d[4][8][2] = {
+		{ {-1,0}, {-1,1}, {-1,2}, {0,-2}, {0,-1}, {1,-1}, {2,-1}, {3,-1} },
+		{ {-3,0}, {-2,0}, {-1,0}, {0,-4}, {0,-3}, {0,-2}, {0,-1}, {1,-1} },
+		{ {-3,0}, {-2,0}, {-1,0}, {0,-2}, {0,-1}, {1,-1}, {2,-1}, {3,-1} },
+		{ {-1,0}, {-1,-1}, {0,-3}, {0,-2}, {0,-1}, {1,-3}, {1,-2}, {1,-1} },
+	};
+	for (unsigned b = 0; b < 8; b++)
+	{
+		int r = d[which][b][0], c = d[which][b][1];
+		dm_module(m, (r < 0) ? (int)df.nrow + r : r, (c < 0) ? (int)df.ncol + c : c, cw, b);
+	}
+}
+
+
+static inline void dm_init(const struct dm_symbol *s)
+{
+	uint16_t m[DM_MAX_MAPPING];
+	unsigned cw = 0;
+
+	df.sym = s;
+	df.nrow = s->rows - 2 * (s->rows / (s->region_rows + 2));
+	df.ncol = s->cols - 2 * (s->cols / (s->region_cols + 2));
+	int nrow = df.nrow, ncol = df.ncol;
+
+	memset(m, 0, sizeof(m));
+	int row = 4, col = 0;
+	do
+	{
+		if (row == nrow && col == 0)
+			dm_corner(m, 0, cw++);
+		if (row == nrow - 2 && col == 0 && ncol % 4)
+			dm_corner(m, 1, cw++);
+		if (row == nrow - 2 && col == 0 && ncol % 8 == 4)
+			dm_corner(m, 2, cw++);
+		if (row == nrow + 4 && col == 2 && !(ncol % 8))
+			dm_corner(m, 3, cw++);
+		do
+		{
+			if (row < nrow && col >= 0 && !m[row * ncol + col])
+				dm_utah(m, row, col, cw++);
+			row -= 2;
+			col += 2;
+		} while (row >= 0 && col < ncol);
+		row += 1;
+		col += 3;
+		do
+		{
+			if (row >= 0 && col < ncol && !m[row * ncol + col])
+				dm_utah(m, row, col, cw++);
+			row += 2;
+			col -= 2;
+		} while (row < nrow && col >= 0);
+		row += 3;
+		col += 1;
+	} while (row < nrow || col < ncol);
+
+	df.corner = !m[nrow * ncol - 1];
+	for (int i = 0; i < nrow * ncol; i++)
+		if (m[i])
+			df.order[m[i] - 1] = i;
+
+	// generator with the roots a^1 .. a^n
+	unsigned n = s->ecc_cw;
+	uint8_t root = 2;
+	memset(df.rs_gen, 0, sizeof(df.rs_gen));
+	df.rs_gen[n - 1] = 1;
+	for (unsigned i = 0; i < n; i++)
+	{
+		for (unsigned j = 0; j < n; j++)
+		{
+			df.rs_gen[j] = dm_gf_mul(df.rs_gen[j], root);
+			if (j + 1 < n)
+				df.rs_gen[j] ^= df.rs_gen[j + 1];
+		}
+		root = dm_gf_mul(root, 0x02);
+	}
+}
+
+
+// 1 if the module at row, col of the symbol is part of a finder pattern, *dark gets its color.
+static inline unsigned dm_finder(const struct dm_symbol *s, unsigned row, unsigned col, uint8_t *dark)
+{
+	unsigned r = row % (s->region_rows + 2), c = col % (s->region_cols + 2);
+	if (c == 0 || r == s->region_rows + 1u)
+		*dark = 1;
+	else if (r == 0)
+		*dark = !(c & 1);
+	else if (c == s->region_cols + 1u)
+		*dark = r & 1;
+	else
+		return 0;
+	return 1;
+}
+
+
+// mapping matrix index -> module index of the symbol.
+static inline unsigned dm_symbol_pos(const struct dm_symbol *s, unsigned i)
+{
+	unsigned r = i / df.ncol, c = i % df.ncol;
+	r += 1 + 2 * (r / s->region_rows);
+	c += 1 + 2 * (c / s->region_cols);
+	return r * s->cols + c;
+}
+
+
+// C40 value of a character, +40 for the shift 2 set. -1 if it has none here.
+static inline int dm_c40_value(char ch)
+{
+	static const char shift2[] = "!\"#$%&'()*+,-./:;<=>?@[\\]^_";
+	if (ch == ' ')
+		return 3;
+	if (ch >= '0' && ch <= '9')
+		return ch - '0' + 4;
+	if (ch >= 'A' && ch <= 'Z')
+		return ch - 'A' + 14;
+	const char *p = ch ? strchr(shift2, ch) : NULL;
+	return p ? 40 + (int)(p - shift2) : -1;
+}
+
+
+// ASCII encodation, digit pairs in one codeword. Returns the number of codewords, -1 if a character is not ASCII.
+static inline int dm_encode_ascii(const char *text, unsigned len, uint8_t *cw)
+{
+	unsigned n = 0;
+	for (unsigned i = 0; i < len; i++)
+	{
+		unsigned char ch = text[i];
+		if (ch > 127)
+			return -1;
+		if (ch >= '0' && ch <= '9' && i + 1 < len && text[i + 1] >= '0' && text[i + 1] <= '9')
+		{
+			cw[n++] = 130 + (ch - '0') * 10 + (text[i + 1] - '0');
+			i++;
+		}
+		else
+			cw[n++] = ch + 1;
+	}
+	return n;
+}
+
+
+/*
+ * C40 encodation, 3 values in 2 codewords, upper case and digits take one
+ * value, '-' two. The characters after the last complete triple are encoded
+ * in ASCII after an unlatch. Returns the number of codewords, -1 if C40 does
+ * not apply; *c40_at_end is set if the data ends in C40, see dm_pad().
+ */
+static inline int dm_encode_c40(const char *text, unsigned len, uint8_t *cw, unsigned *c40_at_end)
+{
+	uint8_t v[3 * DM_MAX_CODEWORDS / 2 + 2];
+	unsigned nv = 0, nv_done = 0, done = 0, n = 0;
+
+	cw[n++] = DM_LATCH_C40;
+	for (unsigned i = 0; i < len; i++)
+	{
+		int c = dm_c40_value(text[i]);
+		if (c < 0 || nv + 2 > sizeof(v))
+			return -1;
+		if (c >= 40)
+			v[nv++] = 1;		// shift 2
+		v[nv++] = c % 40;
+		if (nv % 3 == 0)
+		{
+			done = i + 1;		// characters in complete triples, shifts never straddle them.
+			nv_done = nv;
+		}
+	}
+	for (unsigned k = 0; k < nv_done; k += 3)
+	{
+		unsigned val = 1600 * v[k] + 40 * v[k + 1] + v[k + 2] + 1;
+		cw[n++] = val >> 8;
+		cw[n++] = val & 0xff;
+	}
+	*c40_at_end = (done == len);
+	if (done < len)
+	{
+		cw[n++] = DM_UNLATCH;
+		int k = dm_encode_ascii(text + done, len - done, cw + n);
+		if (k < 0)
+			return -1;
+		n += k;
+	}
+	return n;
+}
+
+
+// the shorter of both encodations into cw. Returns the number of codewords, or -1.
+static inline int dm_encode_text(const char *text, uint8_t *cw, unsigned *c40_at_end)
+{
+	uint8_t c40[2 * DM_MAX_CODEWORDS];
+	unsigned len = strlen(text), at_end = 0;
+	if (len > DM_MAX_CODEWORDS)
+		return -1;
+	int n = dm_encode_ascii(text, len, cw);
+	int k = dm_encode_c40(text, len, c40, &at_end);
+	*c40_at_end = 0;
+	if (k > 0 && (n < 0 || k < n))
+	{
+		memcpy(cw, c40, k);
+		*c40_at_end = at_end;
+		n = k;
+	}
+	return n;
+}
+
+
+// fills the symbol capacity with pad codewords, the 253-state randomized ones after the first.
+static inline void dm_pad(uint8_t *cw, unsigned n, unsigned c40_at_end, unsigned capacity)
+{
+	if (n < capacity && c40_at_end)
+		cw[n++] = DM_UNLATCH;
+	for (unsigned first = 1; n < capacity; n++, first = 0)
+	{
+		unsigned r = 129 + ((149 * (n + 1)) % 253) + 1;
+		cw[n] = first ? DM_PAD : (r > 254 ? r - 254 : r);
+	}
+}
+
+
+/*
+ * Decodes the data codewords of the two encodations above into text.
+ * Returns the text length, or -1 for anything else.
+ */
+static inline int dm_decode_text(const uint8_t *cw, unsigned len, char *text)
+{
+	static const char shift2[] = "!\"#$%&'()*+,-./:;<=>?@[\\]^_";
+	unsigned n = 0, c40 = 0;
+	for (unsigned i = 0; i < len; )
+	{
+		if (!c40)
+		{
+			uint8_t c = cw[i++];
+			if (c == DM_PAD)
+				break;
+			if (c >= 1 && c <= 128)
+				text[n++] = c - 1;
+			else if (c >= 130 && c <= 229)
+			{
+				text[n++] = '0' + (c - 130) / 10;
+				text[n++] = '0' + (c - 130) % 10;
+			}
+			else if (c == DM_LATCH_C40)
+				c40 = 1;
+			else
+				return -1;
+			continue;
+		}
+		if (cw[i] == DM_UNLATCH || i + 1 >= len)
+		{
+			// an implied unlatch leaves a single ASCII codeword at the end.
+			c40 = 0;
+			i += (cw[i] == DM_UNLATCH);
+			continue;
+		}
+		unsigned val = (cw[i] << 8 | cw[i + 1]) - 1, shift = 0;
+		uint8_t v[3] = { (uint8_t)(val / 1600), (uint8_t)(val / 40 % 40), (uint8_t)(val % 40) };
+		i += 2;
+		for (unsigned k = 0; k < 3; k++)
+		{
+			if (shift == 2)
+			{
+				if (v[k] >= sizeof(shift2) - 1)
+					return -1;
+				text[n++] = shift2[v[k]];
+				shift = 0;
+			}
+			else if (shift)
+				return -1;
+			else if (v[k] <= 2)
+				shift = v[k] + 1;
+			else if (v[k] == 3)
+				text[n++] = ' ';
+			else if (v[k] <= 13)
+				text[n++] = '0' + v[k] - 4;
+			else
+				text[n++] = 'A' + v[k] - 14;
+		}
+		if (shift > 1)
+			return -1;		// shift 1 as the last value pads a triple.
+	}
+	text[n] = '\0';
+	return n;
+}
+
+#endif // SFM_DM_H
@@ -0,0 +1,97 @@
+/*
+ * sfm_font.h -- packed glyph bitmaps, made from the Adafruit GFX fonts by
+ * fontpack.c at build time (sfm_fonts.h), decoded row by row while drawing.
+ *
+ * A glyph is width x height bits, row by row, as in GFXfont. Each row is
+ * XORed with the row above, which leaves only the edges of the strokes, and
+ * the resulting bit stream is stored as alternating runs of 0 and 1 bits,
+ * starting with 0. A run of n is Elias gamma coded as n + 1: k zero bits,
+ * then the k + 1 bits of n + 1, MSB first. About 45% of the raw bitmap for
+ * the 24pt font, less saving for the small ones.
+ *
+ * Glyphs are at most 64 pixels wide, a row is one uint64_t, left aligned.
+ */
+#ifndef SFM_FONT_H
+#define SFM_FONT_H
+
+#include <stdint.h>
+
+#define SFM_FONT_MAX_WIDTH	64
+
+struct sfm_glyph {
+	uint16_t offset;		// byte offset of the packed bits
+	uint8_t width, height;
+	uint8_t xAdvance;
+	int8_t xOffset, yOffset;	// as in GFXglyph
+};
+
+struct sfm_font {
+	const uint8_t *data;
+	const struct sfm_glyph *glyph;
+	uint8_t first, last;
+	uint8_t yAdvance;
+	uint16_t len;			// bytes of data
+};
+
+struct sfm_glyph_reader {
+	const uint8_t *p;
+	uint32_t bit;
+	unsigned w;
+	unsigned val;			// bit value of the current run
+	unsigned left;			// bits left in the current run
+	uint64_t prev;			// last decoded row
+};
+
+
+static inline unsigned sfm_font_bit(struct sfm_glyph_reader *r)
+{
+	unsigned b = (r->p[r->bit >> 3] >> (7 - (r->bit & 7))) & 1;
+	r->bit++;
+	return b;
+}
+
+
+static inline unsigned sfm_font_gamma(struct sfm_glyph_reader *r)
+{
+	unsigned k = 0, v = 1;
+	while (!sfm_font_bit(r))
+		k++;
+	while (k--)
+		v = (v << 1) | sfm_font_bit(r);
+	return v - 1;
+}
+
+
+static inline void sfm_glyph_start(struct sfm_glyph_reader *r, const struct sfm_font *f, const struct sfm_glyph *g)
+{
+	r->p = f->data + g->offset;
+	r->bit = 0;
+	r->w = g->width;
+	r->val = 0;
+	r->left = sfm_font_gamma(r);
+	r->prev = 0;
+}
+
+
+// the next row, left aligned, set bits are ink.
+static inline uint64_t sfm_glyph_row(struct sfm_glyph_reader *r)
+{
+	uint64_t x = 0;
+	for (unsigned pos = 0; pos < r->w; )
+	{
+		while (!r->left)
+		{
+			r->val ^= 1;
+			r->left = sfm_font_gamma(r);
+		}
+		unsigned n = (r->left < r->w - pos) ? r->left : r->w - pos;
+		if (r->val)
+			x |= (~0ULL << (64 - n)) >> pos;
+		pos += n;
+		r->left -= n;
+	}
+	r->prev ^= x;
+	return r->prev;
+}
+
+#endif // SFM_FONT_H
@@ -0,0 +1,105 @@
+/*
+ * sfm_ptouch.h -- status reply of the Brother P-touch printers, shared by the
+ * print dispatcher on linux, the usb backend of the RP2040 and the simulated
+ * printer (ptouch_sim.c).
+ *
+ * The printer answers the status request ESC i S with these 32 bytes. It also
+ * sends them unasked when a label is printed, an error occurs or the phase
+ * changes, see status_type.
+ */
+#ifndef SFM_PTOUCH_H
+#define SFM_PTOUCH_H
+
+#include <stdint.h>
+
+#define PTOUCH_VID		0x04F9	// Brother
+#define PTOUCH_STATUS_LEN	32
+#define PTOUCH_PINS		128	// print head of the D410
+#define PTOUCH_LINE_BYTES	(PTOUCH_PINS / 8)
+
+// ptouch_write(), ptouch_print() of the backends, ptouch_rp2040.c and ptouch_sim.c
+#define PTOUCH_E_NO_PRINTER	-1
+#define PTOUCH_E_PRINTER	-2	// the printer reported an error, see ptouch_last_status()
+#define PTOUCH_E_TIMEOUT	-3
+
+// error1
+#define PTOUCH_E1_NO_MEDIA	0x01
+#define PTOUCH_E1_END_OF_MEDIA	0x02
+#define PTOUCH_E1_CUTTER_JAM	0x04
+#define PTOUCH_E1_WEAK_BATTERY	0x08
+#define PTOUCH_E1_IN_USE	0x10
+#define PTOUCH_E1_TURNED_OFF	0x20
+#define PTOUCH_E1_HIGH_VOLTAGE	0x40
+#define PTOUCH_E1_FAN		0x80
+// error2
+#define PTOUCH_E2_REPLACE_MEDIA	0x01
+#define PTOUCH_E2_BUFFER_FULL	0x02
+#define PTOUCH_E2_COMM		0x04
+#define PTOUCH_E2_COMM_FULL	0x08
+#define PTOUCH_E2_COVER_OPEN	0x10
+#define PTOUCH_E2_OVERHEAT	0x20
+#define PTOUCH_E2_BLACK_MARK	0x40
+#define PTOUCH_E2_SYSTEM	0x80
+
+// status_type
+#define PTOUCH_ST_REPLY		0x00	// answer to ESC i S
+#define PTOUCH_ST_PRINTED	0x01
+#define PTOUCH_ST_ERROR		0x02
+#define PTOUCH_ST_OFF		0x04
+#define PTOUCH_ST_NOTIFY	0x05
+#define PTOUCH_ST_PHASE		0x06
+
+// phase_type
+#define PTOUCH_PHASE_EDIT	0x00	// idle, ready for the next label
+#define PTOUCH_PHASE_PRINT	0x01
+
+struct ptouch_status {
+	uint8_t head_mark;		// 0x80
+	uint8_t size;			// 0x20
+	uint8_t brother;		// 'B'
+	uint8_t series, model;
+	uint8_t country;
+	uint8_t reserved1[2];
+	uint8_t error1, error2;
+	uint8_t media_width;		// mm, 0: no tape
+	uint8_t media_type;
+	uint8_t reserved2[3];
+	uint8_t mode;
+	uint8_t reserved3;
+	uint8_t media_length;
+	uint8_t status_type;
+	uint8_t phase_type;
+	uint8_t phase_hi, phase_lo;
+	uint8_t notification;
+	uint8_t reserved4;
+	uint8_t tape_color, text_color;
+	uint8_t hw_settings[4];
+	uint8_t reserved5[2];
+};
+
+static const uint8_t ptouch_status_request[] = { 0x1b, 0x69, 0x53 };	// ESC i S
+
+
+static inline int ptouch_status_valid(const struct ptouch_status *s)
+{
+	return s->head_mark == 0x80 && s->size == PTOUCH_STATUS_LEN;
+}
+
+
+// NULL if the printer can take the next label, else why not.
+static inline const char *ptouch_status_error(const struct ptouch_status *s)
+{
+	if ((s->error1 & (PTOUCH_E1_NO_MEDIA | PTOUCH_E1_END_OF_MEDIA)) || (s->error2 & PTOUCH_E2_REPLACE_MEDIA))
+		return "tape out";
+	if (s->error2 & PTOUCH_E2_COVER_OPEN)
+		return "cover open";
+	if (s->error1 & PTOUCH_E1_CUTTER_JAM)
+		return "cutter jam";
+	if (s->error1 & (PTOUCH_E1_TURNED_OFF | PTOUCH_E1_HIGH_VOLTAGE | PTOUCH_E1_FAN))
+		return "printer error";
+	if (s->error2 & (PTOUCH_E2_OVERHEAT | PTOUCH_E2_SYSTEM))
+		return "printer error";
+	return NULL;
+}
+
+#endif // SFM_PTOUCH_H
@@ -0,0 +1,376 @@
+/*
+ * sfm_qr.h -- qr-code geometry for versions 1 .. QR_MAX_VERSION, shared by
+ * the fast encoder and the decoders (raster verification in shelfman-qrcode,
+ * photo scanning in shelfman-photos). Follows qrcodegen.c.
+ *
+ * qf_init() prepares the function patterns, the order of the data modules and
+ * the Reed-Solomon generator of one version and ecc level in the static qf.
+ * Module arrays are size * size bytes, row by row, 1 = dark.
+ */
+#ifndef SFM_QR_H
+#define SFM_QR_H
+
+#include <stdint.h>
+#include <stdlib.h>	// abs()
+#include <string.h>
+#include <stdbool.h>
+
+#define QR_MAX_VERSION	10		// 57x57 modules, denser codes need more than 128 dots at 2 dots per module.
+#define QR_FIXED_MAX_SIZE	(17 + 4 * QR_MAX_VERSION)
+#define QR_FIXED_MAX_CODEWORDS	346		// raw codewords of version 10
+#define QR_FIXED_MAX_ECC	30
+
+#ifndef QF_STORAGE
+# define QF_STORAGE static		// "static __thread" for tools that decode in several threads.
+#endif
+
+
+// indexed by ecc level L, M, Q, H and version 1..10
+static const int8_t qr_ecc_codewords_per_block[4][QR_MAX_VERSION+1] = {
+	{ -1,  7, 10, 15, 20, 26, 18, 20, 24, 30, 18 },
+	{ -1, 10, 16, 26, 18, 24, 16, 18, 22, 22, 26 },
+	{ -1, 13, 22, 18, 26, 18, 24, 18, 22, 20, 24 },
+	{ -1, 17, 28, 22, 16, 22, 28, 26, 26, 24, 28 }
+};
+static const int8_t qr_num_ecc_blocks[4][QR_MAX_VERSION+1] = {
+	{ -1,  1,  1,  1,  1,  1,  2,  2,  2,  2,  4 },
+	{ -1,  1,  1,  1,  2,  2,  4,  4,  4,  5,  5 },
+	{ -1,  1,  1,  2,  2,  4,  4,  6,  6,  8,  8 },
+	{ -1,  1,  1,  2,  4,  4,  4,  5,  6,  8,  8 }
+};
+static const uint8_t qr_ecc_format_bits[4] = { 1, 0, 3, 2 };	// L, M, Q, H
+
+QF_STORAGE struct {
+	unsigned version, ecc_level;		// version 0: not initialized
+	unsigned size;
+	unsigned num_blocks, block_ecc_len, raw_codewords, data_codewords;
+	uint8_t rs_gen[QR_FIXED_MAX_ECC];
+	uint8_t base[QR_FIXED_MAX_SIZE * QR_FIXED_MAX_SIZE];		// function patterns, 1 = dark
+	uint8_t is_func[QR_FIXED_MAX_SIZE * QR_FIXED_MAX_SIZE];
+	uint16_t order[QR_FIXED_MAX_CODEWORDS * 8];			// module index of each data bit
+} qf;
+
+
+static inline uint8_t gf256_mul(uint8_t x, uint8_t y)
+{
+	uint8_t z = 0;
+	for (int i = 7; i >= 0; i--)
+	{
+		z = (uint8_t)((z << 1) ^ ((z >> 7) * 0x11D));
+		z ^= ((y >> i) & 1) * x;
+	}
+	return z;
+}
+
+
+// the ecc codewords of one block.
+static inline void qf_rs_remainder(const uint8_t *dat, unsigned len, uint8_t *ecc)
+{
+	memset(ecc, 0, qf.block_ecc_len);
+	for (unsigned j = 0; j < len; j++)
+	{
+		uint8_t factor = dat[j] ^ ecc[0];
+		memmove(ecc, ecc + 1, qf.block_ecc_len - 1);
+		ecc[qf.block_ecc_len - 1] = 0;
+		for (unsigned l = 0; l < qf.block_ecc_len; l++)
+			ecc[l] ^= gf256_mul(qf.rs_gen[l], factor);
+	}
+}
+
+
+static inline unsigned qf_format_bits(unsigned ecc_level, unsigned mask)
+{
+	unsigned data = qr_ecc_format_bits[ecc_level] << 3 | mask;
+	unsigned rem = data;
+	for (int i = 0; i < 10; i++)
+		rem = (rem << 1) ^ ((rem >> 9) * 0x537);
+	return (data << 10 | rem) ^ 0x5412;
+}
+
+
+static inline void qf_set_func(unsigned x, unsigned y, bool dark)
+{
+	qf.base[y * qf.size + x] = dark;
+	qf.is_func[y * qf.size + x] = 1;
+}
+
+
+static inline void qf_draw_format_bits(uint8_t *m, unsigned mask)
+{
+	unsigned size = qf.size;
+	unsigned bits = qf_format_bits(qf.ecc_level, mask);
+
+	for (unsigned i = 0; i <= 5; i++)
+		m[i * size + 8] = (bits >> i) & 1;
+	m[7 * size + 8] = (bits >> 6) & 1;
+	m[8 * size + 8] = (bits >> 7) & 1;
+	m[8 * size + 7] = (bits >> 8) & 1;
+	for (unsigned i = 9; i < 15; i++)
+		m[8 * size + 14 - i] = (bits >> i) & 1;
+	for (unsigned i = 0; i < 8; i++)
+		m[8 * size + size - 1 - i] = (bits >> i) & 1;
+	for (unsigned i = 8; i < 15; i++)
+		m[(size - 15 + i) * size + 8] = (bits >> i) & 1;
+	m[(size - 8) * size + 8] = 1;	// always dark
+}
+
+
+static inline void qf_init(unsigned version, unsigned ecc_level)
+{
+	unsigned size = 17 + 4 * version;
+	memset(&qf, 0, sizeof(qf));
+	qf.size = size;
+	qf.ecc_level = ecc_level;
+
+	unsigned raw_modules = (16 * version + 128) * version + 64;
+	if (version >= 2)
+	{
+		unsigned n = version / 7 + 2;
+		raw_modules -= (25 * n - 10) * n - 55;
+		if (version >= 7)
+			raw_modules -= 36;
+	}
+	qf.raw_codewords = raw_modules / 8;
+	qf.num_blocks = qr_num_ecc_blocks[ecc_level][version];
+	qf.block_ecc_len = qr_ecc_codewords_per_block[ecc_level][version];
+	qf.data_codewords = qf.raw_codewords - qf.num_blocks * qf.block_ecc_len;
+
+	// Reed-Solomon generator polynomial, highest coefficient dropped.
+	qf.rs_gen[qf.block_ecc_len - 1] = 1;
+	uint8_t root = 1;
+	for (unsigned i = 0; i < qf.block_ecc_len; i++)
+	{
+		for (unsigned j = 0; j < qf.block_ecc_len; j++)
+		{
+			qf.rs_gen[j] = gf256_mul(qf.rs_gen[j], root);
+			if (j + 1 < qf.block_ecc_len)
+				qf.rs_gen[j] ^= qf.rs_gen[j + 1];
+		}
+		root = gf256_mul(root, 0x02);
+	}
+
+	// timing patterns
+	for (unsigned i = 0; i < size; i++)
+	{
+		qf_set_func(6, i, i % 2 == 0);
+		qf_set_func(i, 6, i % 2 == 0);
+	}
+
+	// finder patterns with separators
+	const int finder[3][2] = { { 3, 3 }, { (int)size - 4, 3 }, { 3, (int)size - 4 } };
+	for (unsigned f = 0; f < 3; f++)
+	{
+		for (int dy = -4; dy <= 4; dy++)
+		{
+			for (int dx = -4; dx <= 4; dx++)
+			{
+				int x = finder[f][0] + dx, y = finder[f][1] + dy;
+				int dist = abs(dx) > abs(dy) ? abs(dx) : abs(dy);
+				if (x >= 0 && x < (int)size && y >= 0 && y < (int)size)
+					qf_set_func(x, y, dist != 2 && dist != 4);
+			}
+		}
+	}
+
+	// alignment patterns
+	if (version >= 2)
+	{
+		unsigned pos[7], n = version / 7 + 2;
+		unsigned step = (version * 4 + n * 2 + 1) / (n * 2 - 2) * 2;
+		pos[0] = 6;
+		for (unsigned i = n - 1, p = version * 4 + 10; i >= 1; i--, p -= step)
+			pos[i] = p;
+		for (unsigned i = 0; i < n; i++)
+		{
+			for (unsigned j = 0; j < n; j++)
+			{
+				if ((i == 0 && j == 0) || (i == 0 && j == n - 1) || (i == n - 1 && j == 0))
+					continue;	// finder pattern corners
+				for (int dy = -2; dy <= 2; dy++)
+					for (int dx = -2; dx <= 2; dx++)
+						qf_set_func(pos[i] + dx, pos[j] + dy, (abs(dx) > abs(dy) ? abs(dx) : abs(dy)) != 1);
+			}
+		}
+	}
+
+	// reserve the format bits, they are drawn per mask.
+	qf_draw_format_bits(qf.is_func, 0);
+	for (unsigned i = 0; i < 9; i++)
+	{
+		qf.is_func[8 * size + i] = qf.is_func[i * size + 8] = 1;
+		if (i < 8)
+			qf.is_func[8 * size + size - 1 - i] = qf.is_func[(size - 1 - i) * size + 8] = 1;
+	}
+
+	// version information
+	if (version >= 7)
+	{
+		unsigned rem = version;
+		for (int i = 0; i < 12; i++)
+			rem = (rem << 1) ^ ((rem >> 11) * 0x1F25);
+		unsigned long bits = (unsigned long)version << 12 | rem;
+		for (unsigned i = 0; i < 18; i++)
+		{
+			bool bit = (bits >> i) & 1;
+			unsigned a = size - 11 + i % 3, b = i / 3;
+			qf_set_func(a, b, bit);
+			qf_set_func(b, a, bit);
+		}
+	}
+
+	// zigzag order of the data modules
+	unsigned k = 0;
+	for (int right = size - 1; right >= 1; right -= 2)
+	{
+		if (right == 6)
+			right = 5;
+		for (unsigned vert = 0; vert < size; vert++)
+		{
+			for (int j = 0; j < 2; j++)
+			{
+				unsigned x = right - j;
+				bool upward = ((right + 1) & 2) == 0;
+				unsigned y = upward ? size - 1 - vert : vert;
+				if (!qf.is_func[y * size + x] && k < qf.raw_codewords * 8)
+					qf.order[k++] = y * size + x;
+			}
+		}
+	}
+	qf.version = version;
+}
+
+
+static inline bool qf_mask_bit(unsigned mask, unsigned x, unsigned y)
+{
+	switch (mask)
+	{
+	case 0:  return (x + y) % 2 == 0;
+	case 1:  return y % 2 == 0;
+	case 2:  return x % 3 == 0;
+	case 3:  return (x + y) % 3 == 0;
+	case 4:  return (x / 3 + y / 2) % 2 == 0;
+	case 5:  return x * y % 2 + x * y % 3 == 0;
+	case 6:  return (x * y % 2 + x * y % 3) % 2 == 0;
+	default: return ((x + y) % 2 + x * y % 3) % 2 == 0;
+	}
+}
+
+
+// both copies of the format bits, allows the 3 bit errors that the BCH code corrects.
+// Returns the number of bit errors, > 3 if unreadable.
+static inline unsigned qf_read_format(const uint8_t *m, unsigned size, unsigned *ecc_level, unsigned *mask)
+{
+	unsigned bits[2] = { 0, 0 }, best_dist = 99;
+
+	for (unsigned i = 0; i <= 5; i++)
+		bits[0] |= m[i * size + 8] << i;
+	bits[0] |= m[7 * size + 8] << 6 | m[8 * size + 8] << 7 | m[8 * size + 7] << 8;
+	for (unsigned i = 9; i < 15; i++)
+		bits[0] |= m[8 * size + 14 - i] << i;
+	for (unsigned i = 0; i < 8; i++)
+		bits[1] |= m[8 * size + size - 1 - i] << i;
+	for (unsigned i = 8; i < 15; i++)
+		bits[1] |= m[(size - 15 + i) * size + 8] << i;
+
+	for (unsigned c = 0; c < 2; c++)
+	{
+		for (unsigned e = 0; e < 4; e++)
+		{
+			for (unsigned k = 0; k < 8; k++)
+			{
+				unsigned dist = __builtin_popcount(bits[c] ^ qf_format_bits(e, k));
+				if (dist < best_dist)
+				{
+					best_dist = dist;
+					*ecc_level = e;
+					*mask = k;
+				}
+			}
+		}
+	}
+	return best_dist;
+}
+
+
+// unmasked codewords in placement order, qf must be initialized.
+static inline void qf_read_codewords(const uint8_t *m, unsigned mask, uint8_t *cw)
+{
+	for (unsigned i = 0; i < qf.raw_codewords * 8; i++)
+	{
+		unsigned pos = qf.order[i];
+		if (!(i & 7))
+			cw[i >> 3] = 0;
+		cw[i >> 3] |= (m[pos] ^ qf_mask_bit(mask, pos % qf.size, pos / qf.size)) << (7 - (i & 7));
+	}
+}
+
+
+// de-interleaves block i into blk: data codewords, then ecc codewords. Returns the data length.
+static inline unsigned qf_block(const uint8_t *cw, unsigned i, uint8_t *blk)
+{
+	unsigned num_short = qf.num_blocks - qf.raw_codewords % qf.num_blocks;
+	unsigned short_data_len = qf.raw_codewords / qf.num_blocks - qf.block_ecc_len;
+	unsigned dat_len = short_data_len + (i < num_short ? 0 : 1);
+
+	for (unsigned j = 0, l = i; j < dat_len; j++, l += qf.num_blocks)
+	{
+		if (j == short_data_len)
+			l -= num_short;
+		blk[j] = cw[l];
+	}
+	for (unsigned j = 0, l = qf.data_codewords + i; j < qf.block_ecc_len; j++, l += qf.num_blocks)
+		blk[dat_len + j] = cw[l];
+	return dat_len;
+}
+
+
+static inline unsigned qf_read_bits(const uint8_t *data, unsigned limit, unsigned *pos, unsigned nbits)
+{
+	unsigned n = 0;
+	for (unsigned i = 0; i < nbits; i++, (*pos)++)
+		n = (n << 1) | ((*pos < limit) ? (data[*pos >> 3] >> (7 - (*pos & 7))) & 1 : 0);
+	return n;
+}
+
+
+/*
+ * The first segment of the data codewords, alphanumeric (fast encoder) or
+ * byte mode (qrcodegen with lower case). text needs QR_FIXED_MAX_CODEWORDS+1.
+ * Returns the text length or -1 for other modes.
+ */
+static inline int qf_decode_text(const uint8_t *data, char *text)
+{
+	static const char alnum[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:";
+	unsigned pos = 0, len = 0, limit = qf.data_codewords * 8;
+	unsigned mode = qf_read_bits(data, limit, &pos, 4);
+
+	if (mode == 0x2)
+	{
+		unsigned count = qf_read_bits(data, limit, &pos, qf.version <= 9 ? 9 : 11);
+		for (; len + 1 < count && len + 1 < QR_FIXED_MAX_CODEWORDS; len += 2)
+		{
+			unsigned v = qf_read_bits(data, limit, &pos, 11);
+			if (v >= 45 * 45)
+				break;
+			text[len] = alnum[v / 45];
+			text[len + 1] = alnum[v % 45];
+		}
+		if (len < count && len < QR_FIXED_MAX_CODEWORDS)
+		{
+			unsigned v = qf_read_bits(data, limit, &pos, 6);
+			text[len++] = (v < 45) ? alnum[v] : '?';
+		}
+	}
+	else if (mode == 0x4)
+	{
+		unsigned count = qf_read_bits(data, limit, &pos, qf.version <= 9 ? 8 : 16);
+		for (; len < count && len < QR_FIXED_MAX_CODEWORDS; len++)
+			text[len] = qf_read_bits(data, limit, &pos, 8);
+	}
+	else
+		return -1;
+	text[len] = '\0';
+	return len;
+}
+
+#endif // SFM_QR_H
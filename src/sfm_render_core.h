@@ -0,0 +1,175 @@
+/*
+ * sfm_render_core.h -- the inner loops of the renderer, specialised for one
+ * pixel format, the rotation for the print head also for one canvas height
+ * (pixels across the tape).
+ *
+ * No include guard: shelfman-qrcode.c includes this once per format and tape
+ * profile, with RC_BPP (1 or 8) and RC_H (0: any height) defined, and picks
+ * the instance in img_new(), see render_core_select(). No pixel operation
+ * asks for the format. The drawing loops depend on the canvas width only,
+ * they are defined once per format, with RC_H 0, which comes first. The
+ * rotation runs over the canvas height, each profile gets its own with
+ * constant bounds. Each instance is a struct render_core named
+ * render_core_<bpp>_<h>. The loops are SFM_HOT, in SRAM on the rp2040.
+ */
+#if !defined(RC_BPP) || !defined(RC_H)
+# error "define RC_BPP and RC_H before including sfm_render_core.h"
+#endif
+
+#define RC_CAT2(a, b, c)	a##_##b##_##c
+#define RC_CAT(a, b, c)		RC_CAT2(a, b, c)
+#define RC_FN(name)		RC_CAT(name, RC_BPP, RC_H)	// of this height
+#define RC_FMT(name)		RC_CAT(name, RC_BPP, 0)		// of this format, any height
+
+#if RC_H
+# define RC_HEIGHT(im)		RC_H
+#else
+# define RC_HEIGHT(im)		((im)->h)
+#endif
+
+
+#if RC_H == 0
+// 1 if the pixel at pos is black.
+static inline unsigned RC_FMT(rc_dark)(const struct img *im, uint32_t pos)
+{
+#if RC_BPP == 8
+	return im->data[pos] < 128;
+#else
+	return !((im->data[pos >> 3] >> (7 - (pos & 7))) & 1);
+#endif
+}
+
+
+// the 8 pixels from pos on as bits, MSB first, 1 is black. May read a few bytes past the last row, see img_new().
+static inline unsigned RC_FMT(rc_dark8)(const struct img *im, uint32_t pos)
+{
+#if RC_BPP == 8
+	const uint8_t *p = im->data + pos;
+	unsigned v = 0;
+	for (unsigned i = 0; i < 8; i++)
+		v = (v << 1) | (p[i] < 128);
+	return v;
+#else
+	const uint8_t *p = im->data + (pos >> 3);
+	unsigned s = pos & 7;
+	return (uint8_t)~((p[0] << s) | (p[1] >> (8 - s)));
+#endif
+}
+
+
+// rectangle(), already clipped.
+static void SFM_HOT(RC_FMT(rc_fill))(struct img *im, unsigned x, unsigned y, unsigned w, unsigned h, unsigned val)
+{
+	uint32_t pos = im->w * y + x;
+	for (unsigned j = 0; j < h; j++, pos += im->w)
+	{
+#if RC_BPP == 8
+		memset(im->data + pos, val, w);
+#else
+		bitrow_fill(im->data, pos, w, val);
+#endif
+	}
+}
+
+
+// copies nbits of a packed row, left aligned, 1 is white, to x, y. Already clipped.
+static void SFM_HOT(RC_FMT(rc_put_row))(struct img *im, unsigned x, unsigned y, const uint8_t *row, unsigned nbits)
+{
+#if RC_BPP == 8
+	uint8_t *p = im->data + im->w * y + x;
+	for (unsigned i = 0; i < nbits; i++)
+		p[i] = ((row[i >> 3] << (i & 7)) & 0x80) ? 255 : 0;
+#else
+	bitrow_put(im->data, im->w * y + x, row, nbits, BLIT_COPY);
+#endif
+}
+
+
+// reads the cols x rows modules of a code at x, y into m, dark = 1. Returns -1 if a module is not uniform.
+static int SFM_HOT(RC_FMT(rc_read_modules))(const struct img *im, unsigned x, unsigned y, unsigned cols, unsigned rows, unsigned spread, uint8_t *m)
+{
+	const unsigned w = im->w;
+	int ret = 0;
+	for (unsigned j = 0; j < rows; j++)
+	{
+		for (unsigned i = 0; i < cols; i++)
+		{
+			uint32_t pos = w * (y + j * spread) + x + i * spread;
+			unsigned v = RC_FMT(rc_dark)(im, pos);
+			for (unsigned dy = 0; dy < spread; dy++)
+				for (unsigned dx = 0; dx < spread; dx++)
+					if (RC_FMT(rc_dark)(im, pos + dy * w + dx) != v)
+						ret = -1;
+			m[j * cols + i] = v;
+		}
+	}
+	return ret;
+}
+#endif // RC_H == 0
+
+
+/*
+ * Rotation for the print head: columns x0 .. x0+7 become 8 raster lines,
+ * top row first, centered on the print head. Each byte of a line is a block
+ * of 8 rows x 8 columns, transposed in one uint64_t. The blocks are aligned
+ * to the bytes of the line, rows above and below the canvas are white.
+ */
+static void SFM_HOT(RC_FN(rc_raster8))(const struct img *im, unsigned x0, uint8_t lines[8][PTOUCH_LINE_BYTES])
+{
+	const unsigned h = RC_HEIGHT(im), w = im->w;
+	const unsigned top = (PTOUCH_PINS - h + 1) / 2;
+	const unsigned mask = (w - x0 >= 8) ? 0xff : (0xff << (8 - (w - x0))) & 0xff;
+
+	memset(lines, 0, 8 * PTOUCH_LINE_BYTES);
+	for (unsigned b = top / 8; b <= (top + h - 1) / 8; b++)
+	{
+		uint64_t blk = 0;
+		for (unsigned r = 0; r < 8; r++)
+		{
+			int y = (int)(8 * b + r) - (int)top;
+			unsigned v = (y >= 0 && y < (int)h) ? RC_FMT(rc_dark8)(im, w * y + x0) & mask : 0;
+			blk = (blk << 8) | v;
+		}
+		blk = transpose8(blk);
+		for (unsigned k = 0; k < 8; k++)
+			lines[k][b] = (uint8_t)(blk >> (56 - 8 * k));
+	}
+}
+
+
+// the 'G' raster lines of ptouch_encode(), one per column.
+static unsigned SFM_HOT(RC_FN(rc_ptouch_lines))(const struct img *im, uint8_t *out)
+{
+	uint8_t lines[8][PTOUCH_LINE_BYTES];
+	unsigned o = 0;
+
+	for (unsigned x0 = 0; x0 < im->w; x0 += 8)
+	{
+		RC_FN(rc_raster8)(im, x0, lines);
+		for (unsigned k = 0; k < 8 && x0 + k < im->w; k++)
+		{
+			unsigned n = packbits(lines[k], PTOUCH_LINE_BYTES, out + o + 3);
+			out[o] = 'G';
+			out[o + 1] = n & 0xff;
+			out[o + 2] = n >> 8;
+			o += 3 + n;
+		}
+	}
+	return o;
+}
+
+
+static const struct render_core RC_FN(render_core) = {
+	RC_H, RC_BPP,
+	RC_FMT(rc_fill),
+	RC_FMT(rc_put_row),
+	RC_FMT(rc_read_modules),
+	RC_FN(rc_ptouch_lines),
+};
+
+#undef RC_HEIGHT
+#undef RC_FN
+#undef RC_FMT
+#undef RC_CAT
+#undef RC_CAT2
+#undef RC_H
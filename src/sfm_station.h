@@ -0,0 +1,184 @@
+/*
+ * sfm_station.h -- binary job protocol between a host and the RP2040 label
+ * station, shared by both sides.
+ *
+ * Frame, all numbers little endian:
+ *	0xA5 0x5A type seq len_lo len_hi payload[len] crc_lo crc_hi
+ * crc is CRC-16/CCITT-FALSE over type .. payload. Frames with a bad crc are
+ * dropped silently, the receiver hunts for the next 0xA5 0x5A.
+ *
+ * The host pushes JOB frames, each is answered with ACK (job id, free queue
+ * slots) or NAK. The host keeps at most 'free' jobs in flight, then the
+ * station's receive ring (STATION_RING_SIZE) can hold all of them while it
+ * is busy rendering. Every label is reported with LABEL, a finished job with
+ * JOB_DONE. STATUS and RASTER can be requested at any time.
+ *
+ * uid pool: the host uploads up to STATION_POOL_MAX uids of its registry with
+ * POOL_BEGIN, POOL_DATA in order, POOL_COMMIT, each answered with ACK or NAK.
+ * The station keeps them in flash and takes the next unused one for every
+ * label of a count job, instead of a random uid.
+ */
+#ifndef SFM_STATION_H
+#define SFM_STATION_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define STATION_SYNC0		0xA5
+#define STATION_SYNC1		0x5A
+#define STATION_HDR_LEN		6	// sync, type, seq, len
+#define STATION_MAX_PAYLOAD	260
+#define STATION_MAX_UIDS	4	// explicit uids per JOB, send more jobs for more.
+#define STATION_QUEUE_LEN	256
+#define STATION_RASTER_CHUNK	256
+#define STATION_POOL_CHUNK	32	// uids per POOL_DATA, one flash page
+#define STATION_POOL_MAX	7680	// see uid_pool.c
+
+// host -> station
+#define STATION_JOB		0x01	// struct station_job_msg
+#define STATION_STATUS		0x02	// no payload, answered with STATUS
+#define STATION_RASTER		0x03	// no payload, answered with RASTER_HDR and RASTER_DATA of the last label
+#define STATION_CLEAR		0x04	// drops all queued jobs, answered with ACK
+#define STATION_POOL_BEGIN	0x05	// uint32_t count, erases the spare pool
+#define STATION_POOL_DATA	0x06	// uint32_t index, then up to STATION_POOL_CHUNK uint64_t uids
+#define STATION_POOL_COMMIT	0x07	// uint16_t crc of all uids, makes the new pool the active one
+
+// station -> host
+#define STATION_ACK		0x81	// struct station_ack_msg
+#define STATION_NAK		0x82	// one byte, STATION_E_*
+#define STATION_STATUS_REPLY	0x83	// struct station_status_msg
+#define STATION_RASTER_HDR	0x84	// struct station_raster_hdr
+#define STATION_RASTER_DATA	0x85	// uint32_t offset, then up to STATION_RASTER_CHUNK bytes
+#define STATION_LABEL		0x86	// struct station_label_msg
+#define STATION_JOB_DONE	0x87	// struct station_done_msg
+
+#define STATION_E_QUEUE_FULL	1
+#define STATION_E_BAD_JOB	2
+#define STATION_E_UNKNOWN	3
+#define STATION_E_NO_RASTER	4
+#define STATION_E_RENDER	5
+#define STATION_E_POOL_EMPTY	6	// all uids of the pool are used, upload a new one
+#define STATION_E_POOL		7	// bad upload, the old pool stays active
+#define STATION_E_PRINTER	8	// tape out, cover open ..., see the printer fields of STATUS
+
+// station_status_msg.printer
+#define STATION_PRINTER_NONE	0
+#define STATION_PRINTER_READY	1
+#define STATION_PRINTER_ERROR	2
+
+struct station_job_msg {
+	uint8_t letter;
+	uint8_t nuid;			// 0: count random uids, else count is ignored
+	uint16_t count;
+	uint64_t uid[STATION_MAX_UIDS];	// only nuid are sent
+} __attribute__((packed));
+
+struct station_ack_msg {
+	uint16_t job_id;		// 0 for CLEAR
+	uint16_t free;			// free queue slots
+} __attribute__((packed));
+
+struct station_status_msg {
+	uint16_t queued, free;
+	uint16_t current_job;		// 0: idle
+	uint8_t last_error;
+	uint8_t pad;
+	uint32_t labels_done, labels_failed;
+	uint32_t pool_count, pool_used;	// 0, 0: no pool, random uids
+	uint8_t printer;		// STATION_PRINTER_*
+	uint8_t media_width;		// mm, from the last status reply of the printer
+	uint8_t printer_error1, printer_error2;	// as in struct ptouch_status
+} __attribute__((packed));
+
+struct station_raster_hdr {
+	uint16_t w, h;
+	uint8_t bits_per_val;
+	uint8_t pad;
+	uint32_t len;			// bytes of raster data, as in struct img
+} __attribute__((packed));
+
+struct station_label_msg {
+	uint16_t job_id, index;
+	uint8_t letter, result;		// result 0: ok, else STATION_E_*
+	uint64_t uid;
+} __attribute__((packed));
+
+struct station_done_msg {
+	uint16_t job_id, ok, failed;
+} __attribute__((packed));
+
+
+static inline uint16_t station_crc16(uint16_t crc, const uint8_t *p, unsigned len)
+{
+	while (len--)
+	{
+		crc ^= (uint16_t)*p++ << 8;
+		for (int i = 0; i < 8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+
+// builds a frame into out, which needs STATION_HDR_LEN + len + 2 bytes. Returns the frame length.
+static inline unsigned station_frame(uint8_t *out, uint8_t type, uint8_t seq, const void *payload, unsigned len)
+{
+	out[0] = STATION_SYNC0;
+	out[1] = STATION_SYNC1;
+	out[2] = type;
+	out[3] = seq;
+	out[4] = len & 0xff;
+	out[5] = len >> 8;
+	if (len)
+		memcpy(out + STATION_HDR_LEN, payload, len);
+	uint16_t crc = station_crc16(0xffff, out + 2, len + 4);
+	out[STATION_HDR_LEN + len] = crc & 0xff;
+	out[STATION_HDR_LEN + len + 1] = crc >> 8;
+	return STATION_HDR_LEN + len + 2;
+}
+
+
+struct station_rx {
+	unsigned pos;			// bytes of the current frame in buf
+	uint8_t buf[STATION_HDR_LEN + STATION_MAX_PAYLOAD + 2];
+	unsigned dropped;		// frames with bad crc or length
+};
+
+#define STATION_RX_TYPE(rx)	((rx)->buf[2])
+#define STATION_RX_SEQ(rx)	((rx)->buf[3])
+#define STATION_RX_LEN(rx)	((rx)->buf[4] | (rx)->buf[5] << 8)
+#define STATION_RX_PAYLOAD(rx)	((rx)->buf + STATION_HDR_LEN)
+
+// feeds one byte. Returns 1 when a complete frame with a good crc is in rx->buf.
+static inline int station_rx_byte(struct station_rx *rx, uint8_t c)
+{
+	if (rx->pos == 0 && c != STATION_SYNC0)
+		return 0;
+	if (rx->pos == 1 && c != STATION_SYNC1)
+	{
+		rx->pos = (c == STATION_SYNC0) ? 1 : 0;
+		return 0;
+	}
+	rx->buf[rx->pos++] = c;
+	if (rx->pos < STATION_HDR_LEN)
+		return 0;
+	unsigned len = STATION_RX_LEN(rx);
+	if (len > STATION_MAX_PAYLOAD)
+	{
+		rx->dropped++;
+		rx->pos = 0;
+		return 0;
+	}
+	if (rx->pos < STATION_HDR_LEN + len + 2)
+		return 0;
+	rx->pos = 0;
+	uint16_t crc = rx->buf[STATION_HDR_LEN + len] | rx->buf[STATION_HDR_LEN + len + 1] << 8;
+	if (crc != station_crc16(0xffff, rx->buf + 2, len + 4))
+	{
+		rx->dropped++;
+		return 0;
+	}
+	return 1;
+}
+
+#endif // SFM_STATION_H
@@ -0,0 +1,98 @@
+/*
+ * sfm_uid.h -- the shelfman payload format, shared by all shelfman tools.
+ *
+ * SFM-<letter>-xxxxxxxx-xxxx-xxxx, a 64 bit uid in hex.
+ * letter: X=any, I=item, C=container, L=location
+ */
+#ifndef SFM_UID_H
+#define SFM_UID_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define SFM_PAYLOAD_LEN 24
+#define SFM_UID_LEN	18	// xxxxxxxx-xxxx-xxxx
+
+// Hex digits may be upper or lower case. Returns 0 if valid, letter and uid may be NULL.
+static inline int sfm_parse(const char *text, char *letter, uint64_t *uid)
+{
+	static const char tmpl[] = "SFM-?-hhhhhhhh-hhhh-hhhh";
+	uint64_t u = 0;
+
+	for (unsigned i = 0; i < SFM_PAYLOAD_LEN; i++)
+	{
+		char c = text[i];
+		if (tmpl[i] == 'h')
+		{
+			if      (c >= '0' && c <= '9') u = (u << 4) | (c - '0');
+			else if (c >= 'a' && c <= 'f') u = (u << 4) | (c - 'a' + 10);
+			else if (c >= 'A' && c <= 'F') u = (u << 4) | (c - 'A' + 10);
+			else return -1;
+		}
+		else if (tmpl[i] == '?')
+		{
+			if (!((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')))
+				return -1;
+		}
+		else if (c != tmpl[i])
+			return -1;
+	}
+	if (text[SFM_PAYLOAD_LEN])
+		return -1;
+	if (letter) *letter = text[4];
+	if (uid) *uid = u;
+	return 0;
+}
+
+
+/*
+ * sfm_parse() for the code stream of a scanner: text is len bytes, not
+ * terminated, but SFM_PAYLOAD_LEN of them must be readable. All characters
+ * are checked without branches on the data, the verdict is one OR over all
+ * of them, so a burst of scans runs without mispredicted jumps.
+ * letter is upper case. Returns 0 if valid, letter and uid are always written.
+ */
+static inline int sfm_parse_n(const char *text, unsigned len, char *letter, uint64_t *uid)
+{
+	static const char tmpl[] = "SFM-?-hhhhhhhh-hhhh-hhhh";
+	static const uint8_t fixed_pos[7] = { 0, 1, 2, 3, 5, 14, 19 };
+	static const uint8_t hex_pos[16] = { 6, 7, 8, 9, 10, 11, 12, 13, 15, 16, 17, 18, 20, 21, 22, 23 };
+	const uint8_t *p = (const uint8_t *)text;
+	unsigned bad = len ^ SFM_PAYLOAD_LEN;
+	uint64_t u = 0;
+
+	for (unsigned i = 0; i < sizeof(fixed_pos); i++)
+		bad |= p[fixed_pos[i]] ^ (uint8_t)tmpl[fixed_pos[i]];
+	bad |= ((p[4] | 0x20u) - 'a') >= 26;
+	for (unsigned i = 0; i < sizeof(hex_pos); i++)
+	{
+		unsigned c = p[hex_pos[i]];
+		unsigned d = c - '0', a = (c | 0x20u) - 'a';
+		unsigned is_d = d < 10, is_a = a < 6;
+		u = (u << 4) | ((d & -is_d) | ((a + 10) & -is_a));
+		bad |= !(is_d | is_a);
+	}
+	*letter = p[4] & ~0x20;
+	*uid = u;
+	return -(bad != 0);
+}
+
+
+// accepts the full payload or just xxxxxxxx-xxxx-xxxx. letter is 'X' for the latter.
+static inline int sfm_parse_any(const char *text, char *letter, uint64_t *uid)
+{
+	char buf[SFM_PAYLOAD_LEN + 2];
+	if (snprintf(buf, sizeof(buf), "SFM-X-%s", text) == SFM_PAYLOAD_LEN && !sfm_parse(buf, letter, uid))
+		return 0;
+	return sfm_parse(text, letter, uid);
+}
+
+
+// needs buf[SFM_PAYLOAD_LEN+1]
+static inline void sfm_format(char *buf, char letter, uint64_t uid)
+{
+	snprintf(buf, SFM_PAYLOAD_LEN + 1, "SFM-%c-%08x-%04x-%04x", letter,
+		(unsigned)(uid >> 32), (unsigned)(uid >> 16) & 0xffff, (unsigned)uid & 0xffff);
+}
+
+#endif // SFM_UID_H
@@ -0,0 +1,491 @@
+/*
+ * shelfman-index.c -- inventory index keyed by the 64 bit shelfman uid.
+ *
+ * One memory-mapped file holds an open addressing hash table of fixed size
+ * records. Each record knows its parent (item -> container -> location) and
+ * keeps a doubly linked list of its children, so that "what is in this
+ * container" only walks the children, and moving an item is O(1).
+ *
+ * Usage: see usage() below.
+ */
+
+# include <stdlib.h>
+# include <stdio.h>
+# include <string.h>
+# include <errno.h>
+# include <ctype.h>
+# include <stdint.h>
+# include <time.h>
+# include <fcntl.h>	// O_RDWR
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/random.h>	// getrandom()
+
+#include "sfm_uid.h"
+
+#define IDX_MAGIC	"SFMIDX1"
+#define IDX_DEFAULT_FILE	"inventory.sfi"
+#define IDX_MIN_CAPACITY	1024	// must be a power of 2
+#define IDX_MAX_LOAD_PERC	70
+#define IDX_NONE	0xffffffffu
+#define IDX_NAME_LEN	30
+
+struct idx_hdr {
+	char magic[8];
+	uint32_t rec_size;
+	uint32_t pad;
+	uint64_t capacity;		// number of slots, a power of 2
+	uint64_t count;			// live records
+	uint64_t used;			// live records and tombstones
+	uint8_t reserved[24];
+};
+
+struct idx_rec {
+	uint64_t uid;			// 0: empty slot
+	uint64_t parent;		// uid of the container or location, 0: none
+	uint32_t first_child, next, prev;	// slot numbers, IDX_NONE
+	uint32_t mtime;
+	char letter;			// X, I, C, L, or '?' for a parent we only know by reference
+	char deleted;			// tombstone, the slot stays part of the probe chain
+	char name[IDX_NAME_LEN];
+};
+
+struct idx {
+	const char *path;
+	int fd;
+	size_t map_len;
+	struct idx_hdr *hdr;
+	struct idx_rec *rec;
+};
+
+
+static int idx_map(struct idx *ix, const char *path, uint64_t capacity, bool create)
+{
+	size_t len = sizeof(struct idx_hdr) + capacity * sizeof(struct idx_rec);
+	struct stat st;
+
+	ix->path = path;
+	ix->fd = open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644);
+	if (ix->fd < 0)
+		return -1;
+	if (create)
+	{
+		if (ftruncate(ix->fd, len) != 0)	// sparse, all slots empty
+			return -1;
+	}
+	else
+	{
+		if (fstat(ix->fd, &st) != 0 || (size_t)st.st_size < sizeof(struct idx_hdr))
+			return -1;
+		len = st.st_size;
+	}
+	void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, ix->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	ix->map_len = len;
+	ix->hdr = (struct idx_hdr *)map;
+	ix->rec = (struct idx_rec *)(ix->hdr + 1);
+
+	if (create)
+	{
+		memcpy(ix->hdr->magic, IDX_MAGIC, sizeof(ix->hdr->magic));
+		ix->hdr->rec_size = sizeof(struct idx_rec);
+		ix->hdr->capacity = capacity;
+	}
+	else if (memcmp(ix->hdr->magic, IDX_MAGIC, sizeof(ix->hdr->magic)) ||
+		 ix->hdr->rec_size != sizeof(struct idx_rec) ||
+		 len != sizeof(struct idx_hdr) + ix->hdr->capacity * sizeof(struct idx_rec))
+	{
+		printf("ERROR: %s is not a shelfman index\n", path);
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+
+static void idx_unmap(struct idx *ix)
+{
+	munmap(ix->hdr, ix->map_len);
+	close(ix->fd);
+}
+
+
+static inline uint32_t idx_hash(struct idx *ix, uint64_t uid)
+{
+	// uids are random already, the multiply only spreads hand made ones.
+	return (uint32_t)((uid * 0x9e3779b97f4a7c15ULL) >> 32) & (ix->hdr->capacity - 1);
+}
+
+
+uint32_t idx_find(struct idx *ix, uint64_t uid)
+{
+	uint32_t mask = ix->hdr->capacity - 1;
+	for (uint32_t s = idx_hash(ix, uid); ix->rec[s].uid; s = (s + 1) & mask)
+		if (ix->rec[s].uid == uid)
+			return ix->rec[s].deleted ? IDX_NONE : s;
+	return IDX_NONE;
+}
+
+
+static void idx_unlink(struct idx *ix, uint32_t s)
+{
+	struct idx_rec *r = ix->rec + s;
+	if (!r->parent)
+		return;
+	if (r->prev != IDX_NONE)
+		ix->rec[r->prev].next = r->next;
+	else
+	{
+		uint32_t p = idx_find(ix, r->parent);
+		if (p != IDX_NONE)
+			ix->rec[p].first_child = r->next;
+	}
+	if (r->next != IDX_NONE)
+		ix->rec[r->next].prev = r->prev;
+	r->parent = 0;
+	r->next = r->prev = IDX_NONE;
+}
+
+
+static void idx_link(struct idx *ix, uint32_t s, uint32_t p)
+{
+	struct idx_rec *r = ix->rec + s;
+	r->parent = ix->rec[p].uid;
+	r->prev = IDX_NONE;
+	r->next = ix->rec[p].first_child;
+	if (r->next != IDX_NONE)
+		ix->rec[r->next].prev = s;
+	ix->rec[p].first_child = s;
+}
+
+
+static int idx_insert(struct idx *ix, uint64_t uid, char letter, uint32_t *slot);
+
+// doubles the capacity: all records are inserted into a new file, then the child lists are rebuilt.
+static int idx_grow(struct idx *ix)
+{
+	struct idx nx;
+	char tmp[256];
+	snprintf(tmp, sizeof(tmp), "%s.%d", ix->path, (int)getpid());
+	if (idx_map(&nx, tmp, ix->hdr->capacity * 2, true))
+	{
+		printf("ERROR: cannot grow %s: errno=%d\n", ix->path, errno);
+		return -1;
+	}
+	for (uint64_t s = 0; s < ix->hdr->capacity; s++)
+	{
+		struct idx_rec *r = ix->rec + s;
+		uint32_t n;
+		if (!r->uid || r->deleted)
+			continue;
+		idx_insert(&nx, r->uid, r->letter, &n);
+		nx.rec[n].mtime = r->mtime;
+		memcpy(nx.rec[n].name, r->name, sizeof(r->name));
+	}
+	for (uint64_t s = 0; s < ix->hdr->capacity; s++)
+	{
+		struct idx_rec *r = ix->rec + s;
+		if (!r->uid || r->deleted || !r->parent)
+			continue;
+		idx_link(&nx, idx_find(&nx, r->uid), idx_find(&nx, r->parent));
+	}
+	if (rename(tmp, ix->path) != 0)
+	{
+		printf("ERROR: cannot replace %s: errno=%d\n", ix->path, errno);
+		idx_unmap(&nx);
+		unlink(tmp);
+		return -1;
+	}
+	nx.path = ix->path;
+	idx_unmap(ix);
+	*ix = nx;
+	return 0;
+}
+
+
+// finds or creates the record for uid. Returns 1 if it was created, 0 if it existed, -1 on error.
+static int idx_insert(struct idx *ix, uint64_t uid, char letter, uint32_t *slot)
+{
+	if ((ix->hdr->used + 1) * 100 > ix->hdr->capacity * IDX_MAX_LOAD_PERC && idx_grow(ix))
+		return -1;
+
+	uint32_t mask = ix->hdr->capacity - 1;
+	uint32_t s, tomb = IDX_NONE;
+	for (s = idx_hash(ix, uid); ix->rec[s].uid; s = (s + 1) & mask)
+	{
+		if (ix->rec[s].uid == uid && !ix->rec[s].deleted)
+		{
+			// a parent known by reference only learns its letter later.
+			if (ix->rec[s].letter == '?')
+				ix->rec[s].letter = letter;
+			*slot = s;
+			return 0;
+		}
+		if (ix->rec[s].deleted && tomb == IDX_NONE)
+			tomb = s;
+	}
+	if (tomb != IDX_NONE)
+		s = tomb;
+	else
+		ix->hdr->used++;
+
+	struct idx_rec *r = ix->rec + s;
+	memset(r, 0, sizeof(*r));
+	r->uid = uid;
+	r->letter = letter;
+	r->first_child = r->next = r->prev = IDX_NONE;
+	r->mtime = (uint32_t)time(NULL);
+	ix->hdr->count++;
+	*slot = s;
+	return 1;
+}
+
+
+// moves the record in slot s into parent, creating a placeholder for an unknown parent.
+static int idx_set_parent(struct idx *ix, uint32_t s, const char *parent)
+{
+	uint64_t uid = ix->rec[s].uid, puid;
+	char pletter;
+	uint32_t p;
+
+	if (!parent || !strcmp(parent, "-"))
+	{
+		idx_unlink(ix, s);
+		return 0;
+	}
+	if (sfm_parse_any(parent, &pletter, &puid) || !puid)
+	{
+		printf("ERROR: bad parent uid '%s'\n", parent);
+		return -1;
+	}
+	if (idx_insert(ix, puid, (strlen(parent) == SFM_UID_LEN) ? '?' : pletter, &p) < 0)
+		return -1;
+	s = idx_find(ix, uid);		// idx_insert() may have grown the table.
+
+	// refuse loops: the new parent must not be inside the record.
+	for (uint32_t a = p; a != IDX_NONE; a = ix->rec[a].parent ? idx_find(ix, ix->rec[a].parent) : IDX_NONE)
+	{
+		if (a == s)
+		{
+			printf("ERROR: %s is inside of the item to be moved\n", parent);
+			return -1;
+		}
+	}
+	idx_unlink(ix, s);
+	idx_link(ix, s, p);
+	ix->rec[s].mtime = (uint32_t)time(NULL);
+	return 0;
+}
+
+
+static void idx_print(struct idx *ix, uint32_t s, const char *indent)
+{
+	char buf[SFM_PAYLOAD_LEN + 1];
+	struct idx_rec *r = ix->rec + s;
+	sfm_format(buf, r->letter, r->uid);
+	printf("%s%s %.*s\n", indent, buf, IDX_NAME_LEN, r->name);
+}
+
+
+// uid [parent|-] [name ...]. Returns 0 on success.
+static int idx_add(struct idx *ix, char **av, int ac)
+{
+	uint64_t uid;
+	char letter;
+	uint32_t s;
+
+	if (ac < 1 || sfm_parse_any(av[0], &letter, &uid) || !uid)
+	{
+		printf("ERROR: bad uid '%s'\n", ac ? av[0] : "");
+		return -1;
+	}
+	if (idx_insert(ix, uid, letter, &s) < 0)
+		return -1;
+	if (ac > 2)
+	{
+		char *name = ix->rec[s].name;
+		name[0] = '\0';
+		for (int i = 2; i < ac; i++)
+		{
+			size_t len = strlen(name);
+			snprintf(name + len, IDX_NAME_LEN - len, "%s%s", len ? " " : "", av[i]);
+		}
+	}
+	return (ac > 1) ? idx_set_parent(ix, s, av[1]) : 0;
+}
+
+
+// bulk add from stdin, one 'uid [parent|-] [name ...]' per line.
+static int idx_import(struct idx *ix)
+{
+	char line[256];
+	unsigned n = 0, errors = 0;
+	while (fgets(line, sizeof(line), stdin))
+	{
+		char *av[16];
+		int ac = 0;
+		for (char *t = strtok(line, " \t\r\n"); t && ac < 16; t = strtok(NULL, " \t\r\n"))
+			av[ac++] = t;
+		if (!ac || av[0][0] == '#')
+			continue;
+		if (idx_add(ix, av, ac))
+			errors++;
+		n++;
+	}
+	printf("imported %u lines, %u errors, %llu records\n", n, errors, (unsigned long long)ix->hdr->count);
+	return errors ? 1 : 0;
+}
+
+
+// registers count fresh random uids and prints them, e.g. as the uid pool of the label station.
+static int idx_new(struct idx *ix, unsigned count, char letter)
+{
+	unsigned n = 0;
+	while (n < count)
+	{
+		uint64_t uid;
+		uint32_t s;
+		if (getrandom(&uid, sizeof(uid), 0) != sizeof(uid))
+		{
+			printf("ERROR: getrandom failed: errno=%d\n", errno);
+			return -1;
+		}
+		if (!uid)
+			continue;
+		int r = idx_insert(ix, uid, letter, &s);
+		if (r < 0)
+			return -1;
+		if (!r)
+			continue;	// taken already
+		idx_print(ix, s, "");
+		n++;
+	}
+	return 0;
+}
+
+
+static uint32_t idx_lookup_arg(struct idx *ix, const char *arg)
+{
+	uint64_t uid;
+	char letter;
+	if (sfm_parse_any(arg, &letter, &uid))
+	{
+		printf("ERROR: bad uid '%s'\n", arg);
+		return IDX_NONE;
+	}
+	uint32_t s = idx_find(ix, uid);
+	if (s == IDX_NONE)
+		printf("%s: not found\n", arg);
+	return s;
+}
+
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-f index.sfi] command ...\n", prog);
+	printf("  add uid [parent|-] [name ...]   add or update, parent is the container or location\n");
+	printf("  mv uid parent|-                 move into parent, or take out\n");
+	printf("  rm uid                          remove, its contents are taken out\n");
+	printf("  get uid                         show and where it is\n");
+	printf("  ls uid                          what is in this container or location\n");
+	printf("  import                          add from stdin, one 'uid [parent|-] [name ...]' per line\n");
+	printf("  new count [letter]              add count fresh random uids and print them\n");
+	printf("  stat\n");
+	printf("uid is SFM-<letter>-xxxxxxxx-xxxx-xxxx or just xxxxxxxx-xxxx-xxxx. Default file: %s\n", IDX_DEFAULT_FILE);
+}
+
+
+int main(int ac, char **av)
+{
+	const char *path = IDX_DEFAULT_FILE;
+	struct idx ix;
+	int opt;
+
+	while ((opt = getopt(ac, av, "f:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'f': path = optarg; break;
+		default: usage(av[0]); return 1;
+		}
+	}
+	if (optind >= ac)
+	{
+		usage(av[0]);
+		return 1;
+	}
+	const char *cmd = av[optind++];
+	char **args = av + optind;
+	int nargs = ac - optind;
+
+	if (idx_map(&ix, path, 0, false))
+	{
+		if (errno != ENOENT || idx_map(&ix, path, IDX_MIN_CAPACITY, true))
+		{
+			printf("ERROR: cannot open %s: errno=%d\n", path, errno);
+			return 1;
+		}
+	}
+
+	int ret = 0;
+	uint32_t s;
+	if (!strcmp(cmd, "add"))
+		ret = idx_add(&ix, args, nargs);
+	else if (!strcmp(cmd, "import"))
+		ret = idx_import(&ix);
+	else if (!strcmp(cmd, "new") && (nargs == 1 || nargs == 2))
+		ret = idx_new(&ix, atoi(args[0]), (nargs == 2) ? toupper(args[1][0]) : 'X');
+	else if (!strcmp(cmd, "mv") && nargs == 2)
+	{
+		if ((s = idx_lookup_arg(&ix, args[0])) == IDX_NONE)
+			ret = 1;
+		else
+			ret = idx_set_parent(&ix, s, args[1]);
+	}
+	else if (!strcmp(cmd, "rm") && nargs == 1)
+	{
+		if ((s = idx_lookup_arg(&ix, args[0])) == IDX_NONE)
+			ret = 1;
+		else
+		{
+			while (ix.rec[s].first_child != IDX_NONE)
+				idx_unlink(&ix, ix.rec[s].first_child);
+			idx_unlink(&ix, s);
+			ix.rec[s].deleted = 1;
+			ix.hdr->count--;
+		}
+	}
+	else if (!strcmp(cmd, "get") && nargs == 1)
+	{
+		if ((s = idx_lookup_arg(&ix, args[0])) == IDX_NONE)
+			ret = 1;
+		else
+		{
+			idx_print(&ix, s, "");
+			for (uint64_t p = ix.rec[s].parent; p && (s = idx_find(&ix, p)) != IDX_NONE; p = ix.rec[s].parent)
+				idx_print(&ix, s, "  in ");
+		}
+	}
+	else if (!strcmp(cmd, "ls") && nargs == 1)
+	{
+		if ((s = idx_lookup_arg(&ix, args[0])) == IDX_NONE)
+			ret = 1;
+		else
+			for (uint32_t c = ix.rec[s].first_child; c != IDX_NONE; c = ix.rec[c].next)
+				idx_print(&ix, c, "");
+	}
+	else if (!strcmp(cmd, "stat"))
+		printf("%s: %llu records, %llu slots used, capacity %llu\n", path,
+			(unsigned long long)ix.hdr->count, (unsigned long long)ix.hdr->used,
+			(unsigned long long)ix.hdr->capacity);
+	else
+	{
+		usage(av[0]);
+		ret = 1;
+	}
+
+	idx_unmap(&ix);
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,1169 @@
+/*
+ * shelfman-photos.c -- photo ingestion for the inventory.
+ *
+ * Photos are decoded and downscaled to thumbnails by a pool of threads, the
+ * thumbnails go into one packed file with an index sorted by shelfman uid.
+ * Browsing an inventory then only touches the thumbnail file, which is read
+ * with mmap().
+ *
+ * File layout (.sft):
+ *	struct sft_hdr
+ *	struct sft_rec + pixels		one per thumbnail, appended
+ *	struct sft_idx[]		sorted by uid, rewritten at the end by each add
+ * Records are never moved, an add appends its records and a new index, and
+ * only then points the header to it. An interrupted add leaves the old index.
+ *
+ * 'scan' finds the shelfman labels in photos, its output feeds 'add', so that
+ * a session of shelf photos is linked to the uids without typing them.
+ *
+ * Only PNG is decoded (lodepng). Phone photos in JPEG need to be converted first.
+ */
+
+# include <stdlib.h>
+# include <stdio.h>
+# include <string.h>
+# include <errno.h>
+# include <math.h>
+# include <stdint.h>
+# include <fcntl.h>	// O_RDWR
+# include <unistd.h>
+# include <pthread.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+
+#define QF_STORAGE static __thread	// qf_init() per worker thread
+#include "lodepng.h"
+#include "sfm_uid.h"
+#include "sfm_qr.h"
+
+#define SFT_MAGIC		"SFMTHB1"
+#define SFT_DEFAULT_FILE	"thumbs.sft"
+#define SFT_DEFAULT_SIZE	160	// thumbnails fit into size x size
+#define SFT_CHANNELS		3	// RGB
+
+struct sft_hdr {
+	char magic[8];
+	uint32_t thumb_size;
+	uint32_t pad;
+	uint64_t index_off;		// 0: no index yet
+	uint64_t index_count;
+};
+
+struct sft_rec {
+	uint64_t uid;
+	uint16_t w, h;
+	uint8_t channels;
+	uint8_t pad[3];
+	uint32_t len;			// bytes of pixels following
+	char name[48];			// basename of the photo
+};
+
+struct sft_idx {
+	uint64_t uid;
+	uint64_t off;			// of the struct sft_rec
+};
+
+struct photo_job {
+	uint64_t uid;
+	char letter;
+	const char *path;
+};
+
+// shared between the worker threads
+static struct {
+	int (*fn)(struct photo_job *job);
+	struct photo_job *jobs;
+	unsigned njobs;
+	unsigned next;			// next job to take, atomic
+	unsigned thumb_size;
+	int fd;
+	pthread_mutex_t lock;		// protects end, index, nindex, errors
+	uint64_t end;
+	struct sft_idx *index;
+	unsigned nindex, errors;
+} pool;
+
+
+/*
+ * Area averaging downscaler: every source pixel is added to exactly one
+ * destination pixel, so the cost is one pass over the photo. The column
+ * mapping is precomputed, rows are accumulated until the next output row.
+ */
+void box_downscale(const unsigned char *rgba, unsigned sw, unsigned sh,
+		   unsigned char *out, unsigned tw, unsigned th)
+{
+	unsigned *xmap = (unsigned *)malloc(sw * sizeof(unsigned));
+	unsigned *xcount = (unsigned *)calloc(tw, sizeof(unsigned));
+	uint32_t *acc = (uint32_t *)calloc(tw * SFT_CHANNELS, sizeof(uint32_t));
+
+	for (unsigned sx = 0; sx < sw; sx++)
+	{
+		xmap[sx] = (uint64_t)sx * tw / sw;
+		xcount[xmap[sx]]++;
+	}
+	unsigned sy = 0;
+	for (unsigned ty = 0; ty < th; ty++)
+	{
+		unsigned sy_end = (uint64_t)(ty + 1) * sh / th;
+		unsigned rows = sy_end - sy;
+		memset(acc, 0, tw * SFT_CHANNELS * sizeof(uint32_t));
+		for (; sy < sy_end; sy++)
+		{
+			const unsigned char *p = rgba + (size_t)sy * sw * 4;
+			for (unsigned sx = 0; sx < sw; sx++, p += 4)
+			{
+				uint32_t *a = acc + xmap[sx] * SFT_CHANNELS;
+				a[0] += p[0];
+				a[1] += p[1];
+				a[2] += p[2];
+			}
+		}
+		for (unsigned tx = 0; tx < tw; tx++)
+		{
+			unsigned area = xcount[tx] * rows;
+			for (unsigned c = 0; c < SFT_CHANNELS; c++)
+				*out++ = area ? (acc[tx * SFT_CHANNELS + c] + area / 2) / area : 255;
+		}
+	}
+	free(xmap);
+	free(xcount);
+	free(acc);
+}
+
+
+// thumbnail size, keeping the aspect ratio.
+static void thumb_dim(unsigned w, unsigned h, unsigned size, unsigned *tw, unsigned *th)
+{
+	if (w <= size && h <= size)
+	{
+		*tw = w;
+		*th = h;
+	}
+	else if (w >= h)
+	{
+		*tw = size;
+		*th = (h * size + w / 2) / w;
+	}
+	else
+	{
+		*th = size;
+		*tw = (w * size + h / 2) / h;
+	}
+	if (!*tw) *tw = 1;
+	if (!*th) *th = 1;
+}
+
+
+static int ingest_one(struct photo_job *job)
+{
+	unsigned char *rgba = NULL;
+	unsigned w, h, tw, th;
+	unsigned error = lodepng_decode32_file(&rgba, &w, &h, job->path);
+	if (error)
+	{
+		printf("%s: PNG error %u: %s\n", job->path, error, lodepng_error_text(error));
+		return -1;
+	}
+	thumb_dim(w, h, pool.thumb_size, &tw, &th);
+
+	struct sft_rec rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.uid = job->uid;
+	rec.w = tw;
+	rec.h = th;
+	rec.channels = SFT_CHANNELS;
+	rec.len = tw * th * SFT_CHANNELS;
+	const char *base = strrchr(job->path, '/');
+	snprintf(rec.name, sizeof(rec.name), "%s", base ? base + 1 : job->path);
+
+	unsigned char *buf = (unsigned char *)malloc(sizeof(rec) + rec.len);
+	box_downscale(rgba, w, h, buf + sizeof(rec), tw, th);
+	free(rgba);
+	memcpy(buf, &rec, sizeof(rec));
+
+	// only the space is reserved under the lock, the writes run in parallel.
+	pthread_mutex_lock(&pool.lock);
+	uint64_t off = pool.end;
+	pool.end += sizeof(rec) + rec.len;
+	pool.index[pool.nindex].uid = rec.uid;
+	pool.index[pool.nindex].off = off;
+	pool.nindex++;
+	pthread_mutex_unlock(&pool.lock);
+
+	int ret = 0;
+	if (pwrite(pool.fd, buf, sizeof(rec) + rec.len, off) != (ssize_t)(sizeof(rec) + rec.len))
+	{
+		printf("ERROR: write failed: errno=%d\n", errno);
+		ret = -1;
+	}
+	free(buf);
+	return ret;
+}
+
+
+static void *pool_worker(void *arg)
+{
+	(void)arg;
+	for (;;)
+	{
+		unsigned i = __atomic_fetch_add(&pool.next, 1, __ATOMIC_RELAXED);
+		if (i >= pool.njobs)
+			break;
+		if (pool.fn(pool.jobs + i))
+		{
+			pthread_mutex_lock(&pool.lock);
+			pool.errors++;
+			pthread_mutex_unlock(&pool.lock);
+		}
+	}
+	return NULL;
+}
+
+
+// photos are taken one at a time by nthreads workers, big photos do not block the others.
+static void run_pool(int (*fn)(struct photo_job *job), unsigned nthreads)
+{
+	pool.fn = fn;
+	pool.next = 0;
+	pthread_t *threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+	for (unsigned t = 0; t < nthreads; t++)
+		pthread_create(threads + t, NULL, pool_worker, NULL);
+	for (unsigned t = 0; t < nthreads; t++)
+		pthread_join(threads[t], NULL);
+	free(threads);
+}
+
+
+static int idx_cmp(const void *a, const void *b)
+{
+	const struct sft_idx *x = (const struct sft_idx *)a, *y = (const struct sft_idx *)b;
+	if (x->uid != y->uid)
+		return (x->uid < y->uid) ? -1 : 1;
+	return (x->off < y->off) ? -1 : (x->off > y->off);
+}
+
+
+static int sft_add(const char *path, struct photo_job *jobs, unsigned njobs, unsigned nthreads, unsigned thumb_size)
+{
+	struct sft_hdr hdr;
+	struct stat st;
+
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || fstat(fd, &st))
+	{
+		printf("ERROR: cannot open %s: errno=%d\n", path, errno);
+		return 1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	if (st.st_size == 0)
+	{
+		memcpy(hdr.magic, SFT_MAGIC, sizeof(hdr.magic));
+		hdr.thumb_size = thumb_size;
+		st.st_size = sizeof(hdr);
+	}
+	else if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr.magic, SFT_MAGIC, sizeof(hdr.magic)))
+	{
+		printf("ERROR: %s is not a shelfman thumbnail file\n", path);
+		close(fd);
+		return 1;
+	}
+
+	memset(&pool, 0, sizeof(pool));
+	pool.jobs = jobs;
+	pool.njobs = njobs;
+	pool.thumb_size = hdr.thumb_size;
+	pool.fd = fd;
+	pool.end = st.st_size;		// append after everything, the old index stays valid until the end.
+	pthread_mutex_init(&pool.lock, NULL);
+	pool.index = (struct sft_idx *)malloc((hdr.index_count + njobs) * sizeof(struct sft_idx));
+	if (hdr.index_count &&
+	    pread(fd, pool.index, hdr.index_count * sizeof(struct sft_idx), hdr.index_off) != (ssize_t)(hdr.index_count * sizeof(struct sft_idx)))
+	{
+		printf("ERROR: cannot read the index of %s\n", path);
+		close(fd);
+		return 1;
+	}
+	pool.nindex = hdr.index_count;
+
+	run_pool(ingest_one, nthreads);
+
+	qsort(pool.index, pool.nindex, sizeof(struct sft_idx), idx_cmp);
+	hdr.index_off = pool.end;
+	hdr.index_count = pool.nindex;
+	size_t ilen = pool.nindex * sizeof(struct sft_idx);
+	int ret = 0;
+	if (pwrite(fd, pool.index, ilen, hdr.index_off) != (ssize_t)ilen || fdatasync(fd) ||
+	    pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fdatasync(fd))
+	{
+		printf("ERROR: cannot write the index of %s: errno=%d\n", path, errno);
+		ret = 1;
+	}
+	printf("%u photos added, %u errors, %llu thumbnails in %s\n", njobs - pool.errors, pool.errors,
+		(unsigned long long)hdr.index_count, path);
+	free(pool.index);
+	close(fd);
+	return ret || pool.errors;
+}
+
+
+struct sft_map {
+	size_t len;
+	const uint8_t *base;
+	const struct sft_hdr *hdr;
+	const struct sft_idx *index;
+};
+
+static int sft_map(const char *path, struct sft_map *m)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) || (size_t)st.st_size < sizeof(struct sft_hdr))
+	{
+		printf("ERROR: cannot open %s: errno=%d\n", path, errno);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+	m->len = st.st_size;
+	m->base = (const uint8_t *)p;
+	m->hdr = (const struct sft_hdr *)p;
+	m->index = (const struct sft_idx *)(m->base + m->hdr->index_off);
+	if (memcmp(m->hdr->magic, SFT_MAGIC, sizeof(m->hdr->magic)) ||
+	    m->hdr->index_off + m->hdr->index_count * sizeof(struct sft_idx) > m->len)
+	{
+		printf("ERROR: %s is not a shelfman thumbnail file\n", path);
+		munmap(p, st.st_size);
+		return -1;
+	}
+	return 0;
+}
+
+
+// first index entry with this uid, binary search.
+static uint64_t sft_lower_bound(struct sft_map *m, uint64_t uid)
+{
+	uint64_t lo = 0, hi = m->hdr->index_count;
+	while (lo < hi)
+	{
+		uint64_t mid = (lo + hi) / 2;
+		if (m->index[mid].uid < uid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+
+static void write_ppm(const char *filename, const struct sft_rec *r)
+{
+	FILE *fp = fopen(filename, "wb");
+	if (!fp)
+	{
+		printf("ERROR: cannot write %s\n", filename);
+		return;
+	}
+	fprintf(fp, "P6\n%u %u\n255\n", r->w, r->h);
+	fwrite(r + 1, 1, r->len, fp);
+	fclose(fp);
+}
+
+
+// lines of 'uid path'. The uid applies to all following lines that have only a path.
+static struct photo_job *read_jobs(FILE *fp, unsigned *njobs)
+{
+	char line[1024];
+	unsigned n = 0, cap = 1024;
+	struct photo_job *jobs = (struct photo_job *)malloc(cap * sizeof(struct photo_job));
+	uint64_t uid = 0;
+	char letter = 'X';
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		char *a = strtok(line, " \t\r\n");
+		char *b = strtok(NULL, "\r\n");
+		if (!a || a[0] == '#')
+			continue;
+		if (b)
+		{
+			if (sfm_parse_any(a, &letter, &uid))
+			{
+				printf("ERROR: bad uid '%s'\n", a);
+				continue;
+			}
+			while (*b == ' ' || *b == '\t') b++;
+			a = b;
+		}
+		if (!uid)
+		{
+			printf("ERROR: no uid for %s\n", a);
+			continue;
+		}
+		if (n == cap)
+			jobs = (struct photo_job *)realloc(jobs, (cap *= 2) * sizeof(struct photo_job));
+		jobs[n].uid = uid;
+		jobs[n].letter = letter;
+		jobs[n].path = strdup(a);
+		n++;
+	}
+	*njobs = n;
+	return jobs;
+}
+
+
+/*
+ * Scanning photos for shelfman labels. A small camera decoder: adaptive
+ * threshold, finder patterns from 1:1:3:1:1 runs, the three finders of a code
+ * give its position and version, the alignment pattern corrects perspective,
+ * then the modules are sampled and decoded with Reed-Solomon error correction.
+ *
+ * We only look for our own labels: SFM payloads need versions 1 .. 3 (see
+ * qr_build_table(), older labels were always version 3), so finder triples
+ * that imply a bigger code are dropped before sampling, and only texts that
+ * sfm_parse() accepts are reported.
+ */
+#define SCAN_MAX_VERSION	4	// one more, the version estimate of a tilted code can be off
+#define SCAN_BLOCK		8	// pixels, adaptive threshold
+#define SCAN_MAX_FINDERS	64
+#define SCAN_MAX_CODES		16	// per photo
+
+struct scan_finder {
+	float x, y, module;
+	unsigned count;			// number of rows it was found on
+	bool used;
+};
+
+struct scan_img {
+	unsigned w, h;
+	uint8_t *bits;			// one byte per pixel, 1 = dark
+	struct scan_finder f[SCAN_MAX_FINDERS];
+	unsigned nf;
+};
+
+static uint8_t gf_exp[512], gf_log[256];
+
+
+static void gf_init(void)
+{
+	unsigned x = 1;
+	for (unsigned i = 0; i < 255; i++)
+	{
+		gf_exp[i] = gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x & 0x100)
+			x ^= 0x11d;
+	}
+	gf_exp[510] = gf_exp[0];
+	gf_exp[511] = gf_exp[1];
+}
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+	return (a && b) ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static inline uint8_t gf_div(uint8_t a, uint8_t b)
+{
+	return a ? gf_exp[gf_log[a] + 255 - gf_log[b]] : 0;
+}
+
+
+/*
+ * Corrects a block of n codewords with nsym ecc codewords in place.
+ * Berlekamp-Massey, Chien search and Forney, the generator roots start at 1
+ * as in qf_init(). Returns the number of corrected codewords or -1.
+ */
+static int rs_correct(uint8_t *blk, unsigned n, unsigned nsym)
+{
+	uint8_t S[QR_FIXED_MAX_ECC], C[QR_FIXED_MAX_ECC + 1], B[QR_FIXED_MAX_ECC + 1], T[QR_FIXED_MAX_ECC + 1];
+	uint8_t O[QR_FIXED_MAX_ECC];
+	unsigned pos[QR_FIXED_MAX_ECC], nerr = 0;
+	bool any = false;
+
+	for (unsigned i = 0; i < nsym; i++)
+	{
+		uint8_t y = 0;
+		for (unsigned j = 0; j < n; j++)
+			y = gf_mul(y, gf_exp[i]) ^ blk[j];
+		S[i] = y;
+		any |= y;
+	}
+	if (!any)
+		return 0;
+
+	// error locator C(x)
+	memset(C, 0, sizeof(C));
+	memset(B, 0, sizeof(B));
+	C[0] = B[0] = 1;
+	unsigned L = 0, m = 1;
+	uint8_t b = 1;
+	for (unsigned k = 0; k < nsym; k++)
+	{
+		uint8_t d = S[k];
+		for (unsigned i = 1; i <= L; i++)
+			d ^= gf_mul(C[i], S[k - i]);
+		if (!d)
+		{
+			m++;
+			continue;
+		}
+		uint8_t coef = gf_div(d, b);
+		memcpy(T, C, sizeof(C));
+		for (unsigned i = 0; i + m <= nsym; i++)
+			C[i + m] ^= gf_mul(coef, B[i]);
+		if (2 * L <= k)
+		{
+			L = k + 1 - L;
+			memcpy(B, T, sizeof(B));
+			b = d;
+			m = 1;
+		}
+		else
+			m++;
+	}
+	if (2 * L > nsym)
+		return -1;
+
+	// roots of C(x) at alpha^-p, p is the degree of the wrong codeword.
+	for (unsigned p = 0; p < n; p++)
+	{
+		uint8_t xinv = gf_exp[(255 - p) % 255], v = 0;
+		for (int i = L; i >= 0; i--)
+			v = gf_mul(v, xinv) ^ C[i];
+		if (!v)
+			pos[nerr++] = p;
+	}
+	if (nerr != L)
+		return -1;
+
+	// error evaluator O(x) = S(x) C(x) mod x^nsym, and the magnitudes.
+	memset(O, 0, sizeof(O));
+	for (unsigned i = 0; i < nsym; i++)
+		for (unsigned j = 0; j <= L && i + j < nsym; j++)
+			O[i + j] ^= gf_mul(S[i], C[j]);
+	for (unsigned k = 0; k < nerr; k++)
+	{
+		unsigned p = pos[k];
+		uint8_t xinv = gf_exp[(255 - p) % 255], om = 0, dl = 0;
+		for (int i = nsym - 1; i >= 0; i--)
+			om = gf_mul(om, xinv) ^ O[i];
+		for (unsigned i = 1; i <= L; i += 2)
+			dl ^= gf_mul(C[i], gf_exp[(gf_log[xinv] * (i - 1)) % 255]);
+		if (!dl)
+			return -1;
+		blk[n - 1 - p] ^= gf_mul(gf_exp[p], gf_div(om, dl));
+	}
+	return nerr;
+}
+
+
+/*
+ * Adaptive threshold in place, gray becomes 1 = dark. The threshold of a
+ * block is the mean of the 5x5 blocks around it, flat blocks count as light
+ * unless their neighbours are darker.
+ */
+static void scan_binarize(uint8_t *gray, unsigned w, unsigned h)
+{
+	unsigned bw = (w + SCAN_BLOCK - 1) / SCAN_BLOCK, bh = (h + SCAN_BLOCK - 1) / SCAN_BLOCK;
+	uint8_t *avg = (uint8_t *)malloc(bw * bh);
+
+	for (unsigned by = 0; by < bh; by++)
+	{
+		for (unsigned bx = 0; bx < bw; bx++)
+		{
+			unsigned min = 255, max = 0, sum = 0, n = 0;
+			for (unsigned y = by * SCAN_BLOCK; y < (by + 1) * SCAN_BLOCK && y < h; y++)
+			{
+				const uint8_t *p = gray + (size_t)y * w;
+				for (unsigned x = bx * SCAN_BLOCK; x < (bx + 1) * SCAN_BLOCK && x < w; x++, n++)
+				{
+					sum += p[x];
+					if (p[x] < min) min = p[x];
+					if (p[x] > max) max = p[x];
+				}
+			}
+			unsigned a = sum / n;
+			if (max - min <= 24)
+			{
+				a = min / 2;
+				if (by > 0 && bx > 0)
+				{
+					unsigned nb = (avg[(by - 1) * bw + bx] + 2 * avg[by * bw + bx - 1] + avg[(by - 1) * bw + bx - 1]) / 4;
+					if (min < nb)
+						a = nb;
+				}
+			}
+			avg[by * bw + bx] = a;
+		}
+	}
+	for (unsigned by = 0; by < bh; by++)
+	{
+		for (unsigned bx = 0; bx < bw; bx++)
+		{
+			unsigned sum = 0, n = 0;
+			for (int dy = -2; dy <= 2; dy++)
+			{
+				for (int dx = -2; dx <= 2; dx++)
+				{
+					int yy = by + dy, xx = bx + dx;
+					if (yy >= 0 && yy < (int)bh && xx >= 0 && xx < (int)bw)
+					{
+						sum += avg[yy * bw + xx];
+						n++;
+					}
+				}
+			}
+			unsigned t = sum / n;
+			for (unsigned y = by * SCAN_BLOCK; y < (by + 1) * SCAN_BLOCK && y < h; y++)
+			{
+				uint8_t *p = gray + (size_t)y * w;
+				for (unsigned x = bx * SCAN_BLOCK; x < (bx + 1) * SCAN_BLOCK && x < w; x++)
+					p[x] = (p[x] <= t);
+			}
+		}
+	}
+	free(avg);
+}
+
+
+static inline int scan_dark(const struct scan_img *s, int x, int y)
+{
+	return (x >= 0 && y >= 0 && x < (int)s->w && y < (int)s->h) ? s->bits[(size_t)y * s->w + x] : -1;
+}
+
+
+// 1:1:3:1:1 with half a module tolerance.
+static bool finder_ratio(const unsigned *c)
+{
+	unsigned total = c[0] + c[1] + c[2] + c[3] + c[4];
+	if (total < 7)
+		return false;
+	float m = total / 7.0f, v = m / 2;
+	return fabsf(c[0] - m) < v && fabsf(c[1] - m) < v && fabsf(c[2] - 3 * m) < 3 * v &&
+	       fabsf(c[3] - m) < v && fabsf(c[4] - m) < v;
+}
+
+
+// consecutive pixels of one color, starting at x,y. Stops after limit.
+static unsigned scan_run(const struct scan_img *s, int x, int y, int dx, int dy, int dark, unsigned limit)
+{
+	unsigned n = 0;
+	while (n <= limit && scan_dark(s, x + n * dx, y + n * dy) == dark)
+		n++;
+	return n;
+}
+
+
+/*
+ * Checks a finder candidate along one axis through x,y, which must be in the
+ * center. Returns the center on that axis or -1, *total is the pattern width.
+ */
+static float cross_check(const struct scan_img *s, int x, int y, int dx, int dy, unsigned ref_total, unsigned *total)
+{
+	unsigned c[5], max = ref_total;
+	int t0 = dx ? x : y;
+
+	unsigned back = scan_run(s, x, y, -dx, -dy, 1, max);
+	c[1] = scan_run(s, x - back * dx, y - back * dy, -dx, -dy, 0, max);
+	c[0] = scan_run(s, x - (back + c[1]) * dx, y - (back + c[1]) * dy, -dx, -dy, 1, max);
+	unsigned fwd = scan_run(s, x + dx, y + dy, dx, dy, 1, max);
+	c[3] = scan_run(s, x + (fwd + 1) * dx, y + (fwd + 1) * dy, dx, dy, 0, max);
+	c[4] = scan_run(s, x + (fwd + 1 + c[3]) * dx, y + (fwd + 1 + c[3]) * dy, dx, dy, 1, max);
+	c[2] = back + fwd;
+	if (!back || !c[0] || !c[1] || !c[3] || !c[4])
+		return -1;
+
+	*total = c[0] + c[1] + c[2] + c[3] + c[4];
+	if (5 * abs((int)*total - (int)ref_total) >= 2 * (int)ref_total || !finder_ratio(c))
+		return -1;
+	return t0 + 1 + ((float)fwd - (float)back) / 2;
+}
+
+
+static void add_finder(struct scan_img *s, float x, float y, float module)
+{
+	for (unsigned i = 0; i < s->nf; i++)
+	{
+		struct scan_finder *f = s->f + i;
+		if (fabsf(x - f->x) <= f->module * 2 && fabsf(y - f->y) <= f->module * 2 &&
+		    fabsf(module - f->module) <= (f->module > 1 ? f->module : 1))
+		{
+			f->x = (f->x * f->count + x) / (f->count + 1);
+			f->y = (f->y * f->count + y) / (f->count + 1);
+			f->module = (f->module * f->count + module) / (f->count + 1);
+			f->count++;
+			return;
+		}
+	}
+	if (s->nf < SCAN_MAX_FINDERS)
+	{
+		struct scan_finder *f = s->f + s->nf++;
+		f->x = x;
+		f->y = y;
+		f->module = module;
+		f->count = 1;
+		f->used = false;
+	}
+}
+
+
+// all rows, runs of dark, light, dark, light, dark are checked as finder candidates.
+static void scan_finders(struct scan_img *s)
+{
+	for (unsigned y = 0; y < s->h; y++)
+	{
+		const uint8_t *row = s->bits + (size_t)y * s->w;
+		unsigned c[5] = { 0, 0, 0, 0, 0 }, nruns = 0, x = 0;
+		while (x < s->w)
+		{
+			unsigned start = x;
+			uint8_t v = row[x];
+			while (x < s->w && row[x] == v)
+				x++;
+			memmove(c, c + 1, 4 * sizeof(unsigned));
+			c[4] = x - start;
+			if (++nruns < 5 || !v || !finder_ratio(c))
+				continue;
+
+			unsigned htotal = c[0] + c[1] + c[2] + c[3] + c[4], vtotal, htotal2;
+			int cx = x - c[4] - c[3] - c[2] / 2;
+			float cy = cross_check(s, cx, y, 0, 1, htotal, &vtotal);
+			if (cy < 0)
+				continue;
+			float fx = cross_check(s, cx, (int)cy, 1, 0, htotal, &htotal2);
+			if (fx < 0)
+				continue;
+			add_finder(s, fx, cy, (htotal2 + vtotal) / 14.0f);
+		}
+	}
+}
+
+
+// projective transform, row vector times matrix as in zxing's PerspectiveTransform.
+struct persp {
+	double a[9];
+};
+
+static struct persp square_to_quad(const double *p)
+{
+	struct persp t;
+	double dx3 = p[0] - p[2] + p[4] - p[6], dy3 = p[1] - p[3] + p[5] - p[7];
+	if (dx3 == 0 && dy3 == 0)
+	{
+		double a[9] = { p[2] - p[0], p[3] - p[1], 0, p[4] - p[2], p[5] - p[3], 0, p[0], p[1], 1 };
+		memcpy(t.a, a, sizeof(a));
+	}
+	else
+	{
+		double dx1 = p[2] - p[4], dx2 = p[6] - p[4], dy1 = p[3] - p[5], dy2 = p[7] - p[5];
+		double den = dx1 * dy2 - dx2 * dy1;
+		double a13 = (dx3 * dy2 - dx2 * dy3) / den, a23 = (dx1 * dy3 - dx3 * dy1) / den;
+		double a[9] = { p[2] - p[0] + a13 * p[2], p[3] - p[1] + a13 * p[3], a13,
+				p[6] - p[0] + a23 * p[6], p[7] - p[1] + a23 * p[7], a23, p[0], p[1], 1 };
+		memcpy(t.a, a, sizeof(a));
+	}
+	return t;
+}
+
+// maps the quad src (4 points, tl tr br bl) onto the quad dst.
+static struct persp quad_to_quad(const double *src, const double *dst)
+{
+	struct persp s = square_to_quad(src), d = square_to_quad(dst), q, r;
+	const double *a = s.a;
+	// the adjoint inverts s, up to a factor that does not matter here.
+	double adj[9] = {
+		a[4] * a[8] - a[5] * a[7], a[2] * a[7] - a[1] * a[8], a[1] * a[5] - a[2] * a[4],
+		a[5] * a[6] - a[3] * a[8], a[0] * a[8] - a[2] * a[6], a[2] * a[3] - a[0] * a[5],
+		a[3] * a[7] - a[4] * a[6], a[1] * a[6] - a[0] * a[7], a[0] * a[4] - a[1] * a[3] };
+	memcpy(q.a, adj, sizeof(adj));
+	for (unsigned i = 0; i < 3; i++)
+		for (unsigned j = 0; j < 3; j++)
+			r.a[i * 3 + j] = q.a[i * 3] * d.a[j] + q.a[i * 3 + 1] * d.a[3 + j] + q.a[i * 3 + 2] * d.a[6 + j];
+	return r;
+}
+
+static void persp_map(const struct persp *t, double x, double y, double *ox, double *oy)
+{
+	const double *a = t->a;
+	double den = a[2] * x + a[5] * y + a[8];
+	*ox = (a[0] * x + a[3] * y + a[6]) / den;
+	*oy = (a[1] * x + a[4] * y + a[7]) / den;
+}
+
+
+/*
+ * The alignment pattern near px,py: its rings and the dark center give
+ * dark, light, dark, light, dark runs, the inner three of one module.
+ * Returns true with the center in *ax, *ay.
+ */
+static bool find_alignment(const struct scan_img *s, float px, float py, float module, float *ax, float *ay)
+{
+	int r = (int)(module * 4) + 2;
+	float best = -1;
+	unsigned lim = (unsigned)(module * 1.5f) + 1;
+
+	for (int y = (int)py - r; y <= (int)py + r; y++)
+	{
+		for (int x = (int)px - r; x <= (int)px + r; x++)
+		{
+			// x,y must be the first pixel of the dark center, after light.
+			if (scan_dark(s, x, y) != 1 || scan_dark(s, x - 1, y) != 0)
+				continue;
+			unsigned c = scan_run(s, x, y, 1, 0, 1, lim);
+			unsigned l0 = scan_run(s, x - 1, y, -1, 0, 0, lim);
+			unsigned l1 = scan_run(s, x + c, y, 1, 0, 0, lim);
+			if (fabsf(c - module) >= module / 2 || fabsf(l0 - module) >= module / 2 || fabsf(l1 - module) >= module / 2 ||
+			    scan_dark(s, x - 1 - l0, y) != 1 || scan_dark(s, x + c + l1, y) != 1)
+				continue;
+			int cx = x + c / 2;
+			unsigned up = scan_run(s, cx, y, 0, -1, 1, lim), down = scan_run(s, cx, y + 1, 0, 1, 1, lim);
+			unsigned lu = scan_run(s, cx, y - up, 0, -1, 0, lim), ld = scan_run(s, cx, y + 1 + down, 0, 1, 0, lim);
+			if (fabsf(up + down - module) >= module / 2 || fabsf(lu - module) >= module / 2 || fabsf(ld - module) >= module / 2 ||
+			    scan_dark(s, cx, y - up - lu) != 1 || scan_dark(s, cx, y + 1 + down + ld) != 1)
+				continue;
+			float fx = x + c / 2.0f, fy = y + 1 + ((float)down - (float)up) / 2;
+			float d = (fx - px) * (fx - px) + (fy - py) * (fy - py);
+			if (best < 0 || d < best)
+			{
+				best = d;
+				*ax = fx;
+				*ay = fy;
+			}
+		}
+	}
+	return best >= 0;
+}
+
+
+// samples the modules through t and decodes them. text needs QR_FIXED_MAX_CODEWORDS+1.
+static int scan_sample(const struct scan_img *s, const struct persp *t, unsigned version, char *text)
+{
+	uint8_t m[QR_FIXED_MAX_SIZE * QR_FIXED_MAX_SIZE];
+	uint8_t cw[QR_FIXED_MAX_CODEWORDS], data[QR_FIXED_MAX_CODEWORDS], blk[QR_FIXED_MAX_CODEWORDS];
+	unsigned size = 17 + 4 * version;
+
+	for (unsigned j = 0; j < size; j++)
+	{
+		for (unsigned i = 0; i < size; i++)
+		{
+			double x, y;
+			persp_map(t, i + 0.5, j + 0.5, &x, &y);
+			int v = scan_dark(s, (int)x, (int)y);
+			if (v < 0)
+				return -1;
+			m[j * size + i] = v;
+		}
+	}
+
+	unsigned ecc_level, mask;
+	if (qf_read_format(m, size, &ecc_level, &mask) > 3)
+		return -1;
+	if (qf.version != version || qf.ecc_level != ecc_level)
+		qf_init(version, ecc_level);
+	qf_read_codewords(m, mask, cw);
+	for (unsigned i = 0, k = 0; i < qf.num_blocks; i++)
+	{
+		unsigned dat_len = qf_block(cw, i, blk);
+		if (rs_correct(blk, dat_len + qf.block_ecc_len, qf.block_ecc_len) < 0)
+			return -1;
+		memcpy(data + k, blk, dat_len);
+		k += dat_len;
+	}
+	if (qf_decode_text(data, text) < 0 || sfm_parse(text, NULL, NULL))
+		return -1;
+	return 0;
+}
+
+
+/*
+ * Decodes the code of one finder triple. The fourth corner is first taken
+ * from the alignment pattern, which corrects perspective. If that fails, e.g.
+ * because a data area looked like the alignment pattern, the three finders
+ * alone are used as a parallelogram.
+ */
+static int scan_decode(const struct scan_img *s, const struct scan_finder *tl, const struct scan_finder *tr,
+	const struct scan_finder *bl, unsigned version, char *text)
+{
+	unsigned size = 17 + 4 * version;
+	double e = size - 3.5;
+	double src[8] = { 3.5, 3.5, e, 3.5, e, e, 3.5, e };
+	double dst[8] = { tl->x, tl->y, tr->x, tr->y, tr->x + bl->x - tl->x, tr->y + bl->y - tl->y, bl->x, bl->y };
+	struct persp t = quad_to_quad(src, dst);
+
+	if (version >= 2)
+	{
+		double px, py, asrc[8], adst[8];
+		float ax = 0, ay = 0, module = (tl->module + tr->module + bl->module) / 3;
+		persp_map(&t, size - 6.5, size - 6.5, &px, &py);
+		if (find_alignment(s, px, py, module, &ax, &ay))
+		{
+			memcpy(asrc, src, sizeof(src));
+			memcpy(adst, dst, sizeof(dst));
+			asrc[4] = asrc[5] = size - 6.5;
+			adst[4] = ax;
+			adst[5] = ay;
+			struct persp ta = quad_to_quad(asrc, adst);
+			if (!scan_sample(s, &ta, version, text))
+				return 0;
+		}
+	}
+	return scan_sample(s, &t, version, text);
+}
+
+
+static float dist(const struct scan_finder *a, const struct scan_finder *b)
+{
+	return hypotf(a->x - b->x, a->y - b->y);
+}
+
+
+/*
+ * Tries all triples of finders with similar module sizes that form a right
+ * isosceles triangle. Returns the number of codes, payloads in codes[].
+ */
+static unsigned scan_codes(struct scan_img *s, char codes[][SFM_PAYLOAD_LEN + 1])
+{
+	unsigned ncodes = 0;
+	char text[QR_FIXED_MAX_CODEWORDS + 1];
+
+	for (unsigned i = 0; i < s->nf; i++)
+	{
+		for (unsigned j = i + 1; j < s->nf; j++)
+		{
+			for (unsigned k = j + 1; k < s->nf && ncodes < SCAN_MAX_CODES; k++)
+			{
+				struct scan_finder *a = s->f + i, *b = s->f + j, *c = s->f + k, *tmp;
+				if (a->used || b->used || c->used)
+					continue;
+				float mmin = fminf(a->module, fminf(b->module, c->module));
+				float mmax = fmaxf(a->module, fmaxf(b->module, c->module));
+				if (mmax > mmin * 1.5f)
+					continue;
+
+				// a is the corner opposite of the longest side.
+				float ab = dist(a, b), ac = dist(a, c), bc = dist(b, c);
+				if (ab > bc && ab > ac)
+				{
+					tmp = a; a = c; c = tmp;
+				}
+				else if (ac > bc && ac > ab)
+				{
+					tmp = a; a = b; b = tmp;
+				}
+				ab = dist(a, b);
+				ac = dist(a, c);
+				bc = dist(b, c);
+				if (fabsf(ab - ac) > 0.3f * fmaxf(ab, ac) || fabsf(bc * bc - ab * ab - ac * ac) > 0.3f * bc * bc)
+					continue;
+				// b is top right: clockwise from a in image coordinates.
+				if ((b->x - a->x) * (c->y - a->y) - (b->y - a->y) * (c->x - a->x) < 0)
+				{
+					tmp = b; b = c; c = tmp;
+				}
+
+				float module = (a->module + b->module + c->module) / 3;
+				int v = ((ab + ac) / 2 / module + 7 - 17 + 2) / 4;
+				static const int tries[3] = { 0, -1, 1 };
+				for (unsigned t = 0; t < 3; t++)
+				{
+					int version = v + tries[t];
+					if (version < 1 || version > SCAN_MAX_VERSION)
+						continue;
+					if (scan_decode(s, a, b, c, version, text))
+						continue;
+					a->used = b->used = c->used = true;
+					unsigned n;
+					for (n = 0; n < ncodes && strcmp(codes[n], text); n++)
+						;
+					if (n == ncodes)
+						memcpy(codes[ncodes++], text, SFM_PAYLOAD_LEN + 1);	// sfm_parse() checked the length
+					break;
+				}
+			}
+		}
+	}
+	return ncodes;
+}
+
+
+static int scan_one(struct photo_job *job)
+{
+	struct scan_img *s = (struct scan_img *)calloc(1, sizeof(struct scan_img));
+	char codes[SCAN_MAX_CODES][SFM_PAYLOAD_LEN + 1];
+	unsigned char *rgba = NULL;
+
+	unsigned error = lodepng_decode32_file(&rgba, &s->w, &s->h, job->path);
+	if (error)
+	{
+		printf("# %s: PNG error %u: %s\n", job->path, error, lodepng_error_text(error));
+		free(s);
+		return -1;
+	}
+	// luma in place, then the threshold in place.
+	for (size_t i = 0, n = (size_t)s->w * s->h; i < n; i++)
+		rgba[i] = (rgba[4 * i] * 77 + rgba[4 * i + 1] * 150 + rgba[4 * i + 2] * 29) >> 8;
+	scan_binarize(rgba, s->w, s->h);
+	s->bits = rgba;
+
+	scan_finders(s);
+	unsigned ncodes = scan_codes(s, codes);
+	free(rgba);
+	free(s);
+
+	pthread_mutex_lock(&pool.lock);
+	for (unsigned i = 0; i < ncodes; i++)
+		printf("%s %s\n", codes[i], job->path);
+	if (!ncodes)
+		printf("# no code: %s\n", job->path);
+	fflush(stdout);
+	pthread_mutex_unlock(&pool.lock);
+	return 0;
+}
+
+
+static int scan_photos(struct photo_job *jobs, unsigned njobs, unsigned nthreads)
+{
+	memset(&pool, 0, sizeof(pool));
+	pthread_mutex_init(&pool.lock, NULL);
+	pool.jobs = jobs;
+	pool.njobs = njobs;
+	gf_init();
+	run_pool(scan_one, nthreads);
+	return pool.errors ? 1 : 0;
+}
+
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-f thumbs.sft] [-j threads] [-s size] command ...\n", prog);
+	printf("  add [uid photo.png ...]   add photos of one uid, or from stdin: lines of 'uid photo.png',\n");
+	printf("                            a line with only a path belongs to the uid above.\n");
+	printf("  ls [uid]                  list the thumbnails\n");
+	printf("  get uid [prefix]          write the thumbnails of uid as prefix-N.ppm\n");
+	printf("  scan [photo.png ...]      find shelfman labels in photos, or in the paths from stdin.\n");
+	printf("                            Prints 'payload photo.png', e.g. '%s scan *.png | %s add'\n", prog, prog);
+	printf("uid is SFM-<letter>-xxxxxxxx-xxxx-xxxx or just xxxxxxxx-xxxx-xxxx. Default file: %s\n", SFT_DEFAULT_FILE);
+	printf("-s: thumbnails fit into size x size, default %u, only used when the file is created.\n", SFT_DEFAULT_SIZE);
+}
+
+
+int main(int ac, char **av)
+{
+	const char *path = SFT_DEFAULT_FILE;
+	unsigned nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned thumb_size = SFT_DEFAULT_SIZE;
+	int opt;
+
+	while ((opt = getopt(ac, av, "f:j:s:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'f': path = optarg; break;
+		case 'j': nthreads = atoi(optarg); break;
+		case 's': thumb_size = atoi(optarg); break;
+		default: usage(av[0]); return 1;
+		}
+	}
+	if (optind >= ac || !nthreads || !thumb_size)
+	{
+		usage(av[0]);
+		return 1;
+	}
+	const char *cmd = av[optind++];
+	char **args = av + optind;
+	int nargs = ac - optind;
+
+	if (!strcmp(cmd, "add"))
+	{
+		unsigned njobs = 0;
+		struct photo_job *jobs;
+		if (nargs)
+		{
+			uint64_t uid;
+			char letter;
+			if (nargs < 2 || sfm_parse_any(args[0], &letter, &uid))
+			{
+				usage(av[0]);
+				return 1;
+			}
+			jobs = (struct photo_job *)malloc(nargs * sizeof(struct photo_job));
+			for (int i = 1; i < nargs; i++, njobs++)
+			{
+				jobs[njobs].uid = uid;
+				jobs[njobs].letter = letter;
+				jobs[njobs].path = args[i];
+			}
+		}
+		else
+			jobs = read_jobs(stdin, &njobs);
+		return sft_add(path, jobs, njobs, nthreads, thumb_size);
+	}
+
+	if (!strcmp(cmd, "scan"))
+	{
+		unsigned njobs = 0, cap = nargs ? nargs : 1024;
+		struct photo_job *jobs = (struct photo_job *)calloc(cap, sizeof(struct photo_job));
+		char line[1024];
+		for (; (int)njobs < nargs; njobs++)
+			jobs[njobs].path = args[njobs];
+		while (!nargs && fgets(line, sizeof(line), stdin))
+		{
+			line[strcspn(line, "\r\n")] = '\0';
+			if (!line[0] || line[0] == '#')
+				continue;
+			if (njobs == cap)
+				jobs = (struct photo_job *)realloc(jobs, (cap *= 2) * sizeof(struct photo_job));
+			jobs[njobs++].path = strdup(line);
+		}
+		return scan_photos(jobs, njobs, nthreads);
+	}
+
+	struct sft_map m;
+	uint64_t uid = 0, i = 0;
+	char letter;
+	if ((!strcmp(cmd, "ls") && nargs <= 1) || (!strcmp(cmd, "get") && (nargs == 1 || nargs == 2)))
+	{
+		if (nargs && sfm_parse_any(args[0], &letter, &uid))
+		{
+			printf("ERROR: bad uid '%s'\n", args[0]);
+			return 1;
+		}
+		if (sft_map(path, &m))
+			return 1;
+		if (nargs)
+			i = sft_lower_bound(&m, uid);
+	}
+	else
+	{
+		usage(av[0]);
+		return 1;
+	}
+
+	unsigned n = 0;
+	for (; i < m.hdr->index_count && (!nargs || m.index[i].uid == uid); i++, n++)
+	{
+		const struct sft_rec *r = (const struct sft_rec *)(m.base + m.index[i].off);
+		char buf[SFM_PAYLOAD_LEN + 1];
+		sfm_format(buf, 'X', r->uid);
+		if (!strcmp(cmd, "ls"))
+			printf("%s %ux%u %.*s\n", buf + 6, r->w, r->h, (int)sizeof(r->name), r->name);
+		else
+		{
+			char filename[256];
+			snprintf(filename, sizeof(filename), "%s-%u.ppm", (nargs > 1) ? args[1] : buf + 6, n + 1);
+			write_ppm(filename, r);
+			printf("%s\n", filename);
+		}
+	}
+	munmap((void *)m.base, m.len);
+	if (nargs && !n)
+	{
+		printf("%s: not found\n", args[0]);
+		return 1;
+	}
+	return 0;
+}
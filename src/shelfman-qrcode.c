@@ -5,6 +5,7 @@
 # include <stdlib.h>	// for free()
 # include <stdio.h>		// for printf()
 # include <string.h>	// for memset()
+# include <ctype.h>		// for toupper()
 # include <errno.h>
 
 #ifdef __linux__
@@ -14,10 +15,24 @@
 # include <stdint.h>	// uint8_t, uint16_t
 # include <time.h>
 # include <sys/random.h>	// getrandom()
+# include <sys/mman.h>	// mmap()
+# include <sys/stat.h>	// fstat()
+# include <sys/file.h>	// flock()
+# include <sys/socket.h>
+# include <sys/un.h>		// sockaddr_un
+# include <poll.h>
+# include <signal.h>
+# include <termios.h>	// station serial port
+# include <glob.h>		// printer discovery
+# include <pthread.h>	// one sender thread per printer
+# include <getopt.h>	// --journal, --resume
+# include "ptouch_sim.h"	// -D sim
 # define sleep_ms(n) usleep(1000*(n))
 #else  // RP2040 Pico SDK
 # include "rp2040.h"
 # include "ptouch_rp2040.h"
+# include "station_uart.h"
+# include "uid_pool.h"
 # include "pico/stdlib.h"		// sleep_ms(), stdio_init_all()
 #ifdef RAW_UART
 # include "hardware/gpio.h"
@@ -27,16 +42,29 @@
 // # include "tusb.h"	// Includes tusb_config.h
 #endif
 
-#define DEBUG 1
+#ifndef DEBUG
+# define DEBUG 1
+#endif
+#if DEBUG > 0
+static int debug_out = 1;	// 0: no DEBUG output of the renderer at run time, --preview output is parsed.
+#endif
 
-#define BITS_PER_PIXEL 1	// 1 or 8.	both is implemented here.
+#define BITS_PER_PIXEL 1	// 1 or 8.	both is implemented here. The default of qr_config.bits_per_val.
 #define BIG_FONT_SIZE 24
 #define SMALL_FONT_SIZE 18
 #define LINE_ADVANCE_FACTOR 1.9
+#define FILENAME_LEN 256
+
+#define CODE_QR		0		// qr_config.symbology
+#define CODE_DM		1		// Data Matrix ECC 200
+#define CODE_AUTO	2		// whichever takes less tape
 
 struct qr_config {
 	// config for brother D410
 	unsigned max_height;		// my tape can print 120, although the printer could print 128.
+	unsigned dpi;			// print head resolution, for the minimum module size of the qr-code.
+	unsigned qr_upper;		// encode the uid in upper case. Alphanumeric mode, fast encoder.
+	unsigned symbology;		// CODE_QR, CODE_DM or CODE_AUTO
 	unsigned big_font_size;
 	unsigned small_font_size;
 	unsigned line_advance_perc;
@@ -46,6 +74,16 @@ struct qr_config {
 	const char *title_text;
 	const char *label_text_pre;
 	const char *outfile;
+	const char *input_png_file;	// optional background, only used WITH_PNG_SUPPORT
+	unsigned seq;			// label number in a batch, 0 for a single label.
+	unsigned strip_gap;		// pixels between the labels of a strip
+	unsigned cut_marks;		// draw a dashed line between the labels of a strip
+	unsigned print;			// send each outfile to the printer
+	const char *printer;		// for print: a usb printer, or a file that gets the printer stream
+	unsigned verify;		// decode each qr-code from the raster before saving
+	unsigned bits_per_val;		// of the label canvas: 1, or 8 for grayscale previews
+	struct label_archive *archive;	// each rendered label is appended, NULL: none. Linux only.
+	unsigned text_fit_warned;	// the text did not fit the tape, said once. See text_fit().
 };
 
 #ifndef WITH_PNG_SUPPORT
@@ -58,30 +96,34 @@ struct qr_config {
 // #define GLYPH_BUF_SIZE (24*48)		// 24 is the largest font size we have, and twice that wide is fairly large.
 
 #include "qrcodegen.h"
+#include "sfm_uid.h"
+#include "sfm_qr.h"
+#include "sfm_dm.h"
+#include "sfm_station.h"
+#include "sfm_ptouch.h"
 
-#define PROGMEM		/* NOOP */
+// the Adafruit GFX fonts, packed at build time by fontpack.c. More fonts are added there.
+#include "sfm_font.h"
+#include "sfm_fonts.h"
 
-#define _ADAFRUIT_GFX_H	/* so that nothing else gets included */
-#include "gfxfont.h"
-#include "Fonts/FreeSans9pt7b.h"
-#include "Fonts/FreeSans12pt7b.h"
-#include "Fonts/FreeSans18pt7b.h"
-#include "Fonts/FreeSans24pt7b.h"
-
-// #include "Fonts/FreeSansBold12pt7b.h"
-// #include "Fonts/FreeSansBold18pt7b.h"
-// #include "Fonts/FreeSansBold24pt7b.h"
-// #include "Fonts/FreeSansBold9pt7b.h"
-// #include "Fonts/FreeSerif12pt7b.h"
-// #include "Fonts/FreeSerif18pt7b.h"
-// #include "Fonts/FreeSerif24pt7b.h"
-// #include "Fonts/FreeSerif9pt7b.h"
+/*
+ * SFM_SRAM, rp2040 only (QRCODE_SRAM in CMakeLists.txt): the inner loops of
+ * the renderer are marked SFM_HOT, the SDK copies them to SRAM at boot, and
+ * the fonts are copied there when first used, see font_in_sram(). From
+ * flash, code, fonts and qr tables thrash the 16k XIP cache while a label
+ * is drawn, and each miss stalls the core on the QSPI flash.
+ */
+#if !defined(__linux__) && SFM_SRAM
+# define SFM_HOT(fn)	__not_in_flash_func(fn)
+#else
+# define SFM_HOT(fn)	fn
+#endif
 
 struct font {
   unsigned size;
   unsigned scale;
   int max_asc;			// initialized by find_font() - typically a negative number.
-  const GFXfont *ptr;
+  const struct sfm_font *ptr;
 } fonts[] = {
   { 9,  1, 0, &FreeSans9pt7b },
   { 12, 1, 0, &FreeSans12pt7b },
@@ -98,17 +140,50 @@ struct font {
 struct img {
   unsigned w, h;
   unsigned bits_per_val;
+  const struct render_core *core;	// loops for this format and height, set by img_new()
   unsigned char data[0];
 };
 
+// the specialised inner loops of one pixel format and canvas height, see sfm_render_core.h
+struct render_core {
+	unsigned h, bits_per_val;	// h 0: any height
+	void (*fill)(struct img *im, unsigned x, unsigned y, unsigned w, unsigned h, unsigned val);
+	void (*put_row)(struct img *im, unsigned x, unsigned y, const uint8_t *row, unsigned nbits);
+	int (*read_modules)(const struct img *im, unsigned x, unsigned y, unsigned cols, unsigned rows, unsigned spread, uint8_t *m);
+	unsigned (*ptouch_lines)(const struct img *im, uint8_t *out);
+};
+
+const struct render_core *render_core_select(unsigned h, unsigned bits_per_val);
+
+unsigned img_data_len(unsigned w, unsigned h, unsigned bits_per_val)
+{
+	return (bits_per_val == 1) ? (w * h / 8 + 1) : (w * h);
+}
+
+
+#define IMG_MAX_LEN	0x7fffffffu	// bytes of data, img_data_len() must not wrap
+
+// returns NULL if the image is too big or out of memory.
 struct img *img_new(unsigned w, unsigned h, int bits_per_val, unsigned char val)
 {
 	assert( (bits_per_val == 8) || (bits_per_val == 1) );
 
-    int data_len = (bits_per_val == 1) ? (w * h / 8 + 1) : (w * h);
-    struct img *im = (struct img *)calloc(sizeof(struct img) + data_len, 1);
+    if ((uint64_t)w * h > IMG_MAX_LEN)
+    {
+        printf("ERROR: img_new: %ux%u is too big\n", w, h);
+        return NULL;
+    }
+    unsigned data_len = img_data_len(w, h, bits_per_val);
+    // 8 spare bytes: the raster loops read whole bytes, also past the last row.
+    struct img *im = (struct img *)calloc(sizeof(struct img) + data_len + 8, 1);
+    if (!im)
+    {
+        printf("ERROR: img_new: no memory for %ux%u\n", w, h);
+        return NULL;
+    }
     im->w = w; im->h = h;
 	im->bits_per_val = bits_per_val;
+	im->core = render_core_select(h, bits_per_val);
 	memset(im->data, val, data_len);
 	return im;
 }
@@ -120,14 +195,13 @@ void img_free(struct img *im)
 }
 
 
-unsigned get_pixel(struct img *im, int x, int y)
+unsigned SFM_HOT(get_pixel)(struct img *im, int x, int y)
 {
-	// CAUTION: keep in sync with bits2img_fg() below.
     uint32_t pos = im->w * y + x;
 	if (im->bits_per_val == 8)
 		return im->data[pos];
 
-	uint16_t byte_idx = (pos / 8);
+	uint32_t byte_idx = (pos / 8);
 	uint8_t bit_idx = 7 - (pos % 8);
 	if (im->data[byte_idx] & (1 << bit_idx))
 		return 255;
@@ -135,19 +209,23 @@ unsigned get_pixel(struct img *im, int x, int y)
 }
 
 
-void set_pixel(struct img *im, int pos, int val)
+static inline void SFM_HOT(set_pixel_bits)(uint8_t *data, uint32_t pos, int val)
+{
+	uint32_t byte_idx = (pos / 8);
+	uint8_t bit_idx = 7 - (pos % 8);
+	if (val)
+		data[byte_idx] |= 1<<bit_idx;
+	else
+		data[byte_idx] &= ~(1<<bit_idx);
+}
+
+
+void SFM_HOT(set_pixel)(struct img *im, int pos, int val)
 {
 	if (im->bits_per_val == 8)
 		im->data[pos] = val;
 	else
-	{
-		uint16_t byte_idx = (pos / 8);
-		uint8_t bit_idx = 7 - (pos % 8);
-		if (val)
-			im->data[byte_idx] |= 1<<bit_idx;
-		else
-			im->data[byte_idx] &= ~(1<<bit_idx);
-	}
+		set_pixel_bits(im->data, pos, val);
 }
 
 
@@ -167,17 +245,21 @@ void img_save(struct img *im, const char *filename)
 	else
 	{
 		// I am lazy: P4 pbm binary is slightly different than struct img: it needs line padding and has bits flipped.
-		// P1 pbm ascii is simpler.
+		// P1 pbm ascii is simpler. Collected in one buffer, one write() per pixel is slow.
 		unsigned pos = 0;
+		char *out = (char *)malloc(im->w * im->h + im->w * im->h / 64 + 1);
+		char *p = out;
 		for (unsigned y=0; y < im->h; y++)
 		{
 			for (unsigned x=0; x < im->w; x++)
 			{
-				write(fd, get_pixel(im, x, y) ? "0" : "1", 1);	// white = 0, black = 1, no whitespace needed.
+				*p++ = get_pixel(im, x, y) ? '0' : '1';	// white = 0, black = 1, no whitespace needed.
 				if (++pos % 64 == 0)
-					write(fd, "\n", 1);
+					*p++ = '\n';
 			}
 		}
+		write(fd, out, p - out);
+		free(out);
 	}
     close(fd);
 #else  // RP2040 Pico SDK
@@ -212,58 +294,430 @@ void img_save(struct img *im, const char *filename)
 }
 
 
-void rectangle(struct img *im, unsigned x, unsigned y, unsigned w, unsigned h, unsigned val)
+/*
+ * Packed row helpers for 1 bit per pixel images.
+ * Rows of a struct img are not padded, row y starts at bit position w*y.
+ * Bits are MSB first, same as in get_pixel().
+ */
+#define BLIT_COPY	0
+#define BLIT_OR		1	// only set bits are copied (white pixels)
+#define BLIT_AND	2	// only cleared bits are copied (black pixels)
+
+// copy nbits starting at bit position pos into out, left aligned.
+static void SFM_HOT(bitrow_get)(const uint8_t *data, uint32_t pos, uint8_t *out, unsigned nbits)
+{
+	const uint8_t *p = data + pos / 8;
+	unsigned shift = pos % 8;
+	unsigned nbytes = (nbits + 7) / 8;
+
+	if (!shift)
+	{
+		memcpy(out, p, nbytes);
+		return;
+	}
+	for (unsigned i = 0; i < nbytes; i++)
+	{
+		// do not touch the next byte, if none of its bits are needed. It may be past the end.
+		uint8_t next = (8*i + 8 - shift < nbits) ? p[i+1] : 0;
+		out[i] = (p[i] << shift) | (next >> (8 - shift));
+	}
+}
+
+
+// write nbits from the left aligned in to bit position pos, combined according to mode.
+static void SFM_HOT(bitrow_put)(uint8_t *data, uint32_t pos, const uint8_t *in, unsigned nbits, unsigned mode)
 {
-    // unsigned char *p = im->data + y*im->w + x;
+	uint8_t *p = data + pos / 8;
+	unsigned shift = pos % 8;
 
-    for (unsigned int j = 0; j < h; j++)
-    {
-		for (unsigned int i = 0; i < w; i++)
+	for (unsigned i = 0; nbits; i++)
+	{
+		uint8_t m = (nbits >= 8) ? 0xff : (uint8_t)(0xff << (8 - nbits));
+		nbits -= (nbits >= 8) ? 8 : nbits;
+
+		// a source byte straddles two destination bytes, unless shift is 0.
+		uint16_t v16 = (uint16_t)(in[i] << 8) >> shift;
+		uint16_t m16 = (uint16_t)(m << 8) >> shift;
+		for (unsigned k = 0; k < 2; k++)
+		{
+			uint8_t v  = (k ? v16 : (v16 >> 8)) & 0xff;
+			uint8_t vm = (k ? m16 : (m16 >> 8)) & 0xff;
+			if (!vm) continue;
+			if (mode == BLIT_OR)
+				p[i+k] |= v & vm;
+			else if (mode == BLIT_AND)
+				p[i+k] &= ~(vm & ~v);
+			else
+				p[i+k] = (p[i+k] & ~vm) | (v & vm);
+		}
+	}
+}
+
+
+static void SFM_HOT(bitrow_fill)(uint8_t *data, uint32_t pos, unsigned nbits, unsigned val)
+{
+	uint8_t v = val ? 0xff : 0x00;
+	while (nbits && (pos % 8))
+	{
+		set_pixel_bits(data, pos++, val);
+		nbits--;
+	}
+	memset(data + pos / 8, v, nbits / 8);
+	pos += nbits & ~7u;
+	nbits %= 8;
+	while (nbits--)
+		set_pixel_bits(data, pos++, val);
+}
+
+
+// horizontal integer upscaling: each input bit becomes spread output bits. spread 2..8.
+// The tables are constant, built by the compiler: bit i of b becomes spread bits at i * spread.
+#define BX_BIT(b, i, s)	((uint64_t)(((b) >> (i)) & 1) * (((1ull << (s)) - 1) << ((i) * (s))))
+#define BX(b, s)	(BX_BIT(b, 7, s) | BX_BIT(b, 6, s) | BX_BIT(b, 5, s) | BX_BIT(b, 4, s) | \
+			 BX_BIT(b, 3, s) | BX_BIT(b, 2, s) | BX_BIT(b, 1, s) | BX_BIT(b, 0, s))
+#define BX4(b, s)	BX(b, s), BX(b + 1, s), BX(b + 2, s), BX(b + 3, s)
+#define BX16(b, s)	BX4(b, s), BX4(b + 4, s), BX4(b + 8, s), BX4(b + 12, s)
+#define BX64(b, s)	BX16(b, s), BX16(b + 16, s), BX16(b + 32, s), BX16(b + 48, s)
+#define BX256(s)	{ BX64(0, s), BX64(64, s), BX64(128, s), BX64(192, s) }
+
+static const uint64_t expand_tab[7][256] = { BX256(2), BX256(3), BX256(4), BX256(5), BX256(6), BX256(7), BX256(8) };
+
+static void SFM_HOT(bitrow_expand)(const uint8_t *in, unsigned nbits, unsigned spread, uint8_t *out)
+{
+	assert(spread >= 2 && spread <= 8);
+	const uint64_t *tab = expand_tab[spread - 2];
+	for (unsigned i = 0; i < (nbits + 7) / 8; i++)
+	{
+		uint64_t e = tab[in[i]];
+		for (unsigned k = 0; k < spread; k++)
+			*out++ = (uint8_t)(e >> (8 * (spread - 1 - k)));
+	}
+}
+
+
+void SFM_HOT(rectangle)(struct img *im, unsigned x, unsigned y, unsigned w, unsigned h, unsigned val)
+{
+	if ((x >= im->w) || (y >= im->h))
+		return;
+	if (w > im->w - x) w = im->w - x;
+	if (h > im->h - y) h = im->h - y;
+
+	im->core->fill(im, x, y, w, h, val);
+}
+
+
+// generic per pixel version of blit(), used for 8 bits per pixel, mixed formats and large spread values.
+static void SFM_HOT(blit_pixels)(struct img *src, unsigned sx, unsigned sy, unsigned sw, unsigned sh,
+          struct img *dst, unsigned dx, unsigned dy,
+          unsigned copy_b, unsigned copy_w, unsigned spread)
+{
+	for (unsigned j = 0; j < sh; j++)
+	{
+		for (unsigned i = 0; i < sw; i++)
 		{
-		    if (((x + i) < (im->w)) &&
-			    ((y + j) < (im->h)))
+			unsigned val = get_pixel(src, sx + i, sy + j);
+			if ((val == 0) ? copy_b : copy_w)
 			{
-				// p[j*im->w + i] = val;
-				set_pixel(im, im->w * (y + j) + x + i, val);
+				rectangle(dst, dx + spread * i, dy + spread * j, spread, spread, val);
 			}
 		}
 	}
 }
 
 
-void blit(struct img *src, unsigned sx, unsigned sy, unsigned sw, unsigned sh,
+void SFM_HOT(blit)(struct img *src, unsigned sx, unsigned sy, unsigned sw, unsigned sh,
           struct img *dst, unsigned dx, unsigned dy,
           unsigned char flags)
 {
-	assert(src->bits_per_val == dst->bits_per_val);
 	// flags |= 0x40 : do not copy black pixels
 	// flags |= 0x80 : do not copy white pixels
 	// remaining bits: (flags & 0x3f):	spread, min 1.
 
-	// unsigned char *ps = src->data + sy*src->w + sx;
-	// unsigned char *pd = dst->data + dy*dst->w + dx;
 	unsigned copy_b = (flags & 0x40) ? 0 : 1;
 	unsigned copy_w = (flags & 0x80) ? 0 : 1;
 	unsigned spread = (flags & 0x3f);
 	if (!spread) spread = 1;
 
+	// clip to the src image
+	if ((sx >= src->w) || (sy >= src->h) || !(copy_b || copy_w))
+		return;
+	if (sw > src->w - sx) sw = src->w - sx;
+	if (sh > src->h - sy) sh = src->h - sy;
+
+	if ((src->bits_per_val != 1) || (dst->bits_per_val != 1) || (spread > 8))
+	{
+		blit_pixels(src, sx, sy, sw, sh, dst, dx, dy, copy_b, copy_w, spread);
+		return;
+	}
+
+	// clip to the dst image
+	if ((dx >= dst->w) || (dy >= dst->h))
+		return;
+	unsigned dw = sw * spread;
+	if (dw > dst->w - dx) dw = dst->w - dx;
+
+	unsigned mode = (copy_b && copy_w) ? BLIT_COPY : (copy_w ? BLIT_OR : BLIT_AND);
+	uint8_t row[(sw + 7) / 8];
+	uint8_t xrow[(sw * spread + 7) / 8 + 8];
+
+	// row wise: src and dst may be the same image, as long as the areas don't overlap.
 	for (unsigned j = 0; j < sh; j++)
 	{
-		for (unsigned i = 0; i < sw; i++)
+		bitrow_get(src->data, src->w * (sy + j) + sx, row, sw);
+		if (spread > 1)
+			bitrow_expand(row, sw, spread, xrow);
+		for (unsigned k = 0; k < spread; k++)
+		{
+			unsigned y = dy + spread * j + k;
+			if (y >= dst->h)
+				return;
+			bitrow_put(dst->data, dst->w * y + dx, (spread > 1) ? xrow : row, dw, mode);
+		}
+	}
+}
+
+
+/*
+ * Box filtered downscale into a new 8 bit image of w x h, for previews.
+ * Each output pixel is the mean of the source area it covers, source pixels
+ * cut by its edges weighted by their share: module edges and thin strokes
+ * turn gray instead of aliasing or vanishing. Integer arithmetic, one pass
+ * over the source rows. The source is 1 or 8 bits per pixel.
+ */
+struct img *img_downscale(const struct img *src, unsigned w, unsigned h)
+{
+	struct img *dst = img_new(w, h, 8, 255);
+	if (!dst)
+		return NULL;
+	uint8_t *v = (uint8_t *)malloc(src->w);
+	uint32_t *hsum = (uint32_t *)malloc(w * sizeof(uint32_t));
+	uint64_t *acc = (uint64_t *)calloc(w, sizeof(uint64_t));
+	uint64_t norm = (uint64_t)src->w * src->h;
+	unsigned y = 0;
+
+	// source pixel i covers [i*w, (i+1)*w), output pixel x covers [x*src->w, (x+1)*src->w). Rows alike.
+	for (unsigned j = 0; j < src->h; j++)
+	{
+		uint32_t pos = src->w * j;
+		if (src->bits_per_val == 8)
+			memcpy(v, src->data + pos, src->w);
+		else
+			for (unsigned i = 0; i < src->w; i++, pos++)
+				v[i] = ((src->data[pos >> 3] >> (7 - (pos & 7))) & 1) ? 255 : 0;
+
+		memset(hsum, 0, w * sizeof(uint32_t));
+		for (unsigned i = 0, x = 0; i < src->w; i++)
 		{
-			if (((sx + i) < (src->w)) &&
-				((sy + j) < (src->h)))
+			for (unsigned a = i * w, b = a + w; a < b; )
 			{
-				// We are inside the src image
-				unsigned val = get_pixel(src, sx + i, sy + j);
-				if ((val == 0) ? copy_b : copy_w)
+				unsigned end = (x + 1) * src->w, e = (b < end) ? b : end;
+				hsum[x] += v[i] * (e - a);
+				if ((a = e) == end)
+					x++;
+			}
+		}
+
+		for (unsigned a = j * h, b = a + h; a < b; )
+		{
+			unsigned end = (y + 1) * src->h, e = (b < end) ? b : end;
+			for (unsigned x = 0; x < w; x++)
+				acc[x] += (uint64_t)hsum[x] * (e - a);
+			if ((a = e) == end)
+			{
+				for (unsigned x = 0; x < w; x++)
 				{
-					rectangle(dst, dx + spread * i, dy + spread * j, spread, spread, val);
+					dst->data[w * y + x] = (uint8_t)((acc[x] + norm / 2) / norm);
+					acc[x] = 0;
 				}
+				y++;
+			}
+		}
+	}
+	free(v);
+	free(hsum);
+	free(acc);
+	return dst;
+}
+
+
+#if WITH_PNG_SUPPORT
+/*
+ * Background cache: the png is decoded and thresholded only once, all further
+ * labels of a batch get a memcpy() of the packed image.
+ * On linux the packed image is also written to a sidecar file next to the png,
+ * so that later runs can mmap() it instead of decoding again. The sidecar is
+ * only trusted, if the hash of the png contents and the threshold match.
+ */
+#define BG_CACHE_MAGIC	"SFMBG01"
+#define BG_CACHE_SUFFIX	".sfmbg"
+
+struct bg_cache_hdr {
+	char magic[8];
+	uint64_t src_hash;		// fnv1a64 of the png file contents
+	uint32_t threshold;
+	uint32_t w, h, bits_per_val;
+};
+
+static struct {
+	char *src;
+	unsigned threshold;
+	struct img *im;
+} bg_cache;
+
+
+uint64_t fnv1a64(const unsigned char *p, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+
+// pngimage is width*height*4 RGBA bytes. Convert to black and white.
+struct img *img_from_rgba(const unsigned char *rgba, unsigned width, unsigned height, unsigned threshold)
+{
+	struct img *bw = img_new(width, height, BITS_PER_PIXEL, 255);
+	for (unsigned int i = 0; i < width * height; i++) {
+		if ((rgba[4*i+3] < threshold) || 	// ALPHA
+		((rgba[4*i+0] < threshold) &&	// R
+		 (rgba[4*i+1] < threshold) &&	// G
+		 (rgba[4*i+2] < threshold)))	// B
+			set_pixel(bw, i, 0);
+	}
+	return bw;
+}
+
+
+#ifdef __linux__
+struct img *bg_sidecar_load(const char *path, uint64_t src_hash, unsigned threshold)
+{
+	struct stat st;
+	struct img *im = NULL;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct bg_cache_hdr))
+	{
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED)
+		{
+			const struct bg_cache_hdr *hdr = (const struct bg_cache_hdr *)map;
+			if (!memcmp(hdr->magic, BG_CACHE_MAGIC, sizeof(hdr->magic)) &&
+			    hdr->src_hash == src_hash && hdr->threshold == threshold &&
+			    hdr->bits_per_val == BITS_PER_PIXEL &&
+			    (size_t)st.st_size == sizeof(*hdr) + img_data_len(hdr->w, hdr->h, hdr->bits_per_val))
+			{
+				im = img_new(hdr->w, hdr->h, hdr->bits_per_val, 0);
+				memcpy(im->data, hdr + 1, img_data_len(im->w, im->h, im->bits_per_val));
 			}
+			munmap(map, st.st_size);
+		}
+	}
+	close(fd);
+	return im;
+}
+
+
+void bg_sidecar_save(const char *path, uint64_t src_hash, unsigned threshold, struct img *im)
+{
+	struct bg_cache_hdr hdr;
+	char tmp[FILENAME_LEN];
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, BG_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.src_hash = src_hash;
+	hdr.threshold = threshold;
+	hdr.w = im->w; hdr.h = im->h; hdr.bits_per_val = im->bits_per_val;
+
+	// write and rename, so that a concurrent run never maps a half written file.
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return;		// read-only directory is fine, we just don't cache.
+	unsigned len = img_data_len(im->w, im->h, im->bits_per_val);
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, im->data, len) != (ssize_t)len ||
+	    close(fd) != 0 ||
+	    rename(tmp, path) != 0)
+	{
+#if DEBUG > 0
+		printf("WARNING: could not write background cache %s: errno=%d\n", path, errno);
+#endif
+		unlink(tmp);
+	}
+}
+#endif // __linux__
+
+
+// returns the thresholded background, owned by the cache. NULL on error.
+struct img *bg_cache_get(const char *png_file, unsigned threshold)
+{
+	if (bg_cache.im && bg_cache.threshold == threshold && !strcmp(bg_cache.src, png_file))
+		return bg_cache.im;
+
+	unsigned char *pngimage = NULL;
+	unsigned width, height, error;
+	struct img *im = NULL;
+#ifdef __linux__
+	char sidecar[FILENAME_LEN];
+	struct stat st;
+	snprintf(sidecar, sizeof(sidecar), "%s%s", png_file, BG_CACHE_SUFFIX);
+
+	int fd = open(png_file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		printf("%s: cannot open: errno=%d\n", png_file, errno);
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		printf("%s: cannot mmap: errno=%d\n", png_file, errno);
+		return NULL;
+	}
+	uint64_t src_hash = fnv1a64((const unsigned char *)map, st.st_size);
+	im = bg_sidecar_load(sidecar, src_hash, threshold);
+#if DEBUG > 0
+	if (im)
+		printf("Loaded background cache %s %ux%u\n", sidecar, im->w, im->h);
+#endif
+	if (!im)
+	{
+		error = lodepng_decode32(&pngimage, &width, &height, (const unsigned char *)map, st.st_size);
+		if (!error)
+		{
+			im = img_from_rgba(pngimage, width, height, threshold);
+			bg_sidecar_save(sidecar, src_hash, threshold, im);
 		}
 	}
+	munmap(map, st.st_size);
+#else
+	error = lodepng_decode32_file(&pngimage, &width, &height, png_file);
+	if (!error)
+		im = img_from_rgba(pngimage, width, height, threshold);
+#endif
+	if (pngimage)
+	{
+		printf("Loaded PNG %ux%u\n", width, height);
+		free(pngimage);
+	}
+	if (!im)
+	{
+		printf("%s: PNG error %u: %s\n", png_file, error, lodepng_error_text(error));
+		return NULL;
+	}
+
+	if (bg_cache.im)
+	{
+		img_free(bg_cache.im);
+		free(bg_cache.src);
+	}
+	bg_cache.src = strdup(png_file);
+	bg_cache.threshold = threshold;
+	bg_cache.im = im;
+	return im;
 }
+#endif // WITH_PNG_SUPPORT
 
 
 uint32_t rand32(void)
@@ -290,299 +744,3706 @@ void hex16_string(char *buf)
 }
 
 
-int render_qrcode(struct img *im, unsigned x, unsigned y, unsigned margin, const char *ecc_letter, unsigned vers, const char *text, unsigned flags)
-{
-    uint8_t qrcode[qrcodegen_BUFFER_LEN_MAX];
-	uint8_t tempBuffer[qrcodegen_BUFFER_LEN_MAX];
-
-    unsigned copy_b = (flags & 0x40) ? 0 : 1;
-    unsigned copy_w = (flags & 0x80) ? 0 : 1;
-    unsigned spread = (flags & 0x3f);
-	if (!spread) spread = 1;
+/*
+ * QR code parameter selection: biggest modules first, as scanners read big
+ * modules faster, then the highest ecc level, then the smallest version.
+ * All choices for all payload lengths are precomputed into qr_table[],
+ * so that a label only does a table lookup.
+ */
+#define QR_MAX_PAYLOAD	160
+#define QR_MIN_MARGIN	2		// pixels, the tape edge adds more.
+#define QR_MIN_MODULE_UM	250		// smaller modules are hard to read for our scanners.
 
-	enum qrcodegen_Ecc ecc = qrcodegen_Ecc_QUARTILE;
+// capacity in characters per version and ecc level L, M, Q, H. From the QR code spec.
+static const uint16_t qr_capacity_byte[QR_MAX_VERSION][4] = {
+	{  17,  14,  11,   7 }, {  32,  26,  20,  14 }, {  53,  42,  32,  24 }, {  78,  62,  46,  34 },
+	{ 106,  84,  60,  44 }, { 134, 106,  74,  58 }, { 154, 122,  86,  64 }, { 192, 152, 108,  84 },
+	{ 230, 180, 130,  98 }, { 271, 213, 151, 119 }
+};
+static const uint16_t qr_capacity_alnum[QR_MAX_VERSION][4] = {
+	{  25,  20,  16,  10 }, {  47,  38,  29,  20 }, {  77,  61,  47,  35 }, { 114,  90,  67,  50 },
+	{ 154, 122,  87,  64 }, { 195, 154, 108,  84 }, { 224, 178, 125,  93 }, { 279, 221, 157, 122 },
+	{ 335, 262, 189, 143 }, { 395, 311, 221, 174 }
+};
+static const char *qr_ecc_names[4] = { "L", "M", "Q", "H" };
 
-	if      (ecc_letter[0] == 'L') ecc=qrcodegen_Ecc_LOW;
-	else if (ecc_letter[0] == 'M') ecc=qrcodegen_Ecc_MEDIUM;
-	else if (ecc_letter[0] == 'Q') ecc=qrcodegen_Ecc_QUARTILE;
-	else if (ecc_letter[0] == 'H') ecc=qrcodegen_Ecc_HIGH;
-	else printf("Unknown ecc letter '%s', expected L, M, Q, H\n", ecc_letter);
+struct qr_params {
+	unsigned version;		// 0: payload does not fit.
+	unsigned ecc_level;		// 0..3
+	const char *ecc;		// "L", "M", "Q", "H"
+	unsigned spread;		// module size in pixels
+	unsigned margin;		// centers the code in a square of max_height
+	unsigned size;			// total pixels incl. margin, as returned by render_qrcode()
+	const struct dm_symbol *dm;	// a Data Matrix instead, see dm_select(). margin is then above and below.
+	unsigned hmargin;		// left and right of the code
+	unsigned width;			// pixels along the tape, incl. margin
+};
 
-	bool ok = qrcodegen_encodeText(text, tempBuffer, qrcode, ecc, vers, vers, qrcodegen_Mask_AUTO, true);
-	if (!ok) return -1;
+static struct qr_params qr_table[2][QR_MAX_PAYLOAD+1];	// [alnum][payload length]
+static unsigned qr_table_height = 0, qr_table_dpi = 0;
 
-	unsigned size = qrcodegen_getSize(qrcode);
-    unsigned ss = size*spread+2*margin;
 
-    if (copy_w && copy_b) rectangle(im, x, y, ss, ss, 255);	// paint background white
+void qr_build_table(unsigned max_height, unsigned dpi)
+{
+	unsigned min_spread = (QR_MIN_MODULE_UM * dpi + 25399) / 25400;
+	if (!min_spread) min_spread = 1;
 
-    for (unsigned int j = 0; j < size; j++)
-    {
-		for (unsigned int i = 0; i < size; i++)
+	memset(qr_table, 0, sizeof(qr_table));
+	for (unsigned alnum = 0; alnum < 2; alnum++)
+	{
+		for (unsigned len = 1; len <= QR_MAX_PAYLOAD; len++)
 		{
-			unsigned val = qrcodegen_getModule(qrcode, i, j);
-			if ((val > 0) ? copy_b : copy_w)
+			struct qr_params *best = &qr_table[alnum][len];
+			for (unsigned v = 1; v <= QR_MAX_VERSION; v++)
 			{
-			  rectangle(im, x+margin+spread*i, y+margin+spread*j, spread, spread, ((val > 0) ? 0 : 255));
+				unsigned modules = 17 + 4 * v;
+				if (max_height < modules + 2 * QR_MIN_MARGIN)
+					break;
+				unsigned spread = (max_height - 2 * QR_MIN_MARGIN) / modules;
+				if (spread < min_spread)
+					break;
+				for (int e = 3; e >= 0; e--)
+				{
+					unsigned cap = alnum ? qr_capacity_alnum[v-1][e] : qr_capacity_byte[v-1][e];
+					if (cap < len)
+						continue;
+					// versions are ascending, so a tie keeps the smaller version.
+					if (spread > best->spread || (spread == best->spread && (unsigned)e > best->ecc_level))
+					{
+						best->version = v;
+						best->ecc_level = e;
+						best->ecc = qr_ecc_names[e];
+						best->spread = spread;
+						best->margin = (max_height - modules * spread) / 2;
+						best->size = modules * spread + 2 * best->margin;
+						best->hmargin = best->margin;
+						best->width = best->size;
+					}
+					break;	// the highest ecc level that fits
+				}
 			}
 		}
 	}
-    return ss;
+	qr_table_height = max_height;
+	qr_table_dpi = dpi;
 }
 
 
-int find_highest_ascender(GFXglyph *g, int nglyphps)
+// true, if qrcodegen will use alphanumeric mode for the text.
+bool qr_is_alnum(const char *text)
 {
-    int off = g[0].yOffset;
-	for (int i = 0; i < nglyphps; i++)
-	{
-		// larger y values downwards.
-		if (off > g[i].yOffset)
-			off = g[i].yOffset;
-	}
-	return off;
+	for (; *text; text++)
+		if (!strchr("0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:", *text))
+			return false;
+	return true;
 }
 
 
-struct font *find_font(int size)
+// returns NULL if the text does not fit on the tape.
+const struct qr_params *qr_select(struct qr_config *cfg, const char *text)
 {
-    for (int i = 0; i < (int)(sizeof(fonts)/sizeof(struct font)); i++)
-    {
-	    if (fonts[i].size >= (unsigned)size)
-		{
-			struct font *f = fonts+i;
-			f->max_asc = find_highest_ascender(f->ptr->glyph, f->ptr->last - f->ptr->first);
-#if DEBUG > 0
-			printf("findfont(%d) -> size=%d, scale=%d, yAdvance=%d, max_asc=%d\n", size, f->size, f->scale, f->ptr->yAdvance, f->max_asc);
+	if (qr_table_height != cfg->max_height || qr_table_dpi != cfg->dpi)
+		qr_build_table(cfg->max_height, cfg->dpi);
+
+	unsigned len = strlen(text);
+	if (len > QR_MAX_PAYLOAD)
+		return NULL;
+	const struct qr_params *p = &qr_table[qr_is_alnum(text)][len];
+	if (!p->version)
+		return NULL;
+#if DEBUG > 1
+	if (debug_out)
+		printf("qr_select(%u bytes) -> version %u, ecc %s, spread %u (%u um), margin %u\n",
+			len, p->version, p->ecc, p->spread, p->spread * 25400 / cfg->dpi, p->margin);
 #endif
-			return f;
-		}
-	}
-	return NULL;
+	return p;
 }
 
 
-// set forground color in output pixels, where bitmap bit is set.
-void bits2img_fg(const uint8_t *bitmap, struct img *output, uint16_t width, uint16_t height, unsigned fg)
+/*
+ * The Data Matrix for the text: for each symbol that holds its codewords the
+ * module size that fills max_height, at least QR_MIN_MODULE_UM. Of those the
+ * one that takes the least tape, then the one with the bigger modules. The
+ * quiet zone left and right is one module, the tape edges add to it above and
+ * below. Returns -1 if none fits.
+ */
+int dm_select(struct qr_config *cfg, const char *text, struct qr_params *p)
 {
-    uint32_t pos = 0;
+	uint8_t cw[DM_MAX_CODEWORDS];
+	unsigned c40_at_end;
+	unsigned min_spread = (QR_MIN_MODULE_UM * cfg->dpi + 25399) / 25400;
+	if (!min_spread) min_spread = 1;
 
-    // rectangle(output, 0, 0, width, height, bg);  // White background, should be done earler
-
-    for(uint16_t y = 0; y < height; y++) {
-        for(uint16_t x = 0; x < width; x++) {
-            // Get bit: MSB first (bit 7 is leftmost pixel)
-            uint16_t byte_idx = (pos / 8);
-            uint8_t bit_idx = 7 - (pos % 8);
-            if (bitmap[byte_idx] & (1 << bit_idx))
-				set_pixel(output, pos, fg);
-            pos++;
-        }
-    }
+	int n = dm_encode_text(text, cw, &c40_at_end);
+	if (n < 0)
+		return -1;
+	memset(p, 0, sizeof(*p));
+	for (unsigned i = 0; i < DM_NUM_SYMBOLS; i++)
+	{
+		const struct dm_symbol *s = dm_symbols + i;
+		if (s->data_cw < (unsigned)n || cfg->max_height < s->rows + 2u * QR_MIN_MARGIN)
+			continue;
+		unsigned spread = (cfg->max_height - 2 * QR_MIN_MARGIN) / s->rows;
+		if (spread < min_spread)
+			continue;
+		unsigned hmargin = (spread > QR_MIN_MARGIN) ? spread : QR_MIN_MARGIN;
+		unsigned width = s->cols * spread + 2 * hmargin;
+		if (!p->dm || width < p->width || (width == p->width && spread > p->spread))
+		{
+			p->dm = s;
+			p->spread = spread;
+			p->margin = (cfg->max_height - s->rows * spread) / 2;
+			p->hmargin = hmargin;
+			p->width = width;
+		}
+	}
+	if (!p->dm)
+		return -1;
+#if DEBUG > 1
+	if (debug_out)
+		printf("dm_select(%d codewords) -> %ux%u, spread %u (%u um), width %u\n",
+			n, p->dm->rows, p->dm->cols, p->spread, p->spread * 25400 / cfg->dpi, p->width);
+#endif
+	return 0;
 }
 
 
-GFXglyph *extract_glyph(struct font *f, unsigned char ch, struct img *output, unsigned bits_per_val, unsigned fg)
+// the code for the text, as cfg->symbology asks. Returns -1 if it does not fit on the tape.
+int code_select(struct qr_config *cfg, const char *text, struct qr_params *p)
 {
-    GFXglyph *glyph = &(f->ptr->glyph[ ch - f->ptr->first ]);
+	const struct qr_params *q = (cfg->symbology != CODE_DM) ? qr_select(cfg, text) : NULL;
+	struct qr_params d;
+	int dm_ok = (cfg->symbology != CODE_QR) && !dm_select(cfg, text, &d);
 
-	if (ch < f->ptr->first || ch > f->ptr->last) return NULL;
+	if (dm_ok && (!q || d.width < q->width || (d.width == q->width && d.spread > q->spread)))
+		*p = d;
+	else if (q)
+		*p = *q;
+	else
+		return -1;
+	return 0;
+}
 
-    if (output)
-		bits2img_fg(f->ptr->bitmap + glyph->bitmapOffset, output, glyph->width, glyph->height, fg);
 
-	return glyph;
-}
+/*
+ * Fast path for our own payloads. SFM-X-XXXXXXXX-XXXX-XXXX in upper case fits
+ * alphanumeric mode. Function patterns, the order of the data modules and the
+ * Reed-Solomon generator are computed once per version and ecc level, a label
+ * then only packs 24 characters, computes the ecc codewords and applies a mask.
+ * Follows qrcodegen.c, but only for versions 1 .. QR_MAX_VERSION.
+ */
+int qr_fixed_mask = -1;		// -1: choose by penalty score, 0..7: always use this mask.
 
+static struct img *qf_modules = NULL;	// result of qr_fixed_encode(), one pixel per module.
 
-// returns width in pixels.
-unsigned draw_text(struct img *im, unsigned x, unsigned y, const char *text, struct font *f, unsigned val)
+
+// penalty score as in the QR code spec, lower is better.
+static long SFM_HOT(qf_penalty)(const uint8_t *m)
 {
-	unsigned orig_x = x;
-	unsigned tlen = strlen(text);
+	unsigned size = qf.size;
+	long result = 0;
+	unsigned dark = 0;
 
-	if (!im)
+	for (unsigned pass = 0; pass < 2; pass++)
 	{
-		// measure length without drawing
-		// CAUTION: keep in sync with drawing code below.
-		for (unsigned c=0; c < tlen; c++)
+		for (unsigned a = 0; a < size; a++)
 		{
-			char ch = text[c];
-			GFXglyph *g = extract_glyph(f, ch, NULL, 0, 0);
-			if (!g)
-				g = extract_glyph(f, '_', NULL, 0, 0);
-			if (g)
-		        x += f->scale * g->xAdvance;
-		}
+			unsigned run = 0;
+			uint8_t prev = 2;
+			unsigned window = 0;	// last 11 modules, starts with the light quiet zone.
+			for (unsigned b = 0; b < size + 4; b++)
+			{
+				uint8_t v = (b < size) ? (pass ? m[b * size + a] : m[a * size + b]) : 0;
+				if (b < size)
+				{
+					if (v == prev)
+					{
+						if (++run == 5)
+							result += 3;
+						else if (run > 5)
+							result++;
+					}
+					else
+						run = 1;
+					prev = v;
+				}
+				window = ((window << 1) | v) & 0x7ff;
+				if (window == 0x5d0 || window == 0x05d)		// 1:1:3:1:1 with 4 light modules
+					result += 40;
+			}
+		}
+	}
+	for (unsigned y = 0; y < size; y++)
+	{
+		for (unsigned x = 0; x < size; x++)
+		{
+			uint8_t v = m[y * size + x];
+			dark += v;
+			if (x + 1 < size && y + 1 < size && v == m[y * size + x + 1] &&
+			    v == m[(y + 1) * size + x] && v == m[(y + 1) * size + x + 1])
+				result += 3;
+		}
+	}
+	long total = size * size;
+	long k = (labs(dark * 20L - total * 10L) + total - 1) / total - 1;
+	return result + k * 10;
+}
+
+
+/*
+ * Encodes an alphanumeric text into qf_modules, one pixel per module, black is dark.
+ * Returns NULL if the text does not fit.
+ */
+struct img *SFM_HOT(qr_fixed_encode)(const char *text, unsigned ecc_level, unsigned version, int mask)
+{
+	static const char alnum[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:";
+	uint8_t data[QR_FIXED_MAX_CODEWORDS], cw[QR_FIXED_MAX_CODEWORDS], ecc[QR_FIXED_MAX_ECC];
+	uint8_t m[QR_FIXED_MAX_SIZE * QR_FIXED_MAX_SIZE], best[QR_FIXED_MAX_SIZE * QR_FIXED_MAX_SIZE];
+	unsigned len = strlen(text);
+
+	if (version < 1 || version > QR_MAX_VERSION || ecc_level > 3)
+		return NULL;
+	if (qf.version != version || qf.ecc_level != ecc_level)
+		qf_init(version, ecc_level);
+
+	// mode indicator, character count, 11 bits per pair of characters.
+	unsigned count_bits = (version <= 9) ? 9 : 11;
+	if (4 + count_bits + len / 2 * 11 + (len % 2) * 6 > qf.data_codewords * 8)
+		return NULL;
+	memset(data, 0, sizeof(data));
+	unsigned nbits = 0;
+#define QF_APPEND(val, n) \
+	for (int _i = (n) - 1; _i >= 0; _i--, nbits++) \
+		data[nbits >> 3] |= (((val) >> _i) & 1) << (7 - (nbits & 7))
+	QF_APPEND(0x2, 4);
+	QF_APPEND(len, count_bits);
+	for (unsigned i = 0; i < len; i += 2)
+	{
+		const char *c0 = strchr(alnum, text[i]);
+		const char *c1 = (i + 1 < len) ? strchr(alnum, text[i+1]) : NULL;
+		if (!c0 || !text[i] || ((i + 1 < len) && !c1))
+			return NULL;
+		if (c1)
+			QF_APPEND((c0 - alnum) * 45 + (c1 - alnum), 11);
+		else
+			QF_APPEND(c0 - alnum, 6);
+	}
+	unsigned capacity = qf.data_codewords * 8;
+	unsigned term = (capacity - nbits < 4) ? capacity - nbits : 4;
+	nbits += term;
+	nbits = (nbits + 7) & ~7u;
+	for (uint8_t pad = 0xec; nbits < capacity; pad ^= 0xec ^ 0x11, nbits += 8)
+		data[nbits >> 3] = pad;
+#undef QF_APPEND
+
+	// split into blocks, add ecc and interleave.
+	unsigned num_short = qf.num_blocks - qf.raw_codewords % qf.num_blocks;
+	unsigned short_data_len = qf.raw_codewords / qf.num_blocks - qf.block_ecc_len;
+	for (unsigned i = 0, k = 0; i < qf.num_blocks; i++)
+	{
+		unsigned dat_len = short_data_len + (i < num_short ? 0 : 1);
+		const uint8_t *dat = data + k;
+		qf_rs_remainder(dat, dat_len, ecc);
+		for (unsigned j = 0, l = i; j < dat_len; j++, l += qf.num_blocks)
+		{
+			if (j == short_data_len)
+				l -= num_short;
+			cw[l] = dat[j];
+		}
+		for (unsigned j = 0, l = qf.data_codewords + i; j < qf.block_ecc_len; j++, l += qf.num_blocks)
+			cw[l] = ecc[j];
+		k += dat_len;
+	}
+
+	// place the codewords, the remainder bits stay light.
+	unsigned size = qf.size;
+	uint8_t unmasked[QR_FIXED_MAX_SIZE * QR_FIXED_MAX_SIZE];
+	memcpy(unmasked, qf.base, size * size);
+	for (unsigned i = 0; i < qf.raw_codewords * 8; i++)
+		unmasked[qf.order[i]] = (cw[i >> 3] >> (7 - (i & 7))) & 1;
+
+	long best_penalty = -1;
+	for (int msk = (mask < 0) ? 0 : mask; msk <= ((mask < 0) ? 7 : mask); msk++)
+	{
+		for (unsigned y = 0; y < size; y++)
+			for (unsigned x = 0; x < size; x++)
+				m[y * size + x] = unmasked[y * size + x] ^ (!qf.is_func[y * size + x] && qf_mask_bit(msk, x, y));
+		qf_draw_format_bits(m, msk);
+		long penalty = (mask < 0) ? qf_penalty(m) : 0;
+		if (best_penalty < 0 || penalty < best_penalty)
+		{
+			best_penalty = penalty;
+			memcpy(best, m, size * size);
+		}
+	}
+
+	if (!qf_modules || qf_modules->w != size)
+	{
+		if (qf_modules)
+			img_free(qf_modules);
+		qf_modules = img_new(size, size, BITS_PER_PIXEL, 255);
+	}
+	for (unsigned i = 0; i < size * size; i++)
+		set_pixel(qf_modules, i, best[i] ? 0 : 255);
+	return qf_modules;
+}
+
+
+/*
+ * Scan verification of a rendered qr-code. We know where the code is and how
+ * big its modules are, so instead of searching for it like a camera decoder,
+ * each module is read straight from the raster: all its pixels must agree,
+ * the format bits must be valid, every ecc codeword must match (no errors to
+ * correct in a fresh label) and the decoded text must be the expected one.
+ * Returns 0 if the code is good.
+ */
+int SFM_HOT(qr_verify)(struct img *im, unsigned x, unsigned y, unsigned margin, unsigned version, unsigned spread,
+	const char *expected)
+{
+	uint8_t m[QR_FIXED_MAX_SIZE * QR_FIXED_MAX_SIZE];
+	uint8_t cw[QR_FIXED_MAX_CODEWORDS], data[QR_FIXED_MAX_CODEWORDS], ecc[QR_FIXED_MAX_ECC];
+	uint8_t blk[QR_FIXED_MAX_CODEWORDS];
+	char text[QR_FIXED_MAX_CODEWORDS + 1];
+	unsigned size = 17 + 4 * version;
+	const char *err = NULL;
+
+	if (version < 1 || version > QR_MAX_VERSION || !spread)
+		return -1;
+	x += margin;
+	y += margin;
+	if (x + size * spread > im->w || y + size * spread > im->h)
+	{
+		err = "outside of the image";
+		goto fail;
+	}
+
+	// modules, dark = 1
+	if (im->core->read_modules(im, x, y, size, size, spread, m))
+	{
+		err = "module not uniform";
+		goto fail;
+	}
+
+	// format bits. Allow the 3 bit errors that a scanner would correct.
+	{
+		unsigned ecc_level = 0, mask = 0;
+		if (qf_read_format(m, size, &ecc_level, &mask) > 3)
+		{
+			err = "bad format bits";
+			goto fail;
+		}
+		if (qf.version != version || qf.ecc_level != ecc_level)
+			qf_init(version, ecc_level);
+		qf_read_codewords(m, mask, cw);
+	}
+
+	// function patterns: the finder, timing and alignment patterns must be intact.
+	for (unsigned i = 0; i < size * size; i++)
+	{
+		if (qf.is_func[i] && qf.base[i] != m[i])
+		{
+			// the format bits are not part of qf.base
+			unsigned fx = i % size, fy = i / size;
+			if (fx != 8 && fy != 8)
+			{
+				err = "function pattern damaged";
+				goto fail;
+			}
+		}
+	}
+
+	// de-interleave, same order as in qr_fixed_encode(), and check the ecc of each block.
+	for (unsigned i = 0, k = 0; i < qf.num_blocks; i++)
+	{
+		unsigned dat_len = qf_block(cw, i, blk);
+		qf_rs_remainder(blk, dat_len, ecc);
+		if (memcmp(blk + dat_len, ecc, qf.block_ecc_len))
+		{
+			err = "ecc mismatch";
+			goto fail;
+		}
+		memcpy(data + k, blk, dat_len);
+		k += dat_len;
+	}
+
+	if (qf_decode_text(data, text) < 0)
+	{
+		err = "unexpected segment mode";
+		goto fail;
+	}
+	if (strcmp(text, expected))
+	{
+		err = "wrong text";
+		goto fail;
+	}
+	return 0;
+
+fail:
+	printf("ERROR: qr-code verification failed for '%s': %s\n", expected, err);
+	return -1;
+}
+
+
+int SFM_HOT(render_qrcode)(struct img *im, unsigned x, unsigned y, unsigned margin, const char *ecc_letter, unsigned vers, const char *text, unsigned flags)
+{
+    unsigned copy_b = (flags & 0x40) ? 0 : 1;
+    unsigned copy_w = (flags & 0x80) ? 0 : 1;
+    unsigned spread = (flags & 0x3f);
+	if (!spread) spread = 1;
+
+	enum qrcodegen_Ecc ecc = qrcodegen_Ecc_QUARTILE;
+
+	if      (ecc_letter[0] == 'L') ecc=qrcodegen_Ecc_LOW;
+	else if (ecc_letter[0] == 'M') ecc=qrcodegen_Ecc_MEDIUM;
+	else if (ecc_letter[0] == 'Q') ecc=qrcodegen_Ecc_QUARTILE;
+	else if (ecc_letter[0] == 'H') ecc=qrcodegen_Ecc_HIGH;
+	else printf("Unknown ecc letter '%s', expected L, M, Q, H\n", ecc_letter);
+
+	// our own payloads take the fast path, anything else goes through qrcodegen.
+	struct img *modules = NULL;
+	if (sfm_parse(text, NULL, NULL) == 0 && qr_is_alnum(text))
+		modules = qr_fixed_encode(text, ecc, vers, qr_fixed_mask);
+	if (modules)
+	{
+		unsigned ss = modules->w*spread+2*margin;
+		if (copy_w && copy_b) rectangle(im, x, y, ss, ss, 255);	// paint background white
+		blit(modules, 0, 0, modules->w, modules->h, im, x+margin, y+margin, flags);
+		return ss;
+	}
+
+    uint8_t qrcode[qrcodegen_BUFFER_LEN_MAX];
+	uint8_t tempBuffer[qrcodegen_BUFFER_LEN_MAX];
+	bool ok = qrcodegen_encodeText(text, tempBuffer, qrcode, ecc, vers, vers, qrcodegen_Mask_AUTO, true);
+	if (!ok) return -1;
+
+	unsigned size = qrcodegen_getSize(qrcode);
+    unsigned ss = size*spread+2*margin;
+
+    if (copy_w && copy_b) rectangle(im, x, y, ss, ss, 255);	// paint background white
+
+    for (unsigned int j = 0; j < size; j++)
+    {
+		for (unsigned int i = 0; i < size; i++)
+		{
+			unsigned val = qrcodegen_getModule(qrcode, i, j);
+			if ((val > 0) ? copy_b : copy_w)
+			{
+			  rectangle(im, x+margin+spread*i, y+margin+spread*j, spread, spread, ((val > 0) ? 0 : 255));
+			}
+		}
+	}
+    return ss;
+}
+
+
+/*
+ * Data Matrix of the text with the symbol of p, see dm_select(). Modules are
+ * p->spread pixels, the symbol is centered between the tape edges. The data
+ * codewords are padded to the capacity, the ecc codewords follow, all bits
+ * go to the modules in the order of dm_init(). Returns the width incl.
+ * margin, or -1 if the text does not fit the symbol.
+ */
+static struct img *dm_modules = NULL;	// one pixel per module
+
+int SFM_HOT(render_datamatrix)(struct img *im, unsigned x, unsigned y, const struct qr_params *p, const char *text)
+{
+	const struct dm_symbol *s = p->dm;
+	uint8_t cw[DM_MAX_CODEWORDS];
+	unsigned c40_at_end;
+
+	int n = dm_encode_text(text, cw, &c40_at_end);
+	if (n < 0 || (unsigned)n > s->data_cw)
+		return -1;
+	if (df.sym != s)
+		dm_init(s);
+	dm_pad(cw, n, c40_at_end, s->data_cw);
+	dm_rs_remainder(cw, s->data_cw, cw + s->data_cw);
+
+	if (!dm_modules || dm_modules->w != s->cols || dm_modules->h != s->rows)
+	{
+		if (dm_modules)
+			img_free(dm_modules);
+		dm_modules = img_new(s->cols, s->rows, BITS_PER_PIXEL, 255);
+	}
+	for (unsigned r = 0; r < s->rows; r++)
+	{
+		for (unsigned c = 0; c < s->cols; c++)
+		{
+			uint8_t dark = 0;
+			dm_finder(s, r, c, &dark);
+			set_pixel(dm_modules, r * s->cols + c, dark ? 0 : 255);
+		}
+	}
+	for (unsigned i = 0; i < (s->data_cw + s->ecc_cw) * 8u; i++)
+		if ((cw[i >> 3] >> (7 - (i & 7))) & 1)
+			set_pixel(dm_modules, dm_symbol_pos(s, df.order[i]), 0);
+	if (df.corner)
+	{
+		set_pixel(dm_modules, dm_symbol_pos(s, df.nrow * df.ncol - 1), 0);
+		set_pixel(dm_modules, dm_symbol_pos(s, (df.nrow - 1) * df.ncol - 2), 0);
+	}
+
+	rectangle(im, x, y, p->width, s->rows * p->spread + 2 * p->margin, 255);
+	blit(dm_modules, 0, 0, s->cols, s->rows, im, x + p->hmargin, y + p->margin, p->spread);
+	return p->width;
+}
+
+
+/*
+ * Scan verification of a rendered Data Matrix, as qr_verify() does it for
+ * qr-codes: uniform modules, intact finder patterns, matching ecc codewords
+ * and the expected text. Returns 0 if the code is good.
+ */
+int SFM_HOT(dm_verify)(struct img *im, unsigned x, unsigned y, const struct qr_params *p, const char *expected)
+{
+	const struct dm_symbol *s = p->dm;
+	uint8_t m[DM_MAX_ROWS * DM_MAX_COLS];
+	uint8_t cw[DM_MAX_CODEWORDS], ecc[DM_MAX_ECC];
+	char text[2 * DM_MAX_CODEWORDS + 1];
+	const char *err = NULL;
+
+	x += p->hmargin;
+	y += p->margin;
+	if (x + s->cols * p->spread > im->w || y + s->rows * p->spread > im->h)
+	{
+		err = "outside of the image";
+		goto fail;
+	}
+	if (im->core->read_modules(im, x, y, s->cols, s->rows, p->spread, m))
+	{
+		err = "module not uniform";
+		goto fail;
+	}
+	for (unsigned r = 0; r < s->rows; r++)
+	{
+		for (unsigned c = 0; c < s->cols; c++)
+		{
+			uint8_t dark;
+			if (dm_finder(s, r, c, &dark) && m[r * s->cols + c] != dark)
+			{
+				err = "finder pattern damaged";
+				goto fail;
+			}
+		}
+	}
+
+	if (df.sym != s)
+		dm_init(s);
+	memset(cw, 0, sizeof(cw));
+	for (unsigned i = 0; i < (s->data_cw + s->ecc_cw) * 8u; i++)
+		cw[i >> 3] |= m[dm_symbol_pos(s, df.order[i])] << (7 - (i & 7));
+	dm_rs_remainder(cw, s->data_cw, ecc);
+	if (memcmp(cw + s->data_cw, ecc, s->ecc_cw))
+	{
+		err = "ecc mismatch";
+		goto fail;
+	}
+	if (dm_decode_text(cw, s->data_cw, text) < 0)
+	{
+		err = "unexpected encodation";
+		goto fail;
+	}
+	if (strcmp(text, expected))
+	{
+		err = "wrong text";
+		goto fail;
+	}
+	return 0;
+
+fail:
+	printf("ERROR: data matrix verification failed for '%s': %s\n", expected, err);
+	return -1;
+}
+
+
+int find_highest_ascender(const struct sfm_glyph *g, int nglyphps)
+{
+    int off = g[0].yOffset;
+	for (int i = 0; i < nglyphps; i++)
+	{
+		// larger y values downwards.
+		if (off > g[i].yOffset)
+			off = g[i].yOffset;
+	}
+	return off;
+}
+
+
+#if !defined(__linux__) && SFM_SRAM
+// a copy of the font in SRAM, made once per font. The flash font if there is no room, or its size is unknown.
+static const struct sfm_font *font_in_sram(const struct sfm_font *pf)
+{
+	static const struct sfm_font *flash[8], *sram[8];
+	unsigned i;
+	for (i = 0; i < 8 && flash[i]; i++)
+		if (flash[i] == pf)
+			return sram[i];
+	unsigned nglyphs = pf->last - pf->first + 1;
+	struct sfm_font *f = (struct sfm_font *)malloc(sizeof(*f) + nglyphs * sizeof(struct sfm_glyph) + pf->len);
+	if (i == 8 || !pf->len || !f)
+	{
+		free(f);
+		return pf;
+	}
+	struct sfm_glyph *g = (struct sfm_glyph *)(f + 1);
+	uint8_t *data = (uint8_t *)(g + nglyphs);
+	memcpy(g, pf->glyph, nglyphs * sizeof(struct sfm_glyph));
+	memcpy(data, pf->data, pf->len);
+	*f = *pf;
+	f->glyph = g;
+	f->data = data;
+	flash[i] = pf;
+	return sram[i] = f;
+}
+#endif
+
+
+struct font *find_font(int size)
+{
+    for (int i = 0; i < (int)(sizeof(fonts)/sizeof(struct font)); i++)
+    {
+	    if (fonts[i].size >= (unsigned)size)
+		{
+			struct font *f = fonts+i;
+			if (!f->max_asc)	// not yet measured, all our fonts have ascenders.
+			{
+				f->max_asc = find_highest_ascender(f->ptr->glyph, f->ptr->last - f->ptr->first);
+#if !defined(__linux__) && SFM_SRAM
+				f->ptr = font_in_sram(f->ptr);
+#endif
+#if DEBUG > 0
+				if (debug_out)
+					printf("findfont(%d) -> size=%d, scale=%d, yAdvance=%d, max_asc=%d\n", size, f->size, f->scale, f->ptr->yAdvance, f->max_asc);
+#endif
+			}
+			return f;
+		}
+	}
+	return NULL;
+}
+
+
+const struct sfm_glyph *find_glyph(struct font *f, unsigned char ch)
+{
+	if (ch < f->ptr->first || ch > f->ptr->last) return NULL;
+	return f->ptr->glyph + (ch - f->ptr->first);
+}
+
+
+// decodes the glyph row by row straight into the canvas: ink black, the rest of the glyph box white.
+// Clipped as blit() does.
+static void SFM_HOT(draw_glyph)(struct img *im, unsigned x, unsigned y, struct font *f, const struct sfm_glyph *g)
+{
+	struct sfm_glyph_reader r;
+	unsigned spread = f->scale;
+	uint8_t row[8], xrow[8 * 8 + 8];
+
+	if (!g->width || !g->height || x >= im->w || y >= im->h)
+		return;
+	unsigned dw = g->width * spread;
+	if (dw > im->w - x) dw = im->w - x;
+
+	sfm_glyph_start(&r, f->ptr, g);
+	for (unsigned j = 0; j < g->height; j++)
+	{
+		uint64_t ink = sfm_glyph_row(&r);
+		for (unsigned i = 0; i < 8; i++)
+			row[i] = ~(uint8_t)(ink >> (56 - 8 * i));
+		if (spread > 1)
+			bitrow_expand(row, g->width, spread, xrow);
+		for (unsigned k = 0; k < spread; k++)
+		{
+			if (y + spread * j + k >= im->h)
+				return;
+			im->core->put_row(im, x, y + spread * j + k, (spread > 1) ? xrow : row, dw);
+		}
+	}
+}
+
+
+// draws text in black, returns its width in pixels. Measures only if im is NULL.
+unsigned SFM_HOT(draw_text)(struct img *im, unsigned x, unsigned y, const char *text, struct font *f)
+{
+	unsigned orig_x = x;
+	unsigned tlen = strlen(text);
+
+	if (!im)
+	{
+		// measure length without drawing
+		// CAUTION: keep in sync with drawing code below.
+		for (unsigned c=0; c < tlen; c++)
+		{
+			char ch = text[c];
+			const struct sfm_glyph *g = find_glyph(f, ch);
+			if (!g)
+				g = find_glyph(f, '_');
+			if (g)
+		        x += f->scale * g->xAdvance;
+		}
 		return x - orig_x;
 	}
 
 #if DEBUG > 0
-    printf("%d,%d '%s' font size: %d, scale %d\n", x, y, text, f->size, f->scale);
+    if (debug_out)
+        printf("%d,%d '%s' font size: %d, scale %d\n", x, y, text, f->size, f->scale);
 #endif
 	for (unsigned c=0; c < tlen; c++)
 	{
 		// CAUTION: keep in sync with measurement code above.
 	    char ch = text[c];
-		GFXglyph *g = extract_glyph(f, ch, NULL, 0, 0);
+		const struct sfm_glyph *g = find_glyph(f, ch);
 		if (!g)
 		{
-		    printf("ERROR: glyph not found: '%c' -> replacing with '_'\n", ch);
-			ch = '_';
-		    g = extract_glyph(f, ch, NULL, 0, 0);
-		    if (!g)
+		    printf("ERROR: glyph not found: '%c' -> replacing with '_'\n", ch);
+			ch = '_';
+		    g = find_glyph(f, ch);
+		    if (!g)
+			{
+				printf("ERROR: replacment glyph also not found: '%c'\n", ch);
+				exit(1);
+			}
+		}
+#if DEBUG > 1
+		if (debug_out)
+			printf("glyph dimension of '%c' (%d x %d) @ xAdv=%d, xOff=%d, yOff=%d\n", text[c], g->width, g->height, g->xAdvance, g->xOffset, g->yOffset);
+#endif
+		draw_glyph(im, x + (f->scale * g->xOffset), y + (f->scale * (g->yOffset - f->max_asc)), f, g);
+		x += f->scale * g->xAdvance;
+	}
+    return x - orig_x;
+}
+
+
+// sends a rendered label, saved as outfile, to the printer if cfg->print is set. Returns 0 on success.
+// On linux it goes to cfg->printer as the dispatcher sends it, see there. The rp2040 prints with the station.
+#ifdef __linux__
+int print_label(struct qr_config *cfg, struct img *im, const char *outfile);
+#else
+int print_label(struct qr_config *cfg, struct img *im, const char *outfile)
+{
+	(void)cfg;
+	(void)im;
+	(void)outfile;
+	return 0;
+}
+#endif
+
+
+/*
+ * Brother P-touch raster stream, as ptouch-print sends it: every column of
+ * the label is one raster line across the print head, top row first,
+ * black is 1, PackBits compressed.
+ */
+
+// bytes needed for a label of width w.
+unsigned ptouch_stream_len(unsigned w)
+{
+	return 8 + w * (3 + PTOUCH_LINE_BYTES + 1) + 1;
+}
+
+
+// PackBits. out needs n + (n + 127) / 128 bytes. Returns the encoded length.
+static unsigned SFM_HOT(packbits)(const uint8_t *in, unsigned n, uint8_t *out)
+{
+	unsigned o = 0;
+	for (unsigned i = 0; i < n; )
+	{
+		unsigned run = 1;
+		while (i + run < n && run < 128 && in[i + run] == in[i])
+			run++;
+		if (run > 1)
+		{
+			out[o++] = (uint8_t)(257 - run);
+			out[o++] = in[i];
+			i += run;
+			continue;
+		}
+		// literals, up to the next repeat.
+		unsigned lit = 1;
+		while (i + lit < n && lit < 128 && !(i + lit + 1 < n && in[i + lit] == in[i + lit + 1]))
+			lit++;
+		out[o++] = lit - 1;
+		memcpy(out + o, in + i, lit);
+		o += lit;
+		i += lit;
+	}
+	return o;
+}
+
+
+// encodes a label for the printer, centered on the print head. out needs ptouch_stream_len() bytes.
+// Returns the stream length, or 0 if the label is higher than the print head.
+unsigned SFM_HOT(ptouch_encode)(struct img *im, uint8_t *out)
+{
+	static const uint8_t hdr[] = {
+		0x1b, 0x40,			// initialize
+		0x1b, 0x69, 0x61, 0x01,		// raster mode
+		'M', 0x02			// TIFF (PackBits) compression
+	};
+	unsigned o = sizeof(hdr);
+
+	if (im->h > PTOUCH_PINS)
+		return 0;
+	memcpy(out, hdr, sizeof(hdr));
+	o += im->core->ptouch_lines(im, out + o);
+	out[o++] = 0x1a;			// print and feed
+	return o;
+}
+
+
+/*
+ * Tape profiles: pixels across the tape at 180 dpi, the canvas height.
+ * The rotation for the print head is instantiated for each of them, and for any height.
+ */
+static const struct tape_profile {
+	unsigned mm, height;
+} tape_profiles[] = {
+	{  6,  32 },
+	{  9,  50 },
+	{ 12,  70 },
+	{ 18, 120 },			// the D410 could print 128, my tape 120.
+	{ 24, 128 },
+};
+
+// 8x8 bit matrix transpose, row 0 in the top byte, column 0 in the top bit of each byte.
+static inline uint64_t transpose8(uint64_t x)
+{
+	uint64_t t;
+	t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+	x = x ^ t ^ (t << 28);
+	return x;
+}
+
+// RC_H 0 first, it defines the loops of the format, see sfm_render_core.h
+#define RC_BPP 1
+#define RC_H 0
+#include "sfm_render_core.h"
+#define RC_H 32
+#include "sfm_render_core.h"
+#define RC_H 50
+#include "sfm_render_core.h"
+#define RC_H 70
+#include "sfm_render_core.h"
+#define RC_H 120
+#include "sfm_render_core.h"
+#define RC_H 128
+#include "sfm_render_core.h"
+#undef RC_BPP
+
+#define RC_BPP 8
+#define RC_H 0
+#include "sfm_render_core.h"
+#ifdef __linux__		// the rp2040 renders 1 bit per pixel, the generic one is enough.
+#define RC_H 32
+#include "sfm_render_core.h"
+#define RC_H 50
+#include "sfm_render_core.h"
+#define RC_H 70
+#include "sfm_render_core.h"
+#define RC_H 120
+#include "sfm_render_core.h"
+#define RC_H 128
+#include "sfm_render_core.h"
+#endif
+#undef RC_BPP
+
+static const struct render_core *const render_cores[] = {
+	&render_core_1_32, &render_core_1_50, &render_core_1_70, &render_core_1_120, &render_core_1_128,
+#ifdef __linux__
+	&render_core_8_32, &render_core_8_50, &render_core_8_70, &render_core_8_120, &render_core_8_128,
+#endif
+	&render_core_1_0, &render_core_8_0,	// last, any height
+};
+
+
+// the core for a canvas, selected once per image in img_new().
+const struct render_core *render_core_select(unsigned h, unsigned bits_per_val)
+{
+	for (unsigned i = 0; i < sizeof(render_cores) / sizeof(render_cores[0]); i++)
+	{
+		const struct render_core *c = render_cores[i];
+		if (c->bits_per_val == bits_per_val && (!c->h || c->h == h))
+			return c;
+	}
+	return NULL;
+}
+
+
+// canvas height for a tape width in mm, 0 if there is no profile.
+unsigned tape_height(unsigned mm)
+{
+	for (unsigned i = 0; i < sizeof(tape_profiles) / sizeof(tape_profiles[0]); i++)
+		if (tape_profiles[i].mm == mm)
+			return tape_profiles[i].height;
+	return 0;
+}
+
+
+// qr, dm or auto as CODE_*, -1 for anything else.
+int symbology(const char *name)
+{
+	static const char *names[] = { "qr", "dm", "auto" };	// by CODE_*
+	for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+		if (!strcmp(name, names[i]))
+			return i;
+	return -1;
+}
+
+
+// in a batch, the label number is inserted before the suffix: output-0001.pgm
+void batch_outfile(struct qr_config *cfg, char *buf, size_t len)
+{
+	const char *dot = strrchr(cfg->outfile, '.');
+	if (!cfg->seq)
+		snprintf(buf, len, "%s", cfg->outfile);
+	else if (!dot)
+		snprintf(buf, len, "%s-%04u", cfg->outfile, cfg->seq);
+	else
+		snprintf(buf, len, "%.*s-%04u%s", (int)(dot - cfg->outfile), cfg->outfile, cfg->seq, dot);
+}
+
+
+// one label: its uid and the measured texts.
+struct qr_tag {
+	char uid16[40];
+	char payload[40];		// uid16, in upper case if cfg->qr_upper
+	char label_text[40];
+	const char *code_text;
+	struct font *small_font, *big_font;
+	struct qr_params code;		// the symbol, see code_select()
+	unsigned x0;			// where it was drawn
+	unsigned text_rows;		// text lines drawn: title, label, code. Fewer on narrow tapes.
+	unsigned big_size, small_size;	// their font sizes, see text_fit()
+	unsigned title_w, label_w, code_w, max_text_w;
+	unsigned width;			// computed width of qr-code and text
+};
+
+
+// the ink of text below the top of its line, see draw_text().
+static unsigned text_height(const char *text, struct font *f)
+{
+	int bottom = 0;
+	for (; *text; text++)
+	{
+		const struct sfm_glyph *g = find_glyph(f, *text);
+		if (!g)
+			g = find_glyph(f, '_');
+		if (g && g->yOffset + g->height > bottom)
+			bottom = g->yOffset + g->height;
+	}
+	return f->scale * (bottom - f->max_asc);
+}
+
+
+// the next smaller font size, or size if there is none.
+static unsigned smaller_font_size(unsigned size)
+{
+	unsigned s = 0;
+	for (unsigned i = 0; i < sizeof(fonts) / sizeof(fonts[0]); i++)
+		if (fonts[i].size < size && fonts[i].size > s)
+			s = fonts[i].size;
+	return s ? s : size;
+}
+
+
+// 1 if the first rows text lines, in fonts big and small, fit into max_height. Placed as draw_qrcode_tag() does.
+static int text_fits(struct qr_config *cfg, struct qr_tag *t, unsigned rows, unsigned big, unsigned small)
+{
+	const char *text[3] = { cfg->title_text, t->label_text, t->code_text };
+	unsigned size[3] = { big, small, small };
+	unsigned y = cfg->vspace/2;
+
+	for (unsigned i = 0; i + 1 < rows; i++)
+		y += cfg->line_advance_perc * size[i] / 100;
+	struct font *f = find_font(size[rows - 1]);
+	return f && y + text_height(text[rows - 1], f) <= cfg->max_height;
+}
+
+
+// picks the text lines and fonts that fit into max_height: all three lines in the
+// configured sizes, else in smaller fonts, else the lines are dropped from the bottom.
+static void text_fit(struct qr_config *cfg, struct qr_tag *t)
+{
+	unsigned big = cfg->big_font_size, small = cfg->small_font_size, rows;
+
+	for (rows = 3; rows > 0; rows--)
+	{
+		big = cfg->big_font_size;
+		small = cfg->small_font_size;
+		while (!text_fits(cfg, t, rows, big, small) &&
+		       (smaller_font_size(big) != big || smaller_font_size(small) != small))
+		{
+			big = smaller_font_size(big);
+			small = smaller_font_size(small);
+		}
+		if (text_fits(cfg, t, rows, big, small))
+			break;
+	}
+	if (!rows)
+	{
+		big = cfg->big_font_size;
+		small = cfg->small_font_size;
+	}
+	t->text_rows = rows;
+	t->big_size = big;
+	t->small_size = small;
+	if ((rows < 3 || big != cfg->big_font_size || small != cfg->small_font_size) && !cfg->text_fit_warned)
+	{
+		static const char *dropped[4] = { "title, label and code", "label and code", "code", "none" };
+		printf("WARNING: text does not fit into %u pixels: fonts %u/%u, %u of 3 lines, dropped: %s\n",
+			cfg->max_height, big, small, rows, dropped[rows]);
+		cfg->text_fit_warned = 1;
+	}
+}
+
+
+// measures the texts. Returns the computed width.
+// uid is xxxxxxxx-xxxx-xxxx, a new random uid is generated if NULL.
+unsigned layout_qrcode_tag(struct qr_config *cfg, const char *letter, const char *uid, struct qr_tag *t)
+{
+	snprintf(t->label_text, sizeof(t->label_text), "%s%s/", cfg->label_text_pre, letter);
+
+    snprintf(t->uid16, sizeof(t->uid16), "SFM-%s-", letter);
+	if (uid)
+		snprintf(t->uid16+strlen(t->uid16), sizeof(t->uid16)-strlen(t->uid16), "%s", uid);
+	else
+		hex16_string(t->uid16+strlen(t->uid16));
+#if DEBUG > 0
+	if (debug_out)
+		printf("uid16=%s\n", t->uid16);
+#endif
+	t->code_text = t->uid16;
+
+	// upper case fits alphanumeric mode: bigger modules and the fast encoder.
+	snprintf(t->payload, sizeof(t->payload), "%s", t->uid16);
+	for (char *p = t->payload; cfg->qr_upper && *p; p++)
+		*p = toupper(*p);
+
+	if (code_select(cfg, t->payload, &t->code))
+	{
+		printf("ERROR: '%s' does not fit into a %s of %u pixels%s\n", t->payload,
+			(cfg->symbology == CODE_QR) ? "qr-code" : "code", cfg->max_height,
+			(cfg->symbology == CODE_QR) ? ", try -S auto" : "");
+		exit(1);
+	}
+
+	text_fit(cfg, t);
+    t->small_font = find_font(t->small_size);
+    t->big_font   = find_font(t->big_size);
+
+	// measure lengths, of the lines that are drawn
+    t->title_w = (t->text_rows > 0) ? draw_text(NULL, 0, 0, cfg->title_text, t->big_font) : 0;
+	t->label_w = (t->text_rows > 1) ? draw_text(NULL, 0, 0, t->label_text, t->small_font) : 0;
+	t->code_w  = (t->text_rows > 2) ? draw_text(NULL, 0, 0, t->code_text,  t->small_font) : 0;
+
+	t->max_text_w = 0;
+	if (t->title_w > t->max_text_w) t->max_text_w = t->title_w;
+	if (t->label_w > t->max_text_w) t->max_text_w = t->label_w;
+	if (t->code_w  > t->max_text_w) t->max_text_w = t->code_w;
+
+    t->width = t->code.width + cfg->hspace + (t->max_text_w ? t->max_text_w + cfg->hspace : 0);
+
+#if DEBUG > 1
+	if (debug_out)
+		printf("title_w=%d, label_w=%d, code_w=%d\n", t->title_w, t->label_w, t->code_w);
+#endif
+	return t->width;
+}
+
+
+// draws qr-code and text with the left edge at x0. Returns the qr-code width, or -1.
+int draw_qrcode_tag(struct qr_config *cfg, struct qr_tag *t, struct img *bw, unsigned x0)
+{
+    const struct qr_params *q = &t->code;
+	t->x0 = x0;
+    int qrsize = q->dm ? render_datamatrix(bw, x0, 0, q, t->payload) :
+		render_qrcode(bw, x0, 0, q->margin, q->ecc, q->version, (const char *)t->payload, q->spread);
+#if DEBUG > 0
+	if (debug_out)
+		printf("qrcde size = %d\n", qrsize);
+#endif
+	if (qrsize < 0) return -1;
+
+    int y = cfg->vspace/2;
+    unsigned x = x0 + qrsize + cfg->hspace;
+    // write some font,
+#if 0
+    draw_text(bw, x0 + qrsize, y,    "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG.", t->small_font);
+    draw_text(bw, x0 + qrsize, y+50, "the quick brown fox jumps over the lazy dog.", t->big_font);
+#else
+	if (t->text_rows > 0)
+		draw_text(bw, x + (int)((t->max_text_w - t->title_w)/2), y, cfg->title_text, t->big_font);
+	y = y + (int)(cfg->line_advance_perc * t->big_size / 100);
+	if (t->text_rows > 1)
+		draw_text(bw, x + (int)((t->max_text_w - t->label_w)/2), y, t->label_text, t->small_font);
+	y = y + (int)(cfg->line_advance_perc * t->small_size / 100);
+	if (t->text_rows > 2)
+		draw_text(bw, x + (int)((t->max_text_w - t->code_w)/2),  y, t->code_text,  t->small_font);
+#endif
+	return qrsize;
+}
+
+
+// checks the qr-code of a drawn tag, before it wastes tape. See qr_verify().
+int verify_qrcode_tag(struct qr_config *cfg, struct qr_tag *t, struct img *im)
+{
+	if (!cfg->verify)
+		return 0;
+	const struct qr_params *q = &t->code;
+	if (q->dm)
+		return dm_verify(im, t->x0, 0, q, t->payload);
+	return qr_verify(im, t->x0, 0, q->margin, q->version, q->spread, t->payload);
+}
+
+
+// renders a label of the computed width, without background. Returns NULL if the qr-code fails.
+struct img *render_qrcode_tag(struct qr_config *cfg, const char *letter, const char *uid, struct qr_tag *t)
+{
+	unsigned width = layout_qrcode_tag(cfg, letter, uid, t);
+	struct img *bw = img_new(width, cfg->max_height, cfg->bits_per_val, 255);
+	if (draw_qrcode_tag(cfg, t, bw, 0) < 0 || verify_qrcode_tag(cfg, t, bw))
+	{
+		img_free(bw);
+		return NULL;
+	}
+	return bw;
+}
+
+
+#ifdef __linux__
+/*
+ * Label archive (-A labels.sfl): each rendered label is appended as
+ *
+ *	struct sfl_hdr
+ *	struct sfl_rec + PackBits raster	one per label, appended
+ *	struct sfl_idx[]			sorted by uid, rewritten at the end of each run
+ *
+ * the layout of the thumbnail file of shelfman-photos. A reprint maps the
+ * file, finds the uid by binary search and sends the stored raster, nothing
+ * is rendered again. The records of a run go over the previous index, so the
+ * header drops the index before the first of them is written: a run that did
+ * not end well leaves only records, SFL_REC_MARK finds them, the next run
+ * indexes them. The file is locked while a run has it open.
+ * A uid archived twice is reprinted as last archived.
+ */
+#define SFL_MAGIC		"SFMLBL1"
+#define SFL_REC_MARK		0x4c424c53	// "SLBL"
+
+struct sfl_hdr {
+	char magic[8];
+	uint64_t index_off;		// 0: no index yet
+	uint64_t index_count;
+};
+
+struct sfl_rec {
+	uint32_t mark;			// SFL_REC_MARK
+	uint32_t time;			// when it was rendered
+	uint64_t uid;
+	char letter;
+	uint8_t bits_per_val;
+	uint16_t w, h;
+	uint16_t pad;
+	uint32_t len;			// of the PackBits data that follows, padded to 8 in the file
+	uint32_t pad2;
+};
+
+struct sfl_idx {
+	uint64_t uid;
+	uint64_t off;			// of the struct sfl_rec
+};
+
+struct label_archive {
+	const char *path;
+	int fd;
+	struct sfl_hdr hdr;
+	uint64_t end;			// where the next record goes
+	struct sfl_idx *index;
+	unsigned nindex, size;
+	unsigned added, recovered;
+};
+
+
+static int sfl_idx_cmp(const void *a, const void *b)
+{
+	const struct sfl_idx *x = (const struct sfl_idx *)a, *y = (const struct sfl_idx *)b;
+	if (x->uid != y->uid)
+		return (x->uid < y->uid) ? -1 : 1;
+	return (x->off < y->off) ? -1 : (x->off > y->off);
+}
+
+
+static void archive_index(struct label_archive *a, uint64_t uid, uint64_t off)
+{
+	if (a->nindex == a->size)
+	{
+		a->size = a->size ? 2 * a->size : 1024;
+		a->index = (struct sfl_idx *)realloc(a->index, a->size * sizeof(struct sfl_idx));
+	}
+	a->index[a->nindex].uid = uid;
+	a->index[a->nindex++].off = off;
+}
+
+
+static struct label_archive *archive_fail(struct label_archive *a)
+{
+	if (a->fd >= 0)
+		close(a->fd);
+	free(a->index);
+	free(a);
+	return NULL;
+}
+
+
+// opens or creates the archive, locks it and indexes the records after the last index. Returns NULL on error.
+struct label_archive *archive_open(const char *path)
+{
+	struct label_archive *a = (struct label_archive *)calloc(1, sizeof(*a));
+	struct stat st;
+
+	a->path = path;
+	a->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (a->fd < 0 || fstat(a->fd, &st))
+	{
+		printf("ERROR: cannot open %s: errno=%d\n", path, errno);
+		return archive_fail(a);
+	}
+	if (flock(a->fd, LOCK_EX | LOCK_NB))
+	{
+		printf("ERROR: %s is in use by another run or the daemon\n", path);
+		return archive_fail(a);
+	}
+	if (st.st_size == 0)
+	{
+		memcpy(a->hdr.magic, SFL_MAGIC, sizeof(a->hdr.magic));
+		if (pwrite(a->fd, &a->hdr, sizeof(a->hdr), 0) != sizeof(a->hdr))
+		{
+			printf("ERROR: cannot write %s: errno=%d\n", path, errno);
+			return archive_fail(a);
+		}
+		st.st_size = sizeof(a->hdr);
+	}
+	else if (pread(a->fd, &a->hdr, sizeof(a->hdr), 0) != sizeof(a->hdr) || memcmp(a->hdr.magic, SFL_MAGIC, sizeof(a->hdr.magic)))
+	{
+		printf("ERROR: %s is not a shelfman label archive\n", path);
+		return archive_fail(a);
+	}
+
+	size_t ilen = a->hdr.index_count * sizeof(struct sfl_idx);
+	uint64_t off = a->hdr.index_off ? a->hdr.index_off + ilen : sizeof(a->hdr);
+	a->index = (struct sfl_idx *)malloc(ilen + sizeof(struct sfl_idx));
+	a->size = a->nindex = a->hdr.index_count;
+	if (ilen && pread(a->fd, a->index, ilen, a->hdr.index_off) != (ssize_t)ilen)
+	{
+		printf("ERROR: cannot read the index of %s\n", path);
+		return archive_fail(a);
+	}
+
+	// records of an interrupted run. A torn one ends the walk, it is overwritten by the next record.
+	struct sfl_rec rec;
+	while (off + sizeof(rec) <= (uint64_t)st.st_size &&
+	       pread(a->fd, &rec, sizeof(rec), off) == sizeof(rec) && rec.mark == SFL_REC_MARK &&
+	       off + sizeof(rec) + rec.len <= (uint64_t)st.st_size)
+	{
+		archive_index(a, rec.uid, off);
+		a->recovered++;
+		off += sizeof(rec) + ((rec.len + 7) & ~7u);
+	}
+	a->end = (off > (uint64_t)st.st_size) ? (uint64_t)st.st_size : off;
+	if (a->hdr.index_off && !a->recovered)
+		a->end = a->hdr.index_off;	// the new records go over the index, it is in memory.
+	if (a->recovered)
+		printf("# %s: %u labels of an interrupted run recovered\n", path, a->recovered);
+	return a;
+}
+
+
+// appends a rendered label. Returns 0 on success.
+int archive_add(struct label_archive *a, const char *uid16, struct img *im)
+{
+	struct sfl_rec rec;
+	memset(&rec, 0, sizeof(rec));
+	if (sfm_parse(uid16, &rec.letter, &rec.uid))
+	{
+		printf("ERROR: cannot archive %s, not a shelfman uid\n", uid16);
+		return -1;
+	}
+	unsigned n = img_data_len(im->w, im->h, im->bits_per_val);
+	uint8_t *buf = (uint8_t *)malloc(sizeof(rec) + n + (n + 127) / 128 + 8);
+	rec.mark = SFL_REC_MARK;
+	rec.time = (uint32_t)time(NULL);
+	rec.bits_per_val = im->bits_per_val;
+	rec.w = im->w;
+	rec.h = im->h;
+	rec.len = packbits(im->data, n, buf + sizeof(rec));
+	memcpy(buf, &rec, sizeof(rec));
+
+	size_t len = sizeof(rec) + ((rec.len + 7) & ~7u);
+	memset(buf + sizeof(rec) + rec.len, 0, len - sizeof(rec) - rec.len);
+	int ret = 0;
+	if (a->hdr.index_off && a->end == a->hdr.index_off)
+	{
+		// the first record overwrites the index. Until archive_close() all records are found by SFL_REC_MARK.
+		a->hdr.index_off = a->hdr.index_count = 0;
+		if (pwrite(a->fd, &a->hdr, sizeof(a->hdr), 0) != sizeof(a->hdr) || fdatasync(a->fd))
+		{
+			printf("ERROR: cannot write %s: errno=%d\n", a->path, errno);
+			free(buf);
+			return -1;
+		}
+	}
+	if (pwrite(a->fd, buf, len, a->end) != (ssize_t)len)
+	{
+		printf("ERROR: cannot write %s: errno=%d\n", a->path, errno);
+		ret = -1;
+	}
+	else
+	{
+		archive_index(a, rec.uid, a->end);
+		a->end += len;
+		a->added++;
+	}
+	free(buf);
+	return ret;
+}
+
+
+// writes the sorted index after the records and only then points the header to it. Returns 0 on success.
+int archive_close(struct label_archive *a)
+{
+	int ret = 0;
+	if (a->added || a->recovered || (a->nindex && !a->hdr.index_off))
+	{
+		qsort(a->index, a->nindex, sizeof(struct sfl_idx), sfl_idx_cmp);
+		a->hdr.index_off = a->end;
+		a->hdr.index_count = a->nindex;
+		size_t ilen = a->nindex * sizeof(struct sfl_idx);
+		if (pwrite(a->fd, a->index, ilen, a->hdr.index_off) != (ssize_t)ilen || fdatasync(a->fd) ||
+		    pwrite(a->fd, &a->hdr, sizeof(a->hdr), 0) != sizeof(a->hdr) || fdatasync(a->fd) ||
+		    ftruncate(a->fd, a->hdr.index_off + ilen))
+		{
+			printf("ERROR: cannot write the index of %s: errno=%d\n", a->path, errno);
+			ret = 1;
+		}
+	}
+	printf("# %u labels archived, %llu in %s\n", a->added, (unsigned long long)a->hdr.index_count, a->path);
+	close(a->fd);
+	free(a->index);
+	free(a);
+	return ret;
+}
+
+
+// archives the columns x .. x+w-1 of a canvas, a label of a strip.
+static int archive_label(struct qr_config *cfg, const char *uid16, struct img *bw, unsigned x, unsigned w)
+{
+	if (!cfg->archive)
+		return 0;
+	if (x == 0 && w >= bw->w)
+		return archive_add(cfg->archive, uid16, bw);
+	struct img *im = img_new(w, bw->h, bw->bits_per_val, 255);
+	blit(bw, x, 0, w, bw->h, im, 0, 0, 1);
+	int ret = archive_add(cfg->archive, uid16, im);
+	img_free(im);
+	return ret;
+}
+#else
+# define archive_label(cfg, uid16, bw, x, w)	0
+#endif // __linux__
+
+
+// renders a label with background and saves it to the batch outfile, which is returned in outfile.
+// uid is xxxxxxxx-xxxx-xxxx, a new random uid if NULL. Returns the label, for the printer, or NULL.
+struct img *save_qrcode_tag(struct qr_config *cfg, const char *letter, const char *uid, char *outfile, size_t len)
+{
+	unsigned width, height;
+	struct qr_tag tag;
+    unsigned computed_width = layout_qrcode_tag(cfg, letter, uid, &tag);
+
+#if WITH_PNG_SUPPORT
+    struct img *bg = NULL;
+    if (cfg->input_png_file)
+	{
+		bg = bg_cache_get(cfg->input_png_file, BW_THRESHOLD);
+		if (!bg)
+			return NULL;
+		width = bg->w;
+		height = bg->h;
+#if DEBUG > 0
+        if (width < computed_width)
+		    printf("WARNING: computed width for qr-code and text is %u\n", computed_width);
+#endif
+	}
+	else
+#endif
+	{
+        width = computed_width;
+
+		height = cfg->max_height;
+#if DEBUG > 0
+		printf("canvas size: %ux%u\n", width, height);
+#endif
+	}
+
+    struct img *bw = img_new(width, height, cfg->bits_per_val, 255);
+
+#if WITH_PNG_SUPPORT
+    if (bg && bg->bits_per_val == bw->bits_per_val)
+		memcpy(bw->data, bg->data, img_data_len(width, height, bw->bits_per_val));	// already thresholded.
+    else if (bg)
+		blit(bg, 0, 0, width, height, bw, 0, 0, 1);
+#endif
+
+    int qrsize = draw_qrcode_tag(cfg, &tag, bw, 0);
+	if (qrsize < 0)
+	{
+		img_free(bw);
+		return NULL;
+	}
+
+#ifdef WITH_PNG_SUPPORT
+    // with a loaded png, we have space to play around.
+    blit(bw, 10, 150, 400, 20,  bw, 10, 180, 6|0x80); // zoom on the text
+    blit(bw, 0, 0, (unsigned)qrsize, (unsigned)qrsize,  bw, 10, 300, 6|0x80); // zoom on QR code
+#endif
+
+	// the text and the zoom blits must not have damaged the qr-code.
+	if (verify_qrcode_tag(cfg, &tag, bw))
+	{
+		img_free(bw);
+		return NULL;
+	}
+
+	if (archive_label(cfg, tag.uid16, bw, 0, bw->w))
+	{
+		img_free(bw);
+		return NULL;
+	}
+
+	batch_outfile(cfg, outfile, len);
+#ifdef WITH_PNG_SUPPORT
+    // FIXME, we should not save a PGM file here, we should save a proper PNG.
+    img_save(bw, outfile);
+#else
+    // save as PGM
+    img_save(bw, outfile);
+#endif
+    return bw;
+}
+
+
+int gen_qrcode_tag(struct qr_config *cfg, const char *letter)
+{
+    char outfile[FILENAME_LEN];
+	struct img *bw = save_qrcode_tag(cfg, letter, NULL, outfile, sizeof(outfile));
+	if (!bw)
+		return 1;
+	int ret = print_label(cfg, bw, outfile);
+	img_free(bw);
+	return ret;
+}
+
+
+
+// draws a dashed vertical line, to mark where the labels of a strip are to be cut.
+void draw_cut_mark(struct img *im, unsigned x)
+{
+	for (unsigned y = 0; y < im->h; y += 8)
+		rectangle(im, x, y, 1, 4, 0);
+}
+
+
+/*
+ * Strip mode: count labels side by side on one canvas, sent to the printer as
+ * one job. Saves the leading and trailing tape margin and the feed time, that
+ * the printer spends on each single job.
+ */
+// draws the already laid out tags side by side and saves them as outfile. Returns the strip, or NULL.
+struct img *render_strip(struct qr_config *cfg, struct qr_tag *tags, unsigned count, const char *outfile)
+{
+	unsigned width = 0;
+	for (unsigned i = 0; i < count; i++)
+		width += (i ? cfg->strip_gap : 0) + tags[i].width;
+#if DEBUG > 0
+	printf("strip of %u labels, canvas size: %ux%u\n", count, width, cfg->max_height);
+#endif
+
+    struct img *bw = img_new(width, cfg->max_height, cfg->bits_per_val, 255);
+	unsigned x = 0;
+	int ret = 0;
+	for (unsigned i = 0; i < count; i++)
+	{
+		if (i)
+		{
+			if (cfg->cut_marks)
+				draw_cut_mark(bw, x + cfg->strip_gap/2);
+			x += cfg->strip_gap;
+		}
+		if (draw_qrcode_tag(cfg, tags + i, bw, x) < 0)
+		{
+			ret = 1;
+			break;
+		}
+		x += tags[i].width;
+	}
+	for (unsigned i = 0; i < count && !ret; i++)
+		ret = verify_qrcode_tag(cfg, tags + i, bw) ? 1 : 0;
+	for (unsigned i = 0; i < count && !ret; i++)
+		ret = archive_label(cfg, tags[i].uid16, bw, tags[i].x0, tags[i].width) ? 1 : 0;
+	if (ret)
+	{
+		img_free(bw);
+		return NULL;
+	}
+	img_save(bw, outfile);
+	return bw;
+}
+
+
+int gen_qrcode_strip(struct qr_config *cfg, const char *letter, unsigned count)
+{
+	if (!count)
+		return 0;
+
+	struct qr_tag *tags = (struct qr_tag *)calloc(count, sizeof(struct qr_tag));
+	for (unsigned i = 0; i < count; i++)
+		layout_qrcode_tag(cfg, letter, NULL, tags + i);
+	struct img *bw = render_strip(cfg, tags, count, cfg->outfile);
+	int ret = bw ? print_label(cfg, bw, cfg->outfile) : 1;
+	img_free(bw);
+	free(tags);
+	return ret;
+}
+
+#ifdef __linux__
+/*
+ * Daemon mode: fonts, qr tables and the fast encoder stay warm, label jobs
+ * come in over a unix socket. One job per line:
+ *
+ *	<letter> [count] [uid ...]
+ *
+ * e.g. "I 3" or "C 0 0123abcd-0000-1111 SFM-C-0123abcd-0000-2222". count
+ * random uids are generated in addition to the explicit ones.
+ * Jobs that arrive within DAEMON_BATCH_MS are rendered together as one strip
+ * and printed as one job. A job that does not fit into the strip fills it,
+ * the rest goes into the next strip. Each label is answered with
+ * "OK <payload>", each strip with "DONE <outfile>", bad jobs with "ERR <reason>".
+ */
+#define DAEMON_BATCH_MS		20
+#define DAEMON_MAX_CLIENTS	32
+#define DAEMON_MAX_LABELS	256		// per strip
+#define DAEMON_MAX_JOB		10000		// labels per job, the daemon prints them in one go.
+#define DAEMON_LINE_LEN		512
+#define DAEMON_MAX_UIDS		(DAEMON_LINE_LEN / (SFM_UID_LEN + 1))
+#define DAEMON_OUT_LEN		32768		// replies a client has not read, then it is dropped.
+
+struct daemon_client {
+	int fd;				// -1: unused
+	unsigned len;
+	char buf[DAEMON_LINE_LEN];
+	unsigned pending;		// labels in the current batch
+	unsigned out_len;
+	char out[DAEMON_OUT_LEN];	// replies the socket did not take yet
+};
+
+struct daemon_label {
+	int client;			// index into clients[], -1 if the client went away.
+	char letter[2];
+	char uid[20];			// empty: generate one.
+};
+
+static struct daemon_client daemon_clients[DAEMON_MAX_CLIENTS];
+static struct daemon_label daemon_labels[DAEMON_MAX_LABELS];
+static unsigned daemon_nlabels = 0;
+
+
+static void daemon_close(int c)
+{
+	close(daemon_clients[c].fd);
+	daemon_clients[c].fd = -1;
+	daemon_clients[c].pending = 0;
+	daemon_clients[c].out_len = 0;
+	for (unsigned i = 0; i < daemon_nlabels; i++)
+		if (daemon_labels[i].client == c)
+			daemon_labels[i].client = -1;	// still printed, nobody to tell.
+}
+
+
+// writes the queued replies that the socket takes now, the rest waits for POLLOUT.
+static void daemon_send(int c)
+{
+	struct daemon_client *cl = daemon_clients + c;
+	int n = write(cl->fd, cl->out, cl->out_len);
+	if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		daemon_close(c);
+	else if (n > 0)
+	{
+		cl->out_len -= n;
+		memmove(cl->out, cl->out + n, cl->out_len);
+	}
+}
+
+
+// a slow or dead client must not block the others: its socket does not block, the replies
+// are queued, and a client that lets DAEMON_OUT_LEN of them pile up is dropped.
+static void daemon_reply(int c, const char *fmt, const char *arg)
+{
+	if (c < 0 || daemon_clients[c].fd < 0)
+		return;
+	struct daemon_client *cl = daemon_clients + c;
+	unsigned room = sizeof(cl->out) - cl->out_len;
+	int len = snprintf(cl->out + cl->out_len, room, fmt, arg);
+	if (len < 0 || (unsigned)len >= room)
+	{
+		printf("# client %d does not read its replies, dropped\n", c);
+		daemon_close(c);
+		return;
+	}
+	cl->out_len += len;
+	daemon_send(c);
+}
+
+
+static void daemon_flush(struct qr_config *cfg, unsigned batch);
+
+
+// checks a job line, then queues its labels in daemon_labels[]. When the batch is full, it is
+// printed and the rest of the job goes into the next one. Returns NULL or an error message.
+static const char *daemon_parse_job(struct qr_config *cfg, unsigned *batch, int c, char *line)
+{
+	char *save = NULL;
+	char *letter = strtok_r(line, " \t", &save);
+	char *tok = strtok_r(NULL, " \t", &save);
+	char uids[DAEMON_MAX_UIDS][SFM_UID_LEN + 1];
+	unsigned long n = 1;
+	unsigned nuids = 0;
+
+	if (!letter || strlen(letter) != 1 || !isalpha(letter[0]))
+		return "expected: <letter> [count] [uid ...]";
+	if (tok)
+	{
+		// not a number: there is no count, it is the first uid.
+		char *end;
+		n = strtoul(tok, &end, 10);
+		if (isdigit((unsigned char)tok[0]) && !*end)
+			tok = strtok_r(NULL, " \t", &save);
+		else
+			n = 0;
+	}
+	for (char *uid = tok; uid; uid = strtok_r(NULL, " \t", &save))
+	{
+		// accept both the plain uid and the full payload.
+		char full[SFM_PAYLOAD_LEN + 1];
+		if (strlen(uid) == SFM_UID_LEN)
+			snprintf(full, sizeof(full), "SFM-%c-%s", letter[0], uid);
+		else
+			snprintf(full, sizeof(full), "%s", uid);
+		if (sfm_parse(full, NULL, NULL) || full[4] != letter[0] || nuids == DAEMON_MAX_UIDS)
+			return "bad uid, expected xxxxxxxx-xxxx-xxxx";
+		snprintf(uids[nuids++], sizeof(uids[0]), "%s", full + 6);
+	}
+	if (n > DAEMON_MAX_JOB)
+		return "count too large";
+	if (!n && !nuids)
+		return "no labels in the job";
+
+	for (unsigned i = 0; i < nuids + n; i++)
+	{
+		if (daemon_nlabels == DAEMON_MAX_LABELS)
+			daemon_flush(cfg, ++*batch);
+		struct daemon_label *l = daemon_labels + daemon_nlabels++;
+		l->client = (daemon_clients[c].fd >= 0) ? c : -1;
+		l->letter[0] = letter[0];
+		l->letter[1] = '\0';
+		snprintf(l->uid, sizeof(l->uid), "%s", (i < nuids) ? uids[i] : "");
+		daemon_clients[c].pending++;
+	}
+	return NULL;
+}
+
+
+static void daemon_flush(struct qr_config *cfg, unsigned batch)
+{
+	char outfile[FILENAME_LEN];
+	struct qr_tag *tags = (struct qr_tag *)calloc(daemon_nlabels, sizeof(struct qr_tag));
+
+	for (unsigned i = 0; i < daemon_nlabels; i++)
+		layout_qrcode_tag(cfg, daemon_labels[i].letter, daemon_labels[i].uid[0] ? daemon_labels[i].uid : NULL, tags + i);
+
+	cfg->seq = batch;
+	batch_outfile(cfg, outfile, sizeof(outfile));
+	struct img *bw = render_strip(cfg, tags, daemon_nlabels, outfile);
+	int err = bw ? print_label(cfg, bw, outfile) : 1;
+	img_free(bw);
+
+	for (unsigned i = 0; i < daemon_nlabels; i++)
+		if (!err)
+			daemon_reply(daemon_labels[i].client, "OK %s\n", tags[i].uid16);
+	for (int c = 0; c < DAEMON_MAX_CLIENTS; c++)
+	{
+		if (daemon_clients[c].pending)
+			daemon_reply(c, err ? "ERR printing %s failed\n" : "DONE %s\n", outfile);
+		daemon_clients[c].pending = 0;
+	}
+	daemon_nlabels = 0;
+	free(tags);
+}
+
+
+static long long daemon_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+
+int run_daemon(struct qr_config *cfg, const char *sock_path)
+{
+	struct sockaddr_un addr;
+	struct pollfd pfd[DAEMON_MAX_CLIENTS + 1];
+	unsigned batch = 0;
+	long long batch_start = 0;
+
+	signal(SIGPIPE, SIG_IGN);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock_path);
+	unlink(sock_path);
+	int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 16) < 0)
+	{
+		printf("ERROR: cannot listen on %s: errno=%d\n", sock_path, errno);
+		return 1;
+	}
+	for (int c = 0; c < DAEMON_MAX_CLIENTS; c++)
+		daemon_clients[c].fd = -1;
+
+	// warm up: fonts and qr tables are measured now, not with the first job.
+	struct qr_tag warm;
+	layout_qrcode_tag(cfg, "X", NULL, &warm);
+	printf("listening on %s\n", sock_path);
+
+	for (;;)
+	{
+		long long now = daemon_ms();
+		int timeout = -1;
+		if (daemon_nlabels)
+		{
+			timeout = (int)(batch_start + DAEMON_BATCH_MS - now);
+			if (timeout <= 0)
+			{
+				daemon_flush(cfg, ++batch);
+				continue;
+			}
+		}
+
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		for (int c = 0; c < DAEMON_MAX_CLIENTS; c++)
+		{
+			pfd[c+1].fd = daemon_clients[c].fd;
+			pfd[c+1].events = POLLIN | (daemon_clients[c].out_len ? POLLOUT : 0);
+		}
+		if (poll(pfd, DAEMON_MAX_CLIENTS + 1, timeout) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			printf("ERROR: poll: errno=%d\n", errno);
+			return 1;
+		}
+
+		if (pfd[0].revents & POLLIN)
+		{
+			int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			int c;
+			for (c = 0; c < DAEMON_MAX_CLIENTS && daemon_clients[c].fd >= 0; c++)
+				;
+			if (c == DAEMON_MAX_CLIENTS)
+				close(fd);	// busy, the client sees EOF.
+			else if (fd >= 0)
+			{
+				daemon_clients[c].fd = fd;
+				daemon_clients[c].len = 0;
+				daemon_clients[c].out_len = 0;
+			}
+		}
+
+		unsigned had_labels = daemon_nlabels;
+		for (int c = 0; c < DAEMON_MAX_CLIENTS; c++)
+		{
+			struct daemon_client *cl = daemon_clients + c;
+			if (cl->fd >= 0 && cl->out_len && (pfd[c+1].revents & POLLOUT))
+				daemon_send(c);
+			if (cl->fd < 0 || !(pfd[c+1].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			int n = read(cl->fd, cl->buf + cl->len, sizeof(cl->buf) - 1 - cl->len);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				continue;
+			if (n <= 0)
+			{
+				daemon_close(c);
+				continue;
+			}
+			cl->len += n;
+			cl->buf[cl->len] = '\0';
+
+			char *line = cl->buf, *nl;
+			while ((nl = strchr(line, '\n')))
+			{
+				*nl = '\0';
+				if (nl > line && nl[-1] == '\r')
+					nl[-1] = '\0';
+				const char *err = *line ? daemon_parse_job(cfg, &batch, c, line) : NULL;
+				if (err)
+					daemon_reply(c, "ERR %s\n", err);
+				line = nl + 1;
+			}
+			cl->len -= line - cl->buf;
+			memmove(cl->buf, line, cl->len);
+			if (cl->len == sizeof(cl->buf) - 1)
+			{
+				daemon_reply(c, "ERR %s\n", "line too long");
+				cl->len = 0;
+			}
+		}
+		if (!had_labels && daemon_nlabels)
+			batch_start = daemon_ms();	// not now: poll() may have waited long since.
+		if (daemon_nlabels >= DAEMON_MAX_LABELS)
+			daemon_flush(cfg, ++batch);
+	}
+}
+
+
+/*
+ * Batch journal: every label of a batch goes through
+ *
+ *	G <n> <uid>	generated, the uid is chosen
+ *	R <n>		rendered
+ *	S <n> <where>	sent to the printer
+ *	A <n>		acknowledged: the printer reported it printed, or the outfile was saved
+ *
+ * as lines appended to the journal file, after a header "SFMJ1 <letter> <count>".
+ * A G line is on disk before its label is sent, so a uid on tape is never
+ * lost. The G lines of JOURNAL_BATCH labels are written and synced at once.
+ * The other lines are only flushed, they survive a crash of the program but
+ * not of the machine: a lost A line prints a label twice with the same uid,
+ * it does not waste a uid.
+ * --resume reads the journal and prints what is not acknowledged, with the
+ * uids already chosen. A torn last line is cut off, and a label never goes back
+ * to an earlier state, e.g. from acknowledged to sent.
+ */
+#define JOURNAL_MAGIC		"SFMJ1"
+#define JOURNAL_BATCH		32
+
+#define JOURNAL_NONE		0
+#define JOURNAL_GENERATED	1
+#define JOURNAL_RENDERED	2
+#define JOURNAL_SENT		3
+#define JOURNAL_ACKED		4
+
+struct journal_label {
+	char uid[SFM_UID_LEN + 1];
+	uint8_t state;			// JOURNAL_*
+};
+
+struct journal {
+	FILE *fp;
+	pthread_mutex_t lock;		// the dispatcher threads mark labels, too.
+	char letter[2];
+	unsigned count;
+	unsigned dirty;			// G lines not yet synced
+	struct journal_label *label;	// [count], label n is label[n-1]
+};
+
+
+static void journal_sync(struct journal *j)
+{
+	if (fflush(j->fp) || fdatasync(fileno(j->fp)))
+		printf("ERROR: cannot write the journal: errno=%d\n", errno);
+	j->dirty = 0;
+}
+
+
+// records a state change of label n. A G line is synced before the label can be sent.
+void journal_mark(struct journal *j, unsigned n, unsigned state, const char *where)
+{
+	if (!j || !n || n > j->count)
+		return;
+	pthread_mutex_lock(&j->lock);
+	struct journal_label *l = j->label + n - 1;
+	l->state = state;
+	switch (state)
+	{
+	case JOURNAL_GENERATED: fprintf(j->fp, "G %u %s\n", n, l->uid); j->dirty++; break;
+	case JOURNAL_RENDERED:  fprintf(j->fp, "R %u\n", n); break;
+	case JOURNAL_SENT:      fprintf(j->fp, "S %u %s\n", n, where ? where : "-"); break;
+	case JOURNAL_ACKED:     fprintf(j->fp, "A %u\n", n); break;
+	}
+	if (state == JOURNAL_SENT && j->dirty)
+		journal_sync(j);
+	else if (state != JOURNAL_GENERATED)
+		fflush(j->fp);
+	pthread_mutex_unlock(&j->lock);
+}
+
+
+// the uid of label n. Labels without one get theirs with the next JOURNAL_BATCH-1, in one sync.
+const char *journal_uid(struct journal *j, unsigned n)
+{
+	if (!j->label[n - 1].uid[0])
+	{
+		for (unsigned k = n; k < n + JOURNAL_BATCH && k <= j->count; k++)
+		{
+			if (j->label[k - 1].uid[0])
+				continue;
+			hex16_string(j->label[k - 1].uid);
+			journal_mark(j, k, JOURNAL_GENERATED, NULL);
+		}
+		pthread_mutex_lock(&j->lock);
+		journal_sync(j);
+		pthread_mutex_unlock(&j->lock);
+	}
+	return j->label[n - 1].uid;
+}
+
+
+// reads the labels of a journal. Returns -1 on error, 1 if the last line is torn, else 0.
+// end gets the offset after the last complete line. States only go forward: a record
+// never takes a label back, e.g. from acknowledged to sent.
+static int journal_read(struct journal *j, const char *path, long *end)
+{
+	char line[256];
+	FILE *fp = fopen(path, "r");
+	unsigned count = 0;
+	int torn = 0;
+
+	if (!fp)
+	{
+		printf("ERROR: cannot read journal %s: errno=%d\n", path, errno);
+		return -1;
+	}
+	if (!fgets(line, sizeof(line), fp) || sscanf(line, JOURNAL_MAGIC " %1s %u", j->letter, &count) != 2 || !count)
+	{
+		printf("ERROR: %s is not a shelfman journal\n", path);
+		fclose(fp);
+		return -1;
+	}
+	j->count = count;
+	j->label = (struct journal_label *)calloc(count, sizeof(struct journal_label));
+	*end = ftell(fp);
+	while (fgets(line, sizeof(line), fp))
+	{
+		char type, arg[64];
+		unsigned n, state = JOURNAL_NONE;
+		if (!strchr(line, '\n'))
+		{
+			torn = 1;		// by a crash, the label is simply not acknowledged.
+			break;
+		}
+		*end = ftell(fp);
+		arg[0] = '\0';
+		if (sscanf(line, "%c %u %63s", &type, &n, arg) < 2 || !n || n > count)
+			continue;
+		struct journal_label *l = j->label + n - 1;
+		switch (type)
+		{
+		case 'G':
+			if (strlen(arg) == SFM_UID_LEN)
+			{
+				memcpy(l->uid, arg, SFM_UID_LEN + 1);
+				state = JOURNAL_GENERATED;
+			}
+			break;
+		case 'R': state = JOURNAL_RENDERED; break;
+		case 'S': state = JOURNAL_SENT; break;
+		case 'A': state = JOURNAL_ACKED; break;
+		}
+		if (state > l->state)
+			l->state = state;
+	}
+	fclose(fp);
+	return torn;
+}
+
+
+// creates a new journal, or reads it with resume. Returns NULL on error.
+struct journal *journal_open(const char *path, const char *letter, unsigned count, unsigned resume)
+{
+	struct journal *j = (struct journal *)calloc(1, sizeof(*j));
+	pthread_mutex_init(&j->lock, NULL);
+
+	if (resume)
+	{
+		long end = 0;
+		int torn = journal_read(j, path, &end);
+		if (torn < 0)
+			goto fail;
+		// the torn fragment goes, completed by a newline it would become a record.
+		if (torn && truncate(path, end))
+		{
+			printf("ERROR: cannot truncate the torn journal %s: errno=%d\n", path, errno);
+			goto fail;
+		}
+		j->fp = fopen(path, "a");
+	}
+	else
+	{
+		int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0)
+		{
+			printf("ERROR: cannot create journal %s: errno=%d%s\n", path, errno,
+				(errno == EEXIST) ? ", continue it with --resume, or remove it" : "");
+			goto fail;
+		}
+		j->fp = fdopen(fd, "w");
+		snprintf(j->letter, sizeof(j->letter), "%s", letter);
+		j->count = count;
+		j->label = (struct journal_label *)calloc(count, sizeof(struct journal_label));
+		fprintf(j->fp, JOURNAL_MAGIC " %s %u\n", j->letter, count);
+		journal_sync(j);
+	}
+	if (!j->fp)
+	{
+		printf("ERROR: cannot append to journal %s: errno=%d\n", path, errno);
+		goto fail;
+	}
+	if (resume)
+	{
+		unsigned acked = 0, sent = 0;
+		for (unsigned i = 0; i < j->count; i++)
+		{
+			acked += (j->label[i].state == JOURNAL_ACKED);
+			sent += (j->label[i].state == JOURNAL_SENT);
+		}
+		printf("# resume: %u of %u labels acknowledged", acked, j->count);
+		if (sent)
+			printf(", %u sent but not acknowledged are printed again with their uids", sent);
+		printf("\n");
+	}
+	return j;
+
+fail:
+	free(j->label);
+	free(j);
+	return NULL;
+}
+
+
+// syncs and frees. Returns the number of labels not acknowledged.
+unsigned journal_close(struct journal *j)
+{
+	unsigned open = 0;
+	journal_sync(j);
+	fclose(j->fp);
+	for (unsigned i = 0; i < j->count; i++)
+		open += (j->label[i].state != JOURNAL_ACKED);
+	if (!open)
+		printf("# journal: all %u labels acknowledged\n", j->count);
+	else
+		printf("# journal: %u of %u labels not acknowledged, continue with --resume\n", open, j->count);
+	pthread_mutex_destroy(&j->lock);
+	free(j->label);
+	free(j);
+	return open;
+}
+
+
+// batch mode with a journal: each label is saved to its outfile and printed, as without one.
+int run_journal_batch(struct qr_config *cfg, struct journal *j)
+{
+	for (unsigned n = 1; n <= j->count; n++)
+	{
+		char outfile[FILENAME_LEN];
+		if (j->label[n - 1].state == JOURNAL_ACKED)
+			continue;
+		cfg->seq = (j->count > 1) ? n : 0;
+		struct img *bw = save_qrcode_tag(cfg, j->letter, journal_uid(j, n), outfile, sizeof(outfile));
+		if (!bw)
+			break;
+		journal_mark(j, n, JOURNAL_RENDERED, NULL);
+		journal_mark(j, n, JOURNAL_SENT, cfg->print ? cfg->printer : outfile);
+		int err = print_label(cfg, bw, outfile);
+		img_free(bw);
+		if (err)
+			break;
+		journal_mark(j, n, JOURNAL_ACKED, NULL);
+	}
+	return journal_close(j) ? 1 : 0;
+}
+
+
+/*
+ * Print dispatcher: a batch is spread over several printers, one sender
+ * thread per printer. The main thread renders and encodes the labels
+ * (ptouch_encode()) into a short queue. Each sender takes the next label
+ * when its printer is done with the last one, so a fast printer prints more.
+ * A printer that runs out of tape or fails is dropped, its label goes back
+ * to the front of the queue for the others. Printers, comma separated:
+ *
+ *	auto			all Brother printers on /dev/usb/lp*
+ *	/dev/usb/lp1		a printer, asked for its status before every label. A label
+ *				is done when the printer reports it printed, not when sent.
+ *	mock[:ms[:labels]]	a simulated printer, ms per label, with tape for that many labels
+ *	file.bin		anything else: the streams are appended to the file
+ */
+#define DISPATCH_MAX_PRINTERS	16
+#define DISPATCH_QUEUE_LEN	32		// encoded labels waiting for a printer
+#define DISPATCH_STATUS_MS	2000
+#define DISPATCH_PRINT_MS	15000		// printed reply after the label, a long label takes a while.
+
+#define DISPATCH_USB		0
+#define DISPATCH_MOCK		1
+#define DISPATCH_FILE		2
+#define DISPATCH_SIM		3	// ptouch_sim.c, there is one
+
+struct dispatch_label {
+	struct dispatch_label *next;
+	unsigned n;			// label number in the journal
+	char uid16[40];
+	unsigned len;
+	uint8_t data[0];		// ptouch stream
+};
+
+struct dispatch_printer {
+	char name[64];
+	int kind;			// DISPATCH_*
+	int fd;
+	unsigned mock_ms, mock_tape;	// mock_tape 0: endless
+	const char *error;		// why it was dropped, NULL while it prints.
+	unsigned labels;
+	unsigned long long bytes;
+	double busy;			// seconds spent on its labels
+	pthread_t thread;
+};
+
+static struct {
+	pthread_mutex_t lock;		// protects everything below
+	pthread_cond_t more;		// a label was queued, or the batch is done
+	pthread_cond_t room;		// a label was taken, or a printer was dropped
+	struct dispatch_label *head, *tail;
+	unsigned queued;
+	unsigned sending;		// labels taken by a printer, they may come back.
+	unsigned done;			// no more labels will come
+	unsigned alive;			// printers not dropped
+	unsigned nprinters;
+	struct dispatch_printer printer[DISPATCH_MAX_PRINTERS];
+	struct journal *journal;	// NULL without -j
+} dispatch;
+
+
+static double dispatch_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+// the next status reply of a usb printer, unasked ones included. Returns 0 or -1 on timeout.
+static int dispatch_read_status(int fd, struct ptouch_status *st, int ms)
+{
+	unsigned n = 0;
+	while (n < sizeof(*st))
+	{
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		if (poll(&pfd, 1, ms) <= 0)
+			return -1;
+		int r = read(fd, (uint8_t *)st + n, sizeof(*st) - n);
+		if (r <= 0)
+			return -1;
+		n += r;
+		if (n && st->head_mark != 0x80)
+			n = 0;		// out of step, hunt for the next reply.
+	}
+	return 0;
+}
+
+
+// sends one label and waits until it is printed. Returns NULL, or why the printer has to be dropped.
+static const char *dispatch_send(struct dispatch_printer *p, struct dispatch_label *l)
+{
+	struct ptouch_status st;
+	const char *err;
+	int ret;
+
+	switch (p->kind)
+	{
+	case DISPATCH_MOCK:
+		if (p->mock_tape && p->labels >= p->mock_tape)
+			return "tape out";
+		sleep_ms(p->mock_ms);
+		return NULL;
+
+	case DISPATCH_SIM:
+		if (!(ret = ptouch_print(l->data, l->len)))
+			ret = ptouch_printed();
+		switch (ret)
+		{
+		case 0:
+			return NULL;
+		case PTOUCH_E_PRINTER:
+			return ptouch_last_status() ? ptouch_status_error(ptouch_last_status()) : "printer error";
+		default:
+			return "no status reply";
+		}
+
+	case DISPATCH_USB:
+		// replies to earlier labels may come first, only ours tells the state of now.
+		if (write(p->fd, ptouch_status_request, sizeof(ptouch_status_request)) != sizeof(ptouch_status_request))
+			return "write failed";
+		do
+		{
+			if (dispatch_read_status(p->fd, &st, DISPATCH_STATUS_MS) || !ptouch_status_valid(&st))
+				return "no status reply";
+			if ((err = ptouch_status_error(&st)))
+				return err;
+		} while (st.status_type != PTOUCH_ST_REPLY);
+		break;
+	}
+	for (unsigned o = 0; o < l->len; )
+	{
+		int n = write(p->fd, l->data + o, l->len - o);
+		if (n <= 0)
+			return "write failed";
+		o += n;
+	}
+
+	// a tape out or an opened cover in print comes instead of the printed reply.
+	while (p->kind == DISPATCH_USB)
+	{
+		if (dispatch_read_status(p->fd, &st, DISPATCH_PRINT_MS) || !ptouch_status_valid(&st))
+			return "no printed reply";
+		if ((err = ptouch_status_error(&st)))
+			return err;
+		if (st.status_type == PTOUCH_ST_ERROR)
+			return "printer error";
+		if (st.status_type == PTOUCH_ST_PRINTED)
+			break;
+	}
+	return NULL;
+}
+
+
+// the -P printer, opened with the first label and kept open across labels and daemon batches.
+// After an error it is closed, the next label opens it again.
+static struct dispatch_printer print_printer;
+
+// encodes the label and sends it as the dispatcher does, with a status check first on a usb printer.
+// A regular file gets the stream appended.
+int print_label(struct qr_config *cfg, struct img *im, const char *outfile)
+{
+	struct dispatch_printer *p = &print_printer;
+	const char *err = NULL;
+	struct stat sb;
+
+	if (!cfg->print)
+		return 0;
+	if (!p->name[0])
+	{
+		snprintf(p->name, sizeof(p->name), "%s", cfg->printer);
+		p->kind = (!stat(p->name, &sb) && S_ISCHR(sb.st_mode)) ? DISPATCH_USB : DISPATCH_FILE;
+		p->fd = (p->kind == DISPATCH_USB) ? open(p->name, O_RDWR) : open(p->name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (p->fd < 0)
+			err = "cannot open it";
+	}
+	if (!err)
+	{
+		struct dispatch_label *l = (struct dispatch_label *)malloc(sizeof(*l) + ptouch_stream_len(im->w));
+		l->len = ptouch_encode(im, l->data);
+		if (!(err = dispatch_send(p, l)))
+		{
+			p->labels++;
+			p->bytes += l->len;
+		}
+		free(l);
+	}
+	if (err)
+	{
+		printf("ERROR: printing %s on %s: %s\n", outfile, cfg->printer, err);
+		if (p->fd >= 0)
+			close(p->fd);
+		p->name[0] = '\0';
+		return 1;
+	}
+	return 0;
+}
+
+
+static void *dispatch_sender(void *arg)
+{
+	struct dispatch_printer *p = (struct dispatch_printer *)arg;
+	for (;;)
+	{
+		pthread_mutex_lock(&dispatch.lock);
+		while (!dispatch.head && !(dispatch.done && !dispatch.sending))
+			pthread_cond_wait(&dispatch.more, &dispatch.lock);
+		struct dispatch_label *l = dispatch.head;
+		if (!l)
+		{
+			pthread_mutex_unlock(&dispatch.lock);
+			break;
+		}
+		if (!(dispatch.head = l->next))
+			dispatch.tail = NULL;
+		dispatch.queued--;
+		dispatch.sending++;
+		pthread_cond_signal(&dispatch.room);
+		pthread_mutex_unlock(&dispatch.lock);
+
+		double t0 = dispatch_now();
+		journal_mark(dispatch.journal, l->n, JOURNAL_SENT, p->name);
+		const char *err = dispatch_send(p, l);
+
+		pthread_mutex_lock(&dispatch.lock);
+		dispatch.sending--;
+		if (err)
+		{
+			// back to the front, the next free printer takes it.
+			p->error = err;
+			l->next = dispatch.head;
+			dispatch.head = l;
+			if (!dispatch.tail)
+				dispatch.tail = l;
+			dispatch.queued++;
+			unsigned alive = --dispatch.alive;
+			pthread_cond_signal(&dispatch.more);
+			pthread_cond_signal(&dispatch.room);
+			pthread_mutex_unlock(&dispatch.lock);
+			printf("# %s: %s, %u printers left\n", p->name, err, alive);
+			break;
+		}
+		p->labels++;
+		p->bytes += l->len;
+		p->busy += dispatch_now() - t0;
+		if (dispatch.done && !dispatch.sending && !dispatch.head)
+			pthread_cond_broadcast(&dispatch.more);	// the others can go home.
+		pthread_mutex_unlock(&dispatch.lock);
+		journal_mark(dispatch.journal, l->n, JOURNAL_ACKED, NULL);
+		printf("OK %s %s\n", l->uid16, p->name);
+		free(l);
+	}
+	return NULL;
+}
+
+
+// adds the brother printers on /dev/usb/lp*, sorted by name.
+static void dispatch_discover(void)
+{
+	glob_t g;
+	if (glob("/dev/usb/lp*", 0, NULL, &g))
+		return;
+	for (size_t i = 0; i < g.gl_pathc && dispatch.nprinters < DISPATCH_MAX_PRINTERS; i++)
+	{
+		char path[FILENAME_LEN];
+		unsigned vid = 0, pid = 0;
+		const char *base = strrchr(g.gl_pathv[i], '/') + 1;
+		snprintf(path, sizeof(path), "/sys/class/usbmisc/%s/device/../idVendor", base);
+		FILE *fp = fopen(path, "r");
+		if (fp)
+		{
+			if (fscanf(fp, "%x", &vid) != 1)
+				vid = 0;
+			fclose(fp);
+		}
+		snprintf(path, sizeof(path), "/sys/class/usbmisc/%s/device/../idProduct", base);
+		if ((fp = fopen(path, "r")))
+		{
+			if (fscanf(fp, "%x", &pid) != 1)
+				pid = 0;
+			fclose(fp);
+		}
+		if (vid != PTOUCH_VID)
+			continue;
+		printf("# found printer %s (%04x:%04x)\n", g.gl_pathv[i], vid, pid);
+		snprintf(dispatch.printer[dispatch.nprinters++].name, sizeof(dispatch.printer[0].name), "%s", g.gl_pathv[i]);
+	}
+	globfree(&g);
+}
+
+
+// parses the printer list and opens them. Returns the number of printers.
+static unsigned dispatch_open(const char *devices)
+{
+	char list[1024];
+	char *save = NULL;
+
+	snprintf(list, sizeof(list), "%s", devices);
+	for (char *d = strtok_r(list, ",", &save); d; d = strtok_r(NULL, ",", &save))
+	{
+		if (!strcmp(d, "auto"))
+			dispatch_discover();
+		else if (dispatch.nprinters < DISPATCH_MAX_PRINTERS)
+			snprintf(dispatch.printer[dispatch.nprinters++].name, sizeof(dispatch.printer[0].name), "%s", d);
+	}
+
+	unsigned nmock = 0, nsim = 0, n = 0;
+	for (unsigned i = 0; i < dispatch.nprinters; i++)
+	{
+		struct dispatch_printer *p = dispatch.printer + n;
+		struct stat sb;
+		*p = dispatch.printer[i];
+		p->fd = -1;
+		if (!strncmp(p->name, "mock", 4) && (!p->name[4] || p->name[4] == ':'))
+		{
+			p->kind = DISPATCH_MOCK;
+			p->mock_ms = 100;
+			p->mock_tape = 0;
+			sscanf(p->name + 4, ":%u:%u", &p->mock_ms, &p->mock_tape);
+			snprintf(p->name, sizeof(p->name), "mock%u", nmock++);
+		}
+		else if (!strncmp(p->name, "sim", 3) && (!p->name[3] || p->name[3] == ':'))
+		{
+			p->kind = DISPATCH_SIM;
+			if (nsim++)
+			{
+				printf("ERROR: only one simulated printer\n");
+				continue;
+			}
+			ptouch_init();
+			if (ptouch_sim_config(p->name + 3) || ptouch_open())
+				continue;
+			snprintf(p->name, sizeof(p->name), "sim");
+		}
+		else if (!stat(p->name, &sb) && S_ISCHR(sb.st_mode))
+		{
+			p->kind = DISPATCH_USB;
+			p->fd = open(p->name, O_RDWR);
+		}
+		else
+		{
+			p->kind = DISPATCH_FILE;
+			p->fd = open(p->name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		}
+		if ((p->kind == DISPATCH_USB || p->kind == DISPATCH_FILE) && p->fd < 0)
+		{
+			printf("ERROR: cannot open printer %s: errno=%d\n", p->name, errno);
+			continue;
+		}
+		n++;
+	}
+	return dispatch.nprinters = n;
+}
+
+
+// renders count labels and prints them on all printers. Returns 0 when all are printed.
+// With a journal, letter and count come from it, and only labels not acknowledged are printed.
+int run_dispatch(struct qr_config *cfg, const char *letter, unsigned count, const char *devices, struct journal *j)
+{
+	unsigned rendered = 0, todo = count, lost = 0;
+	int ret = 0;
+
+	memset(&dispatch, 0, sizeof(dispatch));
+	dispatch.journal = j;
+	if (j)
+	{
+		letter = j->letter;
+		count = j->count;
+		for (unsigned n = todo = 0; n < count; n++)
+			todo += (j->label[n].state != JOURNAL_ACKED);
+	}
+	if (!dispatch_open(devices))
+	{
+		printf("ERROR: no printer in '%s'\n", devices);
+		if (j)
+			journal_close(j);
+		return 1;
+	}
+	pthread_mutex_init(&dispatch.lock, NULL);
+	pthread_cond_init(&dispatch.more, NULL);
+	pthread_cond_init(&dispatch.room, NULL);
+	dispatch.alive = dispatch.nprinters;
+
+	double t0 = dispatch_now();
+	for (unsigned i = 0; i < dispatch.nprinters; i++)
+		pthread_create(&dispatch.printer[i].thread, NULL, dispatch_sender, dispatch.printer + i);
+
+	for (unsigned n = 1; n <= count; n++)
+	{
+		struct qr_tag t;
+		if (j && j->label[n - 1].state == JOURNAL_ACKED)
+			continue;
+		struct img *im = render_qrcode_tag(cfg, letter, j ? journal_uid(j, n) : NULL, &t);
+		if (im && archive_label(cfg, t.uid16, im, 0, im->w))
+		{
+			img_free(im);
+			im = NULL;
+		}
+		if (!im)
+		{
+			ret = 1;
+			break;
+		}
+		struct dispatch_label *l = (struct dispatch_label *)malloc(sizeof(*l) + ptouch_stream_len(im->w));
+		l->next = NULL;
+		l->n = n;
+		snprintf(l->uid16, sizeof(l->uid16), "%s", t.uid16);
+		l->len = ptouch_encode(im, l->data);
+		img_free(im);
+		if (!l->len)
+		{
+			printf("ERROR: label is higher than the print head\n");
+			free(l);
+			ret = 1;
+			break;
+		}
+		journal_mark(j, n, JOURNAL_RENDERED, NULL);
+
+		pthread_mutex_lock(&dispatch.lock);
+		while (dispatch.queued >= DISPATCH_QUEUE_LEN && dispatch.alive)
+			pthread_cond_wait(&dispatch.room, &dispatch.lock);
+		unsigned alive = dispatch.alive;
+		if (alive)
+		{
+			if (dispatch.tail)
+				dispatch.tail->next = l;
+			else
+				dispatch.head = l;
+			dispatch.tail = l;
+			dispatch.queued++;
+			pthread_cond_signal(&dispatch.more);
+		}
+		pthread_mutex_unlock(&dispatch.lock);
+		if (!alive)
+		{
+			free(l);
+			break;
+		}
+		rendered++;
+	}
+
+	pthread_mutex_lock(&dispatch.lock);
+	dispatch.done = 1;
+	pthread_cond_broadcast(&dispatch.more);
+	pthread_mutex_unlock(&dispatch.lock);
+	for (unsigned i = 0; i < dispatch.nprinters; i++)
+		pthread_join(dispatch.printer[i].thread, NULL);
+	double elapsed = dispatch_now() - t0;
+
+	// all printers dropped: what was rendered but not printed has never been on tape.
+	while (dispatch.head)
+	{
+		struct dispatch_label *l = dispatch.head;
+		dispatch.head = l->next;
+		printf("ERR %s not printed\n", l->uid16);
+		free(l);
+		lost++;
+	}
+
+	unsigned printed = 0;
+	printf("# %-20s %7s %9s %9s %6s\n", "printer", "labels", "kbytes", "labels/s", "busy");
+	for (unsigned i = 0; i < dispatch.nprinters; i++)
+	{
+		struct dispatch_printer *p = dispatch.printer + i;
+		printf("# %-20s %7u %9.1f %9.2f %5.0f%% %s\n", p->name, p->labels, p->bytes / 1024.0,
+			elapsed > 0 ? p->labels / elapsed : 0, elapsed > 0 ? 100 * p->busy / elapsed : 0, p->error ? p->error : "");
+		printed += p->labels;
+		if (p->fd >= 0)
+			close(p->fd);
+		if (p->kind == DISPATCH_SIM)
+			ptouch_close();
+	}
+	printf("# %u of %u labels printed in %.2fs, %.2f labels/s\n", printed, todo, elapsed, elapsed > 0 ? printed / elapsed : 0);
+	if (lost || rendered < todo)
+		ret = 1;
+	if (j && journal_close(j))
+		ret = 1;
+	pthread_cond_destroy(&dispatch.more);
+	pthread_cond_destroy(&dispatch.room);
+	pthread_mutex_destroy(&dispatch.lock);
+	return ret;
+}
+
+
+/*
+ * Reprint from the label archive: the file is mapped, the stored raster is
+ * decoded and sent as it was printed, in its width and tape profile.
+ * Records after the index, of a running daemon or an interrupted run, are
+ * searched linearly and win, they are newer than all indexed ones. While a
+ * run writes over the old index, the header has none and all are searched.
+ */
+struct sfl_map {
+	size_t len;
+	const uint8_t *base;
+	const struct sfl_hdr *hdr;
+	const struct sfl_idx *index;
+	uint64_t tail;			// first record after the index
+};
+
+
+static int sfl_map(const char *path, struct sfl_map *m)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) || (size_t)st.st_size < sizeof(struct sfl_hdr))
+	{
+		printf("ERROR: cannot open %s: errno=%d\n", path, errno);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+	m->len = st.st_size;
+	m->base = (const uint8_t *)p;
+	m->hdr = (const struct sfl_hdr *)p;
+	m->index = (const struct sfl_idx *)(m->base + m->hdr->index_off);
+	m->tail = m->hdr->index_off ? m->hdr->index_off + m->hdr->index_count * sizeof(struct sfl_idx) : sizeof(struct sfl_hdr);
+	if (memcmp(m->hdr->magic, SFL_MAGIC, sizeof(m->hdr->magic)) || m->tail > m->len)
+	{
+		printf("ERROR: %s is not a shelfman label archive\n", path);
+		munmap(p, st.st_size);
+		return -1;
+	}
+	return 0;
+}
+
+
+// the record at off, NULL if there is none or it is torn.
+static const struct sfl_rec *sfl_rec_at(const struct sfl_map *m, uint64_t off)
+{
+	const struct sfl_rec *r = (const struct sfl_rec *)(m->base + off);
+	if (off + sizeof(*r) > m->len || r->mark != SFL_REC_MARK || off + sizeof(*r) + r->len > m->len)
+		return NULL;
+	return r;
+}
+
+
+static uint64_t sfl_next(const struct sfl_rec *r, uint64_t off)
+{
+	return off + sizeof(*r) + ((r->len + 7) & ~7u);
+}
+
+
+// the last archived label of uid, NULL if there is none.
+static const struct sfl_rec *sfl_find(const struct sfl_map *m, uint64_t uid)
+{
+	const struct sfl_rec *r, *found = NULL;
+	for (uint64_t off = m->tail; (r = sfl_rec_at(m, off)); off = sfl_next(r, off))
+		if (r->uid == uid)
+			found = r;
+	if (found)
+		return found;
+
+	// past the last entry of uid, binary search. Equal uids are sorted by offset.
+	uint64_t lo = 0, hi = m->hdr->index_count;
+	while (lo < hi)
+	{
+		uint64_t mid = (lo + hi) / 2;
+		if (m->index[mid].uid <= uid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo && m->index[lo - 1].uid == uid && (r = sfl_rec_at(m, m->index[lo - 1].off)) && r->uid == uid)
+		return r;
+	return NULL;
+}
+
+
+// PackBits, the inverse of packbits(). Returns 0 if in decodes to exactly n bytes.
+static int unpackbits(const uint8_t *in, unsigned len, uint8_t *out, unsigned n)
+{
+	unsigned o = 0;
+	for (unsigned i = 0; i < len; )
+	{
+		unsigned c = in[i++];
+		if (c < 128)
+		{
+			if (i + c + 1 > len || o + c + 1 > n)
+				return -1;
+			memcpy(out + o, in + i, c + 1);
+			i += c + 1;
+			o += c + 1;
+		}
+		else if (c > 128)
+		{
+			if (i >= len || o + 257 - c > n)
+				return -1;
+			memset(out + o, in[i++], 257 - c);
+			o += 257 - c;
+		}
+	}
+	return (o == n) ? 0 : -1;
+}
+
+
+// the label of an archive record. NULL if it is damaged.
+static struct img *sfl_load(const struct sfl_rec *r)
+{
+	if (r->bits_per_val != 1 && r->bits_per_val != 8)
+		return NULL;
+	struct img *im = img_new(r->w, r->h, r->bits_per_val, 255);
+	if (unpackbits((const uint8_t *)(r + 1), r->len, im->data, img_data_len(r->w, r->h, r->bits_per_val)))
+	{
+		img_free(im);
+		return NULL;
+	}
+	return im;
+}
+
+
+static void sfl_print(const struct sfl_rec *r, const char *note)
+{
+	char uid16[SFM_PAYLOAD_LEN + 1], when[32];
+	time_t t = r->time;
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+	sfm_format(uid16, r->letter, r->uid);
+	printf("%s %ux%u %s%s\n", uid16, r->w, r->h, when, note);
+}
+
+
+// lists the archived labels, indexed ones sorted by uid, then the unindexed ones.
+int run_archive_list(const char *path)
+{
+	struct sfl_map m;
+	const struct sfl_rec *r;
+	unsigned n = 0;
+
+	if (sfl_map(path, &m))
+		return 1;
+	for (uint64_t i = 0; i < m.hdr->index_count; i++)
+	{
+		if ((r = sfl_rec_at(&m, m.index[i].off)))
+		{
+			sfl_print(r, "");
+			n++;
+		}
+	}
+	for (uint64_t off = m.tail; (r = sfl_rec_at(&m, off)); off = sfl_next(r, off))
+	{
+		sfl_print(r, " not indexed");
+		n++;
+	}
+	printf("# %u labels in %s\n", n, path);
+	munmap((void *)m.base, m.len);
+	return 0;
+}
+
+
+// reprints the comma separated uids from the archive, on the first working printer of devices,
+// else into the outfile, printed with -P. Returns 0 when all are reprinted.
+int run_reprint(struct qr_config *cfg, const char *path, const char *uids, const char *devices)
+{
+	struct sfl_map m;
+	char list[1024];
+	char *save = NULL;
+	unsigned nuids = 0, done = 0;
+	int ret = 0;
+
+	if (sfl_map(path, &m))
+		return 1;
+	memset(&dispatch, 0, sizeof(dispatch));
+	if (devices && !dispatch_open(devices))
+	{
+		printf("ERROR: no printer in '%s'\n", devices);
+		munmap((void *)m.base, m.len);
+		return 1;
+	}
+
+	snprintf(list, sizeof(list), "%s", uids);
+	for (const char *u = list; *u; u++)
+		nuids += (*u == ',');
+	nuids++;
+	for (char *u = strtok_r(list, ",", &save); u; u = strtok_r(NULL, ",", &save))
+	{
+		char letter, uid16[SFM_PAYLOAD_LEN + 1];
+		uint64_t uid;
+		double t0 = dispatch_now();
+		if (sfm_parse_any(u, &letter, &uid))
+		{
+			printf("ERR bad uid %s\n", u);
+			ret = 1;
+			continue;
+		}
+		const struct sfl_rec *r = sfl_find(&m, uid);
+		struct img *im = r ? sfl_load(r) : NULL;
+		if (!im)
+		{
+			printf(r ? "ERR %s is damaged in %s\n" : "ERR %s not in %s\n", u, path);
+			ret = 1;
+			continue;
+		}
+		sfm_format(uid16, r->letter, r->uid);
+		double t_found = dispatch_now() - t0;
+
+		const char *where = NULL;
+		if (devices)
+		{
+			struct dispatch_label *l = (struct dispatch_label *)malloc(sizeof(*l) + ptouch_stream_len(im->w));
+			l->len = ptouch_encode(im, l->data);
+			// in turn, a printer that fails is dropped for the following uids.
+			for (unsigned i = 0; i < dispatch.nprinters && l->len && !where; i++)
+			{
+				struct dispatch_printer *p = dispatch.printer + i;
+				if (p->error)
+					continue;
+				if ((p->error = dispatch_send(p, l)))
+				{
+					printf("# %s: %s\n", p->name, p->error);
+					continue;
+				}
+				p->labels++;
+				where = p->name;
+			}
+			free(l);
+		}
+		else
+		{
+			char outfile[FILENAME_LEN];
+			cfg->seq = (nuids > 1) ? done + 1 : 0;
+			batch_outfile(cfg, outfile, sizeof(outfile));
+			img_save(im, outfile);
+			if (!print_label(cfg, im, outfile))
+				where = outfile;
+		}
+		img_free(im);
+		if (!where)
+		{
+			printf("ERR %s not printed\n", uid16);
+			ret = 1;
+			continue;
+		}
+		printf("OK %s %s, found in %.2f ms, %.1f ms total\n", uid16, where, t_found * 1000, (dispatch_now() - t0) * 1000);
+		done++;
+	}
+
+	for (unsigned i = 0; i < dispatch.nprinters; i++)
+	{
+		if (dispatch.printer[i].fd >= 0)
+			close(dispatch.printer[i].fd);
+		if (dispatch.printer[i].kind == DISPATCH_SIM)
+			ptouch_close();
+	}
+	munmap((void *)m.base, m.len);
+	return ret;
+}
+
+
+/*
+ * Preview mode (--preview height): thumbnails of many labels in one pass, for
+ * the inventory web ui. Payloads come from stdin, one per line. Each label is
+ * rendered on an 8 bit canvas and box filtered down to height pixels, see
+ * img_downscale(). All thumbnails go into one pgm, a grid of cells as wide as
+ * the widest; each is reported as 'OK payload x y w h', bad lines with ERR.
+ * Only OK, ERR, ERROR, WARNING and # lines go to stdout, the renderer is quiet.
+ */
+#define PREVIEW_SHEET_W		2048	// cells per row: as many as fit
+#define PREVIEW_SHEET_MAX	(64u << 20)	// pixels of the sheet
+
+int run_preview(struct qr_config *cfg, unsigned height)
+{
+	struct img **thumbs = NULL;
+	char (*payloads)[SFM_PAYLOAD_LEN + 1] = NULL;
+	unsigned n = 0, size = 0, cell_w = 1, bad = 0;
+	char line[256];
+	double t0 = dispatch_now();
+
+	if (!height || height > cfg->max_height)
+	{
+		printf("ERROR: preview height %u, must be 1 to %u, the label height\n", height, cfg->max_height);
+		return 1;
+	}
+#if DEBUG > 0
+	debug_out = 0;
+#endif
+	cfg->bits_per_val = 8;
+	while (fgets(line, sizeof(line), stdin))
+	{
+		unsigned len = strcspn(line, "\r\n");
+		char letter[2] = { 0, 0 }, payload[SFM_PAYLOAD_LEN + 1];
+		uint64_t uid;
+		struct qr_tag tag;
+
+		if (!len)
+			continue;
+		if (sfm_parse_n(line, len, letter, &uid))
+		{
+			printf("ERR bad code '%.*s'\n", (len < 64) ? (int)len : 64, line);
+			bad++;
+			continue;
+		}
+		sfm_format(payload, letter[0], uid);
+		struct img *im = render_qrcode_tag(cfg, letter, payload + SFM_PAYLOAD_LEN - SFM_UID_LEN, &tag);
+		if (!im)
+		{
+			printf("ERR %s not rendered\n", payload);
+			bad++;
+			continue;
+		}
+		unsigned w = (im->w * height + im->h / 2) / im->h;
+		struct img *t = img_downscale(im, w ? w : 1, height);
+		img_free(im);
+		if (!t)
+		{
+			printf("ERR %s not scaled\n", payload);
+			bad++;
+			continue;
+		}
+
+		if (n == size)
+		{
+			size = size ? 2 * size : 256;
+			thumbs = (struct img **)realloc(thumbs, size * sizeof(*thumbs));
+			payloads = (char (*)[SFM_PAYLOAD_LEN + 1])realloc(payloads, size * sizeof(*payloads));
+		}
+		thumbs[n] = t;
+		memcpy(payloads[n++], payload, sizeof(payload));
+		if (t->w > cell_w)
+			cell_w = t->w;
+	}
+
+	if (n)
+	{
+		unsigned cols = (cell_w < PREVIEW_SHEET_W) ? PREVIEW_SHEET_W / cell_w : 1;
+		if (cols > n)
+			cols = n;
+		uint64_t sheet_h = (uint64_t)(n + cols - 1) / cols * height;
+		struct img *sheet = NULL;
+		if ((uint64_t)cols * cell_w * sheet_h > PREVIEW_SHEET_MAX)
+			printf("ERROR: preview sheet %ux%llu is too big, split the input\n", cols * cell_w, (unsigned long long)sheet_h);
+		else
+			sheet = img_new(cols * cell_w, (unsigned)sheet_h, 8, 255);
+		for (unsigned i = 0; i < n; i++)
+		{
+			unsigned x = i % cols * cell_w, y = i / cols * height;
+			if (sheet)
+			{
+				for (unsigned j = 0; j < height; j++)
+					memcpy(sheet->data + (size_t)sheet->w * (y + j) + x, thumbs[i]->data + thumbs[i]->w * j, thumbs[i]->w);
+				printf("OK %s %u %u %u %u\n", payloads[i], x, y, thumbs[i]->w, height);
+			}
+			img_free(thumbs[i]);
+		}
+		if (!sheet)
+		{
+			bad += n;
+			n = 0;
+		}
+		else
+		{
+			img_save(sheet, cfg->outfile);
+			img_free(sheet);
+		}
+	}
+	double elapsed = dispatch_now() - t0;
+	printf("# %u previews of %u pixels in %s, %u bad, %.2fs, %.0f labels/s\n", n, height, n ? cfg->outfile : "-",
+		bad, elapsed, elapsed > 0 ? n / elapsed : 0);
+	free(thumbs);
+	free(payloads);
+	return bad ? 1 : 0;
+}
+
+
+/*
+ * Host side of the label station (sfm_station.h): job lines
+ * '<letter> [count] [uid ...]' from stdin go to the station on a serial port.
+ * No more jobs are in flight than the station has free queue slots, so the
+ * host streams without waiting per label. Each label is printed as reported.
+ */
+#define STATION_TIMEOUT_MS	5000
+
+struct station_host {
+	int fd;
+	uint8_t seq;
+	struct station_rx rx;
+	unsigned unacked, free, jobs, labels;
+};
+
+
+static int station_open(const char *tty)
+{
+	int fd = open(tty, O_RDWR | O_NOCTTY);
+	struct termios t;
+	if (fd < 0 || tcgetattr(fd, &t))
+	{
+		printf("ERROR: cannot open %s: errno=%d\n", tty, errno);
+		return -1;
+	}
+	cfmakeraw(&t);
+	cfsetspeed(&t, B921600);
+	t.c_cflag |= CLOCAL | CREAD;
+	tcsetattr(fd, TCSANOW, &t);
+	tcflush(fd, TCIOFLUSH);
+	return fd;
+}
+
+
+static int station_host_send(struct station_host *h, uint8_t type, const void *payload, unsigned len)
+{
+	uint8_t frame[STATION_HDR_LEN + STATION_MAX_PAYLOAD + 2];
+	unsigned n = station_frame(frame, type, ++h->seq, payload, len);
+	return (write(h->fd, frame, n) == (ssize_t)n) ? 0 : -1;
+}
+
+
+// waits for the next frame. Returns 0, or -1 on timeout.
+static int station_host_recv(struct station_host *h)
+{
+	uint8_t buf[256];
+	for (;;)
+	{
+		struct pollfd p = { h->fd, POLLIN, 0 };
+		if (poll(&p, 1, STATION_TIMEOUT_MS) <= 0)
+			return -1;
+		// one byte at a time, the rest of a read would belong to the next frame.
+		if (read(h->fd, buf, 1) != 1)
+			return -1;
+		if (station_rx_byte(&h->rx, buf[0]))
+			return 0;
+	}
+}
+
+
+// handles the reports that may come in at any time. Returns 1 if the frame was one of them.
+static int station_host_report(struct station_host *h)
+{
+	struct station_rx *rx = &h->rx;
+	char payload[SFM_PAYLOAD_LEN + 1];
+
+	switch (STATION_RX_TYPE(rx))
+	{
+	case STATION_ACK:
+	{
+		struct station_ack_msg a;
+		memcpy(&a, STATION_RX_PAYLOAD(rx), sizeof(a));
+		h->unacked--;
+		h->free = a.free;
+		return 1;
+	}
+	case STATION_NAK:
+		printf("ERR station: error %u\n", STATION_RX_PAYLOAD(rx)[0]);
+		h->unacked--;
+		h->jobs--;
+		return 1;
+	case STATION_LABEL:
+	{
+		struct station_label_msg l;
+		memcpy(&l, STATION_RX_PAYLOAD(rx), sizeof(l));
+		sfm_format(payload, l.letter, l.uid);
+		if (l.result)
+			printf("ERR %s: error %u\n", payload, l.result);
+		else
+			printf("OK %s\n", payload);
+		h->labels++;
+		return 1;
+	}
+	case STATION_JOB_DONE:
+		h->jobs--;
+		h->free++;
+		return 1;
+	}
+	return 0;
+}
+
+
+static int station_host_job(struct station_host *h, struct station_job_msg *m)
+{
+	while (h->unacked >= h->free)
+	{
+		if (station_host_recv(h))
+			return -1;
+		station_host_report(h);
+	}
+	if (station_host_send(h, STATION_JOB, m, 4 + 8 * m->nuid))
+		return -1;
+	h->unacked++;
+	h->jobs++;
+	m->nuid = 0;
+	return 0;
+}
+
+
+// waits for the ACK or NAK of the last request, that is not a job. Returns 0 for ACK.
+static int station_host_wait(struct station_host *h)
+{
+	for (;;)
+	{
+		if (station_host_recv(h))
+			return -1;
+		uint8_t type = STATION_RX_TYPE(&h->rx);
+		if ((type == STATION_ACK || type == STATION_NAK) && STATION_RX_SEQ(&h->rx) == h->seq)
+			return (type == STATION_ACK) ? 0 : STATION_RX_PAYLOAD(&h->rx)[0];
+		station_host_report(h);
+	}
+}
+
+
+// reads one 'uid ...' per line, as printed by 'shelfman-index new'. Returns the number of uids, or -1.
+static int station_read_pool(const char *file, uint64_t *uids)
+{
+	FILE *fp = fopen(file, "r");
+	char line[256];
+	int n = 0;
+
+	if (!fp)
+	{
+		printf("ERROR: cannot open %s: errno=%d\n", file, errno);
+		return -1;
+	}
+	while (n >= 0 && fgets(line, sizeof(line), fp))
+	{
+		char *t = strtok(line, " \t\r\n");
+		if (!t || t[0] == '#')
+			continue;
+		if (n == STATION_POOL_MAX)
+		{
+			printf("ERROR: %s has more than %u uids\n", file, STATION_POOL_MAX);
+			n = -1;
+		}
+		else if (sfm_parse_any(t, NULL, uids + n))
+		{
+			printf("ERROR: bad uid %s in %s\n", t, file);
+			n = -1;
+		}
+		else
+			n++;
+	}
+	fclose(fp);
+	if (!n)
+		printf("ERROR: no uids in %s\n", file);
+	return n ? n : -1;
+}
+
+
+// replaces the uid pool of the station. The old pool stays active until the commit.
+static int station_upload_pool(struct station_host *h, const char *file)
+{
+	uint64_t *uids = (uint64_t *)malloc(STATION_POOL_MAX * sizeof(uint64_t));
+	int n = station_read_pool(file, uids);
+	int r = -1;
+
+	if (n < 0)
+	{
+		free(uids);
+		return -1;
+	}
+	uint32_t count = n;
+	if (!station_host_send(h, STATION_POOL_BEGIN, &count, 4) && !(r = station_host_wait(h)))
+	{
+		for (uint32_t i = 0; i < count && !r; i += STATION_POOL_CHUNK)
+		{
+			uint8_t chunk[4 + STATION_POOL_CHUNK * 8];
+			unsigned len = (count - i < STATION_POOL_CHUNK) ? count - i : STATION_POOL_CHUNK;
+			memcpy(chunk, &i, 4);
+			memcpy(chunk + 4, uids + i, len * 8);
+			r = station_host_send(h, STATION_POOL_DATA, chunk, 4 + len * 8) ? -1 : station_host_wait(h);
+		}
+	}
+	if (!r)
+	{
+		uint16_t crc = station_crc16(0xffff, (const uint8_t *)uids, count * 8);
+		r = station_host_send(h, STATION_POOL_COMMIT, &crc, 2) ? -1 : station_host_wait(h);
+	}
+	free(uids);
+	if (r)
+	{
+		printf("ERROR: pool upload failed%s\n", (r > 0) ? ", the old pool stays active" : ", no answer");
+		return -1;
+	}
+	printf("# pool: %u uids uploaded\n", count);
+	return 0;
+}
+
+
+static int station_pull_raster(struct station_host *h, const char *outfile)
+{
+	struct station_raster_hdr rh;
+	struct img *im = NULL;
+	uint32_t got = 0;
+
+	memset(&rh, 0, sizeof(rh));
+	if (station_host_send(h, STATION_RASTER, NULL, 0))
+		return -1;
+	for (;;)
+	{
+		if (station_host_recv(h))
+			break;
+		uint8_t type = STATION_RX_TYPE(&h->rx);
+		if (type == STATION_NAK)
+		{
+			printf("ERROR: the station has no raster\n");
+			return -1;
+		}
+		if (type == STATION_RASTER_HDR)
+		{
+			memcpy(&rh, STATION_RX_PAYLOAD(&h->rx), sizeof(rh));
+			if (rh.len != img_data_len(rh.w, rh.h, rh.bits_per_val))
+				break;
+			im = img_new(rh.w, rh.h, rh.bits_per_val, 255);
+		}
+		else if (type == STATION_RASTER_DATA && im)
+		{
+			uint32_t off;
+			unsigned n = STATION_RX_LEN(&h->rx) - 4;
+			memcpy(&off, STATION_RX_PAYLOAD(&h->rx), 4);
+			if (off + n > rh.len)
+				break;
+			memcpy(im->data + off, STATION_RX_PAYLOAD(&h->rx) + 4, n);
+			if ((got += n) == rh.len)
+			{
+				img_save(im, outfile);
+				img_free(im);
+				return 0;
+			}
+		}
+		else
+			station_host_report(h);
+	}
+	printf("ERROR: raster transfer failed\n");
+	if (im)
+		img_free(im);
+	return -1;
+}
+
+
+int run_station_client(const char *tty, const char *pool_file, const char *raster_out)
+{
+	struct station_host h;
+	struct station_status_msg st;
+	char line[1024];
+
+	memset(&h, 0, sizeof(h));
+	if ((h.fd = station_open(tty)) < 0)
+		return 1;
+
+	// the free queue slots are our window.
+	if (station_host_send(&h, STATION_STATUS, NULL, 0))
+		return 1;
+	do
+	{
+		if (station_host_recv(&h))
+		{
+			printf("ERROR: no answer from the station on %s\n", tty);
+			return 1;
+		}
+	} while (STATION_RX_TYPE(&h.rx) != STATION_STATUS_REPLY);
+	memcpy(&st, STATION_RX_PAYLOAD(&h.rx), sizeof(st));
+	h.free = st.free;
+	if (pool_file)
+	{
+		if (station_upload_pool(&h, pool_file))
+			return 1;
+	}
+	else if (st.pool_count)
+		printf("# pool: %u of %u uids used\n", st.pool_used, st.pool_count);
+	if (st.printer == STATION_PRINTER_READY)
+		printf("# printer: %u mm tape\n", st.media_width);
+	else if (st.printer == STATION_PRINTER_ERROR)
+	{
+		struct ptouch_status ps;
+		memset(&ps, 0, sizeof(ps));
+		ps.error1 = st.printer_error1;
+		ps.error2 = st.printer_error2;
+		printf("# printer: %s\n", ptouch_status_error(&ps));
+	}
+
+	while (fgets(line, sizeof(line), stdin))
+	{
+		char *save = NULL;
+		char *letter = strtok_r(line, " \t\r\n", &save);
+		char *tok = strtok_r(NULL, " \t\r\n", &save);
+		struct station_job_msg m;
+		unsigned long random = 1;
+		unsigned uids = 0, bad = 0;
+
+		if (!letter)
+			continue;
+		if (strlen(letter) != 1 || !isalpha(letter[0]))
+		{
+			printf("ERR expected: <letter> [count] [uid ...]\n");
+			continue;
+		}
+		if (tok)
+		{
+			// as in daemon_parse_job(): not a number, then there is no count and it is the first uid.
+			char *end;
+			random = strtoul(tok, &end, 10);
+			if (isdigit((unsigned char)tok[0]) && !*end)
+				tok = strtok_r(NULL, " \t\r\n", &save);
+			else
+				random = 0;
+		}
+		if (random > 0xffff)
+		{
+			printf("ERR count %lu, at most 65535\n", random);
+			continue;
+		}
+		memset(&m, 0, sizeof(m));
+		m.letter = toupper(letter[0]);
+		for (char *uid = tok; uid; uid = strtok_r(NULL, " \t\r\n", &save))
+		{
+			char l;
+			uint64_t u;
+			if (sfm_parse_any(uid, &l, &u))
 			{
-				printf("ERROR: replacment glyph also not found: '%c'\n", ch);
-				exit(1);
+				printf("ERR bad uid %s\n", uid);
+				bad++;
+				continue;
 			}
+			uids++;
+			m.uid[m.nuid] = u;
+			if (++m.nuid == STATION_MAX_UIDS && station_host_job(&h, &m))
+				goto fail;
 		}
-		struct img *glyph_buf = img_new(g->width, g->height, BITS_PER_PIXEL, 255);
-
-#if DEBUG > 1
-		printf("glyph dimension of '%c' (%d x %d) @ xAdv=%d, xOff=%d, yOff=%d\n", text[c], g->width, g->height, g->xAdvance, g->xOffset, g->yOffset);
-#endif
-		(void)extract_glyph(f, ch, glyph_buf, BITS_PER_PIXEL, 0);
-		blit(glyph_buf, 0, 0, g->width, g->height,
-			 im, x + (f->scale * g->xOffset), y + (f->scale * (g->yOffset - f->max_asc)), f->scale);
-		x += f->scale * g->xAdvance;
-		img_free(glyph_buf);
+		if (m.nuid && station_host_job(&h, &m))
+			goto fail;
+		if (!uids && !random && !bad)
+			printf("ERR no labels in the job\n");
+		m.count = random;
+		if (m.count && station_host_job(&h, &m))
+			goto fail;
 	}
-    return x - orig_x;
+	while (h.jobs)
+	{
+		if (station_host_recv(&h))
+			goto fail;
+		station_host_report(&h);
+	}
+	if (raster_out && station_pull_raster(&h, raster_out))
+		return 1;
+	close(h.fd);
+	return 0;
+
+fail:
+	printf("ERROR: station on %s does not answer, %u labels reported\n", tty, h.labels);
+	close(h.fd);
+	return 1;
 }
+#endif // __linux__
 
 
-int gen_qrcode_tag(struct qr_config *cfg, const char *letter)
-{
-	unsigned width, height;
-	char uid16[40];
-	const char *code_text = "-";
-	char label_text[40];
-	snprintf(label_text, 40, "%s%s/", cfg->label_text_pre, letter);
+#ifndef __linux__ // RP2040 Pico SDK
+#define LED_PIN 25
 
-    sprintf(uid16, "SFM-%s-", letter);
-	hex16_string(uid16+strlen(uid16));
-#if DEBUG > 0
-	printf("uid16=%s\n", uid16);
+#define BLINK_DIT	blink(0)
+#define BLINK_DAH	blink(1)
+
+#if PICO_STDIO_USB_USE_TINYUSB
+# define CONSOLE_READY stdio_usb_connected()
+#elif PICO_STDIO_UART_ENABLED
+# define CONSOLE_READY true
+#else
+# define CONSOLE_READY false	// neither usb nor uart configured.
 #endif
-	code_text = uid16;
 
-    struct font *small_font = find_font(cfg->small_font_size);
-    struct font *big_font   = find_font(cfg->big_font_size);
+/*
+ * Label station: jobs come in as frames of sfm_station.h over a DMA uart
+ * (station_uart.c). The queue holds STATION_QUEUE_LEN jobs, one label is
+ * rendered per station_poll(), so that the uart is drained in between.
+ * Count jobs take their uids from the flash pool (uid_pool.c) when the host
+ * has uploaded one, else they are random as on linux.
+ */
+struct station_job {
+	uint16_t id, count, done, failed;
+	uint8_t seq;
+	char letter;
+	uint8_t nuid;
+	uint64_t uid[STATION_MAX_UIDS];
+};
 
-	// measure lengths
-    unsigned title_w = draw_text(NULL, 0, 0, cfg->title_text, big_font, 0);
-	unsigned label_w = draw_text(NULL, 0, 0, label_text, small_font, 0);
-	unsigned code_w  = draw_text(NULL, 0, 0, code_text,  small_font, 0);
+static struct station_job station_queue[STATION_QUEUE_LEN];
+static unsigned station_head = 0, station_queued = 0;		// head: the job in progress
+static uint16_t station_next_id = 1;
+static struct station_status_msg station_stat;
+static struct station_rx station_rx;
+static struct img *station_last = NULL;		// last label, for RASTER
 
-	unsigned max_text_w = 0;
-	if (title_w > max_text_w) max_text_w = title_w;
-	if (label_w > max_text_w) max_text_w = label_w;
-	if (code_w  > max_text_w) max_text_w = code_w;
 
-    unsigned computed_width = cfg->max_height + cfg->hspace + max_text_w + cfg->hspace;
+static void station_send(uint8_t type, uint8_t seq, const void *payload, unsigned len)
+{
+	uint8_t frame[STATION_HDR_LEN + STATION_MAX_PAYLOAD + 2];
+	station_uart_write(frame, station_frame(frame, type, seq, payload, len));
+}
 
-#if DEBUG > 1
-	printf("title_w=%d, label_w=%d, code_w=%d\n", title_w, label_w, code_w);
-#endif
-#if WITH_PNG_SUPPORT
-    unsigned char *pngimage = NULL;
-    if (cfg->input_png_file)
+
+static void station_nak(uint8_t seq, uint8_t err)
+{
+	station_stat.last_error = err;
+	station_send(STATION_NAK, seq, &err, 1);
+}
+
+
+static void station_raster(uint8_t seq)
+{
+	if (!station_last)
 	{
-		unsigned error = lodepng_decode32_file(&pngimage, &width, &height, cfg->input_png_file);
-		if (error) {
-			printf("%s: PNG error %u: %s\n", cfg->input_png_file, error, lodepng_error_text(error));
-			return 1;
-		}
-		printf("Loaded PNG %ux%u\n", width, height);
-#if DEBUG > 0
-        if (width < c_width)
-		    printf("WARNING: computed width for qr-code and text is %u\n", c_width);
-#endif
+		station_nak(seq, STATION_E_NO_RASTER);
+		return;
 	}
-	else
-#endif
-	{
-        width = computed_width;
+	struct station_raster_hdr h;
+	memset(&h, 0, sizeof(h));
+	h.w = station_last->w;
+	h.h = station_last->h;
+	h.bits_per_val = station_last->bits_per_val;
+	h.len = img_data_len(h.w, h.h, h.bits_per_val);
+	station_send(STATION_RASTER_HDR, seq, &h, sizeof(h));
 
-		height = cfg->max_height;
-#if DEBUG > 0
-		printf("canvas size: %ux%u\n", width, height);
-#endif
+	uint8_t chunk[4 + STATION_RASTER_CHUNK];
+	for (uint32_t off = 0; off < h.len; off += STATION_RASTER_CHUNK)
+	{
+		unsigned n = (h.len - off < STATION_RASTER_CHUNK) ? h.len - off : STATION_RASTER_CHUNK;
+		memcpy(chunk, &off, 4);
+		memcpy(chunk + 4, station_last->data + off, n);
+		station_send(STATION_RASTER_DATA, seq, chunk, 4 + n);
 	}
+}
 
-    struct img *bw = img_new(width, height, BITS_PER_PIXEL, 255);
 
-#if WITH_PNG_SUPPORT
-    if (pngimage)
+// the printer fields of STATUS, from the last reply. Does not wait for the printer.
+static void station_printer_status(struct station_status_msg *st)
+{
+	const struct ptouch_status *ps = ptouch_last_status();
+	st->printer = ptouch_ready() ? STATION_PRINTER_READY : STATION_PRINTER_NONE;
+	st->media_width = st->printer_error1 = st->printer_error2 = 0;
+	if (!st->printer || !ps)
+		return;
+	if (ptouch_status_error(ps))
+		st->printer = STATION_PRINTER_ERROR;
+	st->media_width = ps->media_width;
+	st->printer_error1 = ps->error1;
+	st->printer_error2 = ps->error2;
+}
+
+
+static void station_handle(struct station_rx *rx)
+{
+	uint8_t seq = STATION_RX_SEQ(rx);
+	unsigned len = STATION_RX_LEN(rx);
+	struct station_ack_msg ack;
+
+	switch (STATION_RX_TYPE(rx))
+	{
+	case STATION_JOB:
 	{
-		// pngimage is now width*height*4 RGBA bytes.
-		// Convert to black and white, as bytes.
-		for (unsigned int i = 0; i < width * height; i++) {
-			if ((pngimage[4*i+3] < BW_THRESHOLD) || 	// ALPHA
-			((pngimage[4*i+0] < BW_THRESHOLD) &&	// R
-			 (pngimage[4*i+1] < BW_THRESHOLD) &&	// G
-			 (pngimage[4*i+2] < BW_THRESHOLD)))	// B
-				set_pixel(bw, i, 0);
+		struct station_job_msg m;
+		memset(&m, 0, sizeof(m));
+		memcpy(&m, STATION_RX_PAYLOAD(rx), (len < sizeof(m)) ? len : sizeof(m));
+		if (len < 4 || m.nuid > STATION_MAX_UIDS || len != 4 + 8u * m.nuid || !isalpha(m.letter) ||
+		    (!m.nuid && !m.count))
+		{
+			station_nak(seq, STATION_E_BAD_JOB);
+			return;
 		}
-		free(pngimage);
-		// bw image is now width*height bytes 0 or 255.
+		if (station_queued == STATION_QUEUE_LEN)
+		{
+			station_nak(seq, STATION_E_QUEUE_FULL);
+			return;
+		}
+		struct station_job *j = station_queue + (station_head + station_queued++) % STATION_QUEUE_LEN;
+		memset(j, 0, sizeof(*j));
+		j->id = station_next_id++;
+		if (!station_next_id)
+			station_next_id = 1;
+		j->seq = seq;
+		j->letter = toupper(m.letter);
+		j->nuid = m.nuid;
+		j->count = m.nuid ? m.nuid : m.count;
+		memcpy(j->uid, m.uid, sizeof(j->uid));
+		ack.job_id = j->id;
+		ack.free = STATION_QUEUE_LEN - station_queued;
+		station_send(STATION_ACK, seq, &ack, sizeof(ack));
+		return;
 	}
-#endif
+	case STATION_STATUS:
+	{
+		uint32_t count, used;
+		uid_pool_status(&count, &used);
+		station_stat.queued = station_queued;
+		station_stat.free = STATION_QUEUE_LEN - station_queued;
+		station_stat.current_job = station_queued ? station_queue[station_head].id : 0;
+		station_stat.pool_count = count;
+		station_stat.pool_used = used;
+		station_printer_status(&station_stat);
+		station_send(STATION_STATUS_REPLY, seq, &station_stat, sizeof(station_stat));
+		return;
+	}
+	case STATION_RASTER:
+		station_raster(seq);
+		return;
+	case STATION_POOL_BEGIN:
+	case STATION_POOL_DATA:
+	case STATION_POOL_COMMIT:
+	{
+		const uint8_t *p = STATION_RX_PAYLOAD(rx);
+		uint32_t v = 0;
+		uint64_t uids[STATION_POOL_CHUNK];
+		int r = -1;
+		memcpy(&v, p, (len < 4) ? len : 4);
+		if (STATION_RX_TYPE(rx) == STATION_POOL_BEGIN && len == 4)
+			r = uid_pool_begin(v);
+		else if (STATION_RX_TYPE(rx) == STATION_POOL_DATA && len > 4 && (len - 4) % 8 == 0)
+		{
+			memcpy(uids, p + 4, len - 4);	// aligned for the flash page
+			r = uid_pool_data(v, uids, (len - 4) / 8);
+		}
+		else if (STATION_RX_TYPE(rx) == STATION_POOL_COMMIT && len == 2)
+			r = uid_pool_commit(v & 0xffff);
+		if (r)
+		{
+			station_nak(seq, STATION_E_POOL);
+			return;
+		}
+		ack.job_id = 0;
+		ack.free = STATION_QUEUE_LEN - station_queued;
+		station_send(STATION_ACK, seq, &ack, sizeof(ack));
+		return;
+	}
+	case STATION_CLEAR:
+		// the job in progress is finished, the others are dropped.
+		if (station_queued > 1)
+			station_queued = 1;
+		ack.job_id = 0;
+		ack.free = STATION_QUEUE_LEN - station_queued;
+		station_send(STATION_ACK, seq, &ack, sizeof(ack));
+		return;
+	default:
+		station_nak(seq, STATION_E_UNKNOWN);
+	}
+}
 
-    int qrsize = render_qrcode(bw, 0, 0, 2, "Q", 3, (const char *)uid16, 4);
-#if DEBUG > 0
-	printf("qrcde size = %d\n", qrsize);
-#endif
-	if (qrsize < 0) return 1;
 
-    int y = cfg->vspace/2;
-    // write some font,
-#if 0
-    draw_text(bw, qrsize, y,    "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG.", small_font, 0);
-    draw_text(bw, qrsize, y+50, "the quick brown fox jumps over the lazy dog.", big_font, 0);
-#else
-	draw_text(bw, qrsize + cfg->hspace + (int)((max_text_w - title_w)/2), y, cfg->title_text, big_font, 0);
-	y = y + (int)(cfg->line_advance_perc * cfg->big_font_size / 100);
-	draw_text(bw, qrsize + cfg->hspace + (int)((max_text_w - label_w)/2), y, label_text, small_font, 0);
-	y = y + (int)(cfg->line_advance_perc * cfg->small_font_size / 100);
-	draw_text(bw, qrsize + cfg->hspace + (int)((max_text_w - code_w)/2),  y, code_text,  small_font, 0);
-#endif
+// renders one label, uid NULL: a random one. Returns 0 or STATION_E_*, printed gets the uid.
+static uint8_t station_render(struct qr_config *cfg, char letter, const uint64_t *uid, uint64_t *printed)
+{
+	struct qr_tag tag;
+	char l[2] = { letter, '\0' };
+	char payload[SFM_PAYLOAD_LEN + 1];
 
-#ifdef WITH_PNG_SUPPORT
-    // with a loaded png, we have space to play around.
-    blit(bw, 10, 150, 400, 20,  bw, 10, 180, 6|0x80); // zoom on the text
-    blit(bw, 0, 0, (unsigned)qrsize, (unsigned)qrsize,  bw, 10, 300, 6|0x80); // zoom on QR code
-#endif
+	if (uid)
+		sfm_format(payload, letter, *uid);
+	rp2040_boost(true);
+	struct img *bw = render_qrcode_tag(cfg, l, uid ? payload + 6 : NULL, &tag);
+	rp2040_boost(false);
+	sfm_parse(tag.uid16, NULL, printed);
+	if (!bw)
+		return STATION_E_RENDER;
+	if (station_last)
+		img_free(station_last);
+	station_last = bw;
 
-#ifdef WITH_PNG_SUPPORT
-    // FIXME, we should not save a PGM file here, we should save a proper PNG.
-    img_save(bw, cfg->outfile);
-#else
-    // save as PGM
-    img_save(bw, cfg->outfile);
-#endif
+	// the printer is optional, without one the host fetches the raster.
+	if (!ptouch_ready())
+		return 0;
+	uint8_t *stream = (uint8_t *)malloc(ptouch_stream_len(bw->w));
+	if (!stream)
+		return STATION_E_RENDER;
+	unsigned len = ptouch_encode(bw, stream);
+	int r = len ? ptouch_print(stream, len) : 0;
+	free(stream);
+	if (!len)
+		return STATION_E_RENDER;
+	if (r)
+		return STATION_E_PRINTER;
+	return 0;
+}
+
+
+// renders the next label of the head job and reports it.
+static void station_run(struct qr_config *cfg)
+{
+	struct station_job *j = station_queue + station_head;
+	struct station_label_msg lm;
+	uint64_t uid = 0;
+	int pool = 0;
+
+	memset(&lm, 0, sizeof(lm));
+	lm.job_id = j->id;
+	lm.index = j->done + j->failed;
+	lm.letter = j->letter;
+
+	// a printer that reports an error stops the label before it takes a uid of the pool.
+	// Its last reply tells, without a round trip; only an error is asked again, it may be cleared.
+	// ptouch_print() asks for the status anyway, after the label is rendered.
+	const struct ptouch_status *ps = ptouch_last_status();
+	if (ptouch_ready() && ps && ptouch_status_error(ps) && ptouch_status(NULL) == PTOUCH_E_PRINTER)
+		lm.result = STATION_E_PRINTER;
+	else
+	{
+		if (j->nuid)
+			uid = j->uid[lm.index];
+		else
+			pool = uid_pool_take(&uid);	// 1: no pool, random uid
+		if (pool < 0)
+			lm.result = STATION_E_POOL_EMPTY;	// no random uids once the host manages them.
+		else
+			lm.result = station_render(cfg, j->letter, (pool == 1) ? NULL : &uid, &uid);
+	}
+	lm.uid = uid;
+
+	if (lm.result)
+	{
+		station_stat.last_error = lm.result;
+		station_stat.labels_failed++;
+		j->failed++;
+	}
+	else
+	{
+		station_stat.labels_done++;
+		j->done++;
+	}
+	station_send(STATION_LABEL, j->seq, &lm, sizeof(lm));
 
-    img_free(bw);
-    return 0;
+	if (j->done + j->failed == j->count)
+	{
+		struct station_done_msg dm = { j->id, j->done, j->failed };
+		station_send(STATION_JOB_DONE, j->seq, &dm, sizeof(dm));
+		station_head = (station_head + 1) % STATION_QUEUE_LEN;
+		station_queued--;
+	}
 }
 
 
-#ifndef __linux__ // RP2040 Pico SDK
-#define LED_PIN 25
+void station_poll(struct qr_config *cfg)
+{
+	uint8_t buf[256];
+	unsigned n;
 
-#define BLINK_DIT	blink(0)
-#define BLINK_DAH	blink(1)
+	while ((n = station_uart_read(buf, sizeof(buf))) > 0)
+		for (unsigned i = 0; i < n; i++)
+			if (station_rx_byte(&station_rx, buf[i]))
+				station_handle(&station_rx);
+	tuh_task();
+	ptouch_poll();		// the printed reply of the last label
+	if (station_queued)
+		station_run(cfg);
+}
 
-#if PICO_STDIO_USB_USE_TINYUSB
-# define CONSOLE_READY stdio_usb_connected()
-#elif PICO_STDIO_UART_ENABLED
-# define CONSOLE_READY true
-#else
-# define CONSOLE_READY false	// neither usb nor uart configured.
-#endif
 
 struct qr_config *global_qrcode_cfg = NULL;
 
+// BOOTSEL: a label of any kind, as gen_qrcode_tag() makes it. Reports the time from the
+// button to the verified raster, to compare builds with and without SFM_SRAM and SFM_BOOST_KHZ.
+// The first label after boot also measures the fonts and builds the qr tables.
+static int button_label(struct qr_config *cfg)
+{
+	char outfile[FILENAME_LEN];
+	struct qr_tag tag;
+	uint64_t t0 = time_us_64();
+
+	rp2040_boost(true);
+	uint64_t t1 = time_us_64();
+	struct img *bw = render_qrcode_tag(cfg, "X", NULL, &tag);
+	uint64_t t2 = time_us_64();
+	rp2040_boost(false);
+	if (CONSOLE_READY)
+		printf("button to raster: %u us, render %u us, clock switch %u us (sram %d, boost %u kHz)\n",
+			(unsigned)(t2 - t0), (unsigned)(t2 - t1), (unsigned)(t1 - t0 + time_us_64() - t2),
+			SFM_SRAM, SFM_BOOST_KHZ);
+	if (!bw)
+		return 1;
+	batch_outfile(cfg, outfile, sizeof(outfile));
+	img_save(bw, outfile);
+	int ret = print_label(cfg, bw, outfile);
+	img_free(bw);
+	return ret;
+}
+
+
 bool sleep100ms_bs(unsigned n)
 {
     static bool prev_bootsel_state = 0;
@@ -592,7 +4453,11 @@ bool sleep100ms_bs(unsigned n)
 
 	for (unsigned i=0; i < n; i++)
 	{
-		sleep_ms(100);
+		for (unsigned j=0; j < 10; j++)
+		{
+			station_poll(global_qrcode_cfg);	// the uart ring must not wait 100ms.
+			sleep_ms(10);
+		}
 		bool state = get_bootsel_button();	// from rp2040.c
 		if (state != prev_bootsel_state)
 		{
@@ -601,7 +4466,7 @@ bool sleep100ms_bs(unsigned n)
 			{
 				if (CONSOLE_READY)
 					printf("BOOTSEL pressed!\n");
-				gen_qrcode_tag(global_qrcode_cfg, "X");
+				button_label(global_qrcode_cfg);
 			}
 			else
 			{
@@ -624,44 +4489,396 @@ int blink(bool dah)
 #endif // __linux__ // RP2040 Pico SDK
 
 
-int main(int ac, char **av)
+// the defaults, for a brother D410.
+void qr_config_default(struct qr_config *cfg)
 {
-    struct qr_config cfg;
-	// config for brother D410
-	cfg.max_height = 120;		// my tape can print 120, although the printer could print 128.
-	cfg.big_font_size = BIG_FONT_SIZE;
-	cfg.small_font_size = SMALL_FONT_SIZE;
-	cfg.line_advance_perc = (int)(100 * LINE_ADVANCE_FACTOR);
-	cfg.hspace = 16;
-	cfg.vspace = 8;
-	cfg.title_text = "JW";
-	cfg.label_text_pre = "shelfman.de/";
+	cfg->max_height = 120;		// my tape can print 120, although the printer could print 128.
+	cfg->dpi = 180;
+	cfg->qr_upper = 1;
+	cfg->symbology = CODE_QR;
+	cfg->big_font_size = BIG_FONT_SIZE;
+	cfg->small_font_size = SMALL_FONT_SIZE;
+	cfg->line_advance_perc = (int)(100 * LINE_ADVANCE_FACTOR);
+	cfg->hspace = 16;
+	cfg->vspace = 8;
+	cfg->title_text = "JW";
+	cfg->label_text_pre = "shelfman.de/";
 
 #if WITH_PNG_SUPPORT
-	cfg.outfile = "output.pgm";	// FIXME: this should be a png file, see FIXME at end of main()
+	cfg->outfile = "output.pgm";	// FIXME: this should be a png file, see FIXME at end of main()
 #else
-	cfg.outfile = "output.pgm";	// FIXME: this should be pbm, if BITS_PER_PIXEL == 1
+	cfg->outfile = "output.pgm";	// FIXME: this should be pbm, if BITS_PER_PIXEL == 1
 #endif
 
-#if WITH_PNG_SUPPORT
-	if (ac > 2)
-		cfg.input_png_file = av[2];
+	cfg->input_png_file = NULL;
+	cfg->seq = 0;
+	cfg->strip_gap = cfg->hspace;
+	cfg->cut_marks = 0;
+	cfg->print = 0;
+	cfg->printer = "/dev/usb/lp0";
+	cfg->verify = 1;
+	cfg->bits_per_val = BITS_PER_PIXEL;
+	cfg->archive = NULL;
+	cfg->text_fit_warned = 0;
+}
+
+
+#ifdef SFM_LIBRARY
+/*
+ * C ABI of libshelfman.so, used by shelfman-qrcode.py through ctypes.
+ * Labels are struct img: 1 bit per pixel, MSB first, rows not padded,
+ * 1 is white, or with bits_per_val 8 one byte per pixel, 255 is white.
+ * Not thread safe, the qr tables are global.
+ */
+struct sfm_lib {
+	struct qr_config cfg;
+	char title[64], label_pre[64];
+};
+
+extern "C" {
+
+struct sfm_lib *sfm_lib_new(void)
+{
+	struct sfm_lib *lib = (struct sfm_lib *)calloc(1, sizeof(*lib));
+	qr_config_default(&lib->cfg);
+	return lib;
+}
+
+
+void sfm_lib_free(struct sfm_lib *lib)
+{
+	free(lib);
+}
+
+
+// sets a config value by name. Returns 0, or -1 for an unknown name.
+int sfm_lib_set(struct sfm_lib *lib, const char *name, const char *value)
+{
+	struct qr_config *cfg = &lib->cfg;
+	unsigned v = atoi(value);
+
+	if (!strcmp(name, "title"))
+	{
+		snprintf(lib->title, sizeof(lib->title), "%s", value);
+		cfg->title_text = lib->title;
+	}
+	else if (!strcmp(name, "label_pre"))
+	{
+		snprintf(lib->label_pre, sizeof(lib->label_pre), "%s", value);
+		cfg->label_text_pre = lib->label_pre;
+	}
+	else if (!strcmp(name, "max_height")) cfg->max_height = v;
+	else if (!strcmp(name, "tape"))
+	{
+		if (!tape_height(v))
+			return -1;
+		cfg->max_height = tape_height(v);
+	}
+	else if (!strcmp(name, "dpi")) cfg->dpi = v;
+	else if (!strcmp(name, "qr_upper")) cfg->qr_upper = v;
+	else if (!strcmp(name, "symbology"))
+	{
+		if (symbology(value) < 0)
+			return -1;
+		cfg->symbology = symbology(value);
+	}
+	else if (!strcmp(name, "verify")) cfg->verify = v;
+	else if (!strcmp(name, "bits_per_val"))
+	{
+		if (v != 1 && v != 8)
+			return -1;
+		cfg->bits_per_val = v;
+	}
+	else if (!strcmp(name, "hspace")) cfg->hspace = v;
+	else if (!strcmp(name, "vspace")) cfg->vspace = v;
+	else if (!strcmp(name, "big_font_size")) cfg->big_font_size = v;
+	else if (!strcmp(name, "small_font_size")) cfg->small_font_size = v;
 	else
-		cfg.input_png_file = NULL;
-#endif
+		return -1;
+	return 0;
+}
+
+
+// renders one label, as shelfman-qrcode does. uid is xxxxxxxx-xxxx-xxxx, or NULL for a random one.
+// payload gets the SFM payload, it needs SFM_PAYLOAD_LEN+1 bytes. Returns NULL on error.
+struct img *sfm_lib_render(struct sfm_lib *lib, const char *letter, const char *uid, char *payload)
+{
+	struct qr_tag tag;
+	struct img *im = render_qrcode_tag(&lib->cfg, letter, uid, &tag);
+	if (payload)
+	{
+		memcpy(payload, tag.uid16, SFM_PAYLOAD_LEN);	// layout_qrcode_tag() made it SFM_PAYLOAD_LEN long.
+		payload[SFM_PAYLOAD_LEN] = '\0';
+	}
+	return im;
+}
+
+
+// renders count labels into out[]. uids is NULL, or count uids of SFM_UID_LEN+1 bytes each,
+// payloads gets count payloads of SFM_PAYLOAD_LEN+1 bytes each. Returns the number of failed labels.
+int sfm_lib_render_batch(struct sfm_lib *lib, const char *letter, unsigned count, const char *uids,
+			 struct img **out, char *payloads)
+{
+	int failed = 0;
+	for (unsigned i = 0; i < count; i++)
+	{
+		out[i] = sfm_lib_render(lib, letter, uids ? uids + i * (SFM_UID_LEN + 1) : NULL,
+					payloads ? payloads + i * (SFM_PAYLOAD_LEN + 1) : NULL);
+		if (!out[i])
+			failed++;
+	}
+	return failed;
+}
+
+
+void sfm_lib_img_info(struct img *im, unsigned *w, unsigned *h, unsigned *bits_per_val, unsigned *len)
+{
+	*w = im->w;
+	*h = im->h;
+	*bits_per_val = im->bits_per_val;
+	*len = img_data_len(im->w, im->h, im->bits_per_val);
+}
+
+
+const unsigned char *sfm_lib_img_data(struct img *im)
+{
+	return im->data;
+}
+
+
+void sfm_lib_img_free(struct img *im)
+{
+	img_free(im);
+}
+
+
+// a box filtered thumbnail of h pixels, 8 bits per pixel, see img_downscale(). Free it with sfm_lib_img_free().
+struct img *sfm_lib_thumbnail(struct img *im, unsigned h)
+{
+	unsigned w = (im->w * h + im->h / 2) / im->h;
+	return h ? img_downscale(im, w ? w : 1, h) : NULL;
+}
+
+
+// saves as shelfman-qrcode does, byte identical.
+void sfm_lib_save(struct img *im, const char *filename)
+{
+	img_save(im, filename);
+}
+
+
+// the printer stream of a label. out NULL: returns the buffer size needed.
+unsigned sfm_lib_ptouch(struct img *im, unsigned char *out)
+{
+	return out ? ptouch_encode(im, out) : ptouch_stream_len(im->w);
+}
+
+} // extern "C"
+#endif // SFM_LIBRARY
+
+
+#ifndef SFM_LIBRARY
+#define OPT_REPRINT	256	// long options only
+#define OPT_LIST	257
+#define OPT_PREVIEW	258
+#define OPT_GRAY	259
+#define OPT_PRINTER	260
+
+int main(int ac, char **av)
+{
+    struct qr_config cfg;
+	qr_config_default(&cfg);
 
 #ifdef __linux__
 
     srand(time(NULL));
     const char *letter = "X";
-	if (ac > 1) letter = av[1];
-    gen_qrcode_tag(&cfg, letter);
+	unsigned count = 1;
+	unsigned strip = 0;
+	int opt;
+	const char *sock_path = NULL;
+	const char *station_tty = NULL, *raster_out = NULL, *pool_file = NULL;
+	const char *printers = NULL;
+	const char *journal_file = NULL;
+	const char *archive_file = NULL, *reprint = NULL;
+	unsigned resume = 0, list = 0, preview = 0;
+	static const struct option long_opts[] = {
+		{ "journal", required_argument, NULL, 'j' },
+		{ "resume",  no_argument,       NULL, 'r' },
+		{ "archive", required_argument, NULL, 'A' },
+		{ "reprint", required_argument, NULL, OPT_REPRINT },
+		{ "list",    no_argument,       NULL, OPT_LIST },
+		{ "preview", required_argument, NULL, OPT_PREVIEW },
+		{ "gray",    no_argument,       NULL, OPT_GRAY },
+		{ "printer", required_argument, NULL, OPT_PRINTER },
+		{ NULL, 0, NULL, 0 }
+	};
+	while ((opt = getopt_long(ac, av, "A:b:cd:D:g:j:lm:n:o:p:PrR:sS:t:u:Vh", long_opts, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'A': archive_file = optarg; break;
+		case OPT_REPRINT: reprint = optarg; break;
+		case OPT_LIST: list = 1; break;
+		case OPT_PREVIEW:
+			if (!(preview = atoi(optarg)))
+			{
+				printf("ERROR: --preview needs the thumbnail height in pixels\n");
+				return 1;
+			}
+			break;
+		case OPT_GRAY: cfg.bits_per_val = 8; break;
+		case OPT_PRINTER: cfg.printer = optarg; cfg.print = 1; break;
+		case 'b': cfg.input_png_file = optarg; break;
+		case 'c': cfg.cut_marks = 1; break;
+		case 'd': sock_path = optarg; break;
+		case 'D': printers = optarg; break;
+		case 'g': cfg.strip_gap = atoi(optarg); break;
+		case 'j': journal_file = optarg; break;
+		case 'l': cfg.qr_upper = 0; break;
+		case 'm': qr_fixed_mask = atoi(optarg) & 7; break;
+		case 'n': count = atoi(optarg); break;
+		case 'o': cfg.outfile = optarg; break;
+		case 'p': pool_file = optarg; break;
+		case 'P': cfg.print = 1; break;
+		case 'r': resume = 1; break;
+		case 'R': raster_out = optarg; break;
+		case 's': strip = 1; break;
+		case 'S':
+			if (symbology(optarg) < 0)
+			{
+				printf("ERROR: unknown symbology %s, try qr, dm or auto\n", optarg);
+				return 1;
+			}
+			cfg.symbology = symbology(optarg);
+			break;
+		case 't':
+			if (!(cfg.max_height = tape_height(atoi(optarg))))
+			{
+				printf("ERROR: no profile for %s mm tape, try 6, 9, 12, 18 or 24\n", optarg);
+				return 1;
+			}
+			break;
+		case 'u': station_tty = optarg; break;
+		case 'V': cfg.verify = 0; break;
+		default:
+			printf("Usage: %s [-n count [-s [-g gap] [-c]]] [-t mm] [-S symbology] [-o outfile] [-P] [-b background.png] [letter [background.png]]\n", av[0]);
+			printf("       %s -d socket [-o outfile] [-P]\n", av[0]);
+			printf("       %s -n count -D printer[,printer ...] [letter]\n", av[0]);
+			printf("       %s -n count [-D printer[,printer ...]] -j journal [--resume] [letter]\n", av[0]);
+			printf("       %s -A archive --reprint uid[,uid ...] [-D printer[,printer ...] | -o outfile [-P]]\n", av[0]);
+			printf("       %s -A archive --list\n", av[0]);
+			printf("       %s --preview height [-t mm] [-S symbology] [-o sheet.pgm] < payloads\n", av[0]);
+			printf("       %s -u tty [-p pool.txt] [-R raster.pbm]\n", av[0]);
+			printf("  letter: X=any, I=item, C=container, L=location (default: X)\n");
+			printf("  -n: batch mode, outfile gets a running number inserted before the suffix.\n");
+			printf("  -s: strip mode, all labels of the batch go into one outfile, printed as one job.\n");
+			printf("  -g: pixels between the labels of a strip (default: %u)\n", cfg.strip_gap);
+			printf("  -c: draw cut marks between the labels of a strip.\n");
+			printf("  -t: tape width in mm: 6, 9, 12, 18 or 24 (default: 18, %u pixels)\n", cfg.max_height);
+			printf("  -S: qr (default), dm: Data Matrix, or auto: the one that takes less tape. 6 and 9 mm need dm.\n");
+			printf("  -l: lower case qr-code payload, as in older versions. Byte mode, no fast encoder.\n");
+			printf("  -m: always use this qr mask 0..7, instead of the one with the best penalty score.\n");
+			printf("  -P: print each outfile on the P-touch at %s, or --printer device (or file).\n", cfg.printer);
+			printf("  -V: do not verify the qr-codes before saving.\n");
+			printf("  --gray: render on an 8 bit grayscale canvas, saved as pgm. The printer output is the same.\n");
+			printf("  -d: daemon mode, jobs '<letter> [count] [uid ...]' come in line by line on a unix socket.\n");
+			printf("  -D: spread the batch over these printers: auto (all on /dev/usb/lp*), a device,\n");
+			printf("      mock[:ms[:labels]] (simulated, ms per label, tape for that many labels), a file, or\n");
+			printf("      sim[:tape=mm][:labels=n][:fail=n][:mmps=n][:usb=kB][:out=file.pbm],\n");
+			printf("      a simulated P-touch that decodes the printer stream, with its timing and status replies.\n");
+			printf("      fail=n: label n fails in print, as with an opened cover. See ptouch_sim.c.\n");
+			printf("  -j, --journal: log each label of the batch to this file, uid first, so that an\n");
+			printf("      interrupted batch can be finished with --resume, without wasted or doubled uids.\n");
+			printf("  -r, --resume: continue the batch of the journal, letter and count are taken from it.\n");
+			printf("  -A, --archive: append each rendered label to this archive, for reprints.\n");
+			printf("  --reprint: print these labels again from the archive, as they were printed.\n");
+			printf("      uid is the payload or xxxxxxxx-xxxx-xxxx. With -D on the first printer that works.\n");
+			printf("  --list: list the labels in the archive.\n");
+			printf("  --preview: thumbnails of that height for the payloads on stdin, box filtered from the\n");
+			printf("      grayscale label, all in one pgm. Reports 'OK payload x y w h' for each.\n");
+			printf("  -u: send the job lines from stdin to the RP2040 label station on a serial port.\n");
+			printf("  -p: first upload the uid pool of the station, see 'shelfman-index new'.\n");
+			printf("  -R: then fetch the last label from the station into a pbm file.\n");
+			return 1;
+		}
+	}
+	if (optind < ac) letter = av[optind++];
+	if (optind < ac) cfg.input_png_file = av[optind++];	// compatible with older versions
+#if !WITH_PNG_SUPPORT
+	if (cfg.input_png_file)
+		printf("WARNING: compiled without WITH_PNG_SUPPORT, ignoring %s\n", cfg.input_png_file);
+#endif
+
+	if ((reprint || list) && !archive_file)
+	{
+		printf("ERROR: --reprint and --list need the archive, -A file\n");
+		return 1;
+	}
+	if (list)
+		return run_archive_list(archive_file);
+	if (preview)
+		return run_preview(&cfg, preview);
+	if (reprint)
+		return run_reprint(&cfg, archive_file, reprint, printers);
+	if (station_tty)
+		return run_station_client(station_tty, pool_file, raster_out);
+
+	struct journal *j = NULL;
+	if (resume && !journal_file)
+	{
+		printf("ERROR: --resume needs the journal, -j file\n");
+		return 1;
+	}
+	if (journal_file && strip)
+		printf("WARNING: strip mode prints the batch as one job, ignoring the journal %s\n", journal_file);
+	else if (journal_file && !sock_path && !(j = journal_open(journal_file, letter, count, resume)))
+		return 1;
+	if (archive_file && !(cfg.archive = archive_open(archive_file)))
+	{
+		if (j)
+			journal_close(j);
+		return 1;
+	}
+
+	int ret = 0;
+	if (sock_path)
+		ret = run_daemon(&cfg, sock_path);
+	else if (printers)
+	{
+		if (cfg.input_png_file)
+			printf("WARNING: the print dispatcher ignores the background %s\n", cfg.input_png_file);
+		ret = run_dispatch(&cfg, letter, count, printers, j);
+	}
+	else if (strip)
+	{
+		if (cfg.input_png_file)
+			printf("WARNING: strip mode ignores the background %s\n", cfg.input_png_file);
+		ret = gen_qrcode_strip(&cfg, letter, count);
+	}
+	else if (j)
+		ret = run_journal_batch(&cfg, j);
+	else
+	{
+		for (unsigned n = 1; n <= count && !ret; n++)
+		{
+			cfg.seq = (count > 1) ? n : 0;
+			ret = gen_qrcode_tag(&cfg, letter);
+		}
+	}
+	if (cfg.archive && archive_close(cfg.archive))
+		ret = 1;
+	return ret;
 
 #else  // RP2040 Pico SDK
 
+    rp2040_clock_init();	// before the uarts, see SFM_BOOST_KHZ
     gpio_init(LED_PIN);
     gpio_set_dir(LED_PIN, GPIO_OUT);
     stdio_init_all();		// uart nr. and baud rate chosen in CMakeLists.txt via target_compile_definitions()
+    station_uart_init();	// binary job protocol on uart0, see sfm_station.h
+    ptouch_init();		// usb host, the printer is optional
+    uid_pool_init();
 
     // rtc_init();
 	global_qrcode_cfg = &cfg;
@@ -682,3 +4899,4 @@ int main(int ac, char **av)
 
 	return 0;
 }
+#endif // SFM_LIBRARY
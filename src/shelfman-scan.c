@@ -0,0 +1,371 @@
+/*
+ * shelfman-scan.c -- taking inventory with a handheld scanner.
+ *
+ * The scanner sends one code per line, as a keyboard on stdin or on a serial
+ * port. Scanning a location, then its containers and items, moves them there:
+ *	L	the following scans go into this location
+ *	C	moves into the current location, the following items go into it
+ *	I, X	moves into the current container, else into the current location
+ * Each scan is a line 'uid [parent]' of an append-only log, the input of
+ * 'shelfman-index import'.
+ *
+ * The reader thread only parses and queues, it never waits for the disk. The
+ * writer takes all queued scans at once and commits them with one write()
+ * and one fdatasync(), then acknowledges each with an OK line. A burst of
+ * scans so costs one sync per group, not one per scan, and while a sync runs
+ * the next group queues up. A full queue stops the reader, the kernel then
+ * buffers the port, nothing is dropped.
+ *
+ * Usage: see usage() below.
+ */
+
+# include <stdlib.h>
+# include <stdio.h>
+# include <string.h>
+# include <errno.h>
+# include <stdint.h>
+# include <time.h>
+# include <fcntl.h>	// O_RDWR
+# include <unistd.h>
+# include <signal.h>
+# include <pthread.h>
+# include <termios.h>	// serial scanners
+
+#include "sfm_uid.h"
+
+#define SCAN_DEFAULT_LOG	"scans.log"
+#define SCAN_LINE_MAX		128	// longer lines are bad codes
+#define SCAN_QUEUE_LEN		65536	// scans not yet committed
+#define SCAN_LOG_LINE		(2 * SFM_PAYLOAD_LEN + 2)	// "uid parent\n"
+
+struct scan_event {
+	uint64_t uid, parent;		// parent 0: none
+	char letter, parent_letter;
+};
+
+static struct {
+	pthread_mutex_t lock;		// protects everything below
+	pthread_cond_t more;		// a scan was queued, or the input ended
+	pthread_cond_t room;		// a group was taken
+	struct scan_event queue[SCAN_QUEUE_LEN];
+	unsigned head, count;
+	unsigned done;			// no more scans will come
+	int failed;			// the log cannot be written
+} scan;
+
+static volatile sig_atomic_t scan_stop = 0;
+
+// counted by the reader, the writer has its own.
+static unsigned long scan_reads = 0, scan_bad = 0;
+
+
+static double scan_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static void scan_signal(int sig)
+{
+	(void)sig;
+	scan_stop = 1;
+}
+
+
+static speed_t scan_baud(unsigned baud)
+{
+	static const struct { unsigned baud; speed_t speed; } bauds[] = {
+		{ 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+	};
+	for (unsigned i = 0; i < sizeof(bauds) / sizeof(bauds[0]); i++)
+		if (bauds[i].baud == baud)
+			return bauds[i].speed;
+	return B0;
+}
+
+
+static int scan_open_tty(const char *tty, unsigned baud)
+{
+	int fd = open(tty, O_RDONLY | O_NOCTTY);
+	struct termios t;
+	if (fd < 0 || tcgetattr(fd, &t))
+	{
+		printf("ERROR: cannot open %s: errno=%d\n", tty, errno);
+		return -1;
+	}
+	cfmakeraw(&t);
+	cfsetspeed(&t, scan_baud(baud));
+	t.c_cflag |= CLOCAL | CREAD;
+	tcsetattr(fd, TCSANOW, &t);
+	return fd;
+}
+
+
+// queues a scan, waits while the queue is full. Ends the input if the log cannot be written.
+static void scan_queue(const struct scan_event *e)
+{
+	pthread_mutex_lock(&scan.lock);
+	while (scan.count == SCAN_QUEUE_LEN && !scan.failed)
+		pthread_cond_wait(&scan.room, &scan.lock);
+	if (scan.failed)
+	{
+		pthread_mutex_unlock(&scan.lock);
+		scan_stop = 1;
+		return;
+	}
+	scan.queue[(scan.head + scan.count) % SCAN_QUEUE_LEN] = *e;
+	scan.count++;
+	pthread_cond_signal(&scan.more);
+	pthread_mutex_unlock(&scan.lock);
+}
+
+
+// one line of the scanner. The location and container are those of the scans before.
+static void scan_line(const char *line, unsigned len)
+{
+	static struct scan_event location, container;
+	struct scan_event e;
+
+	scan_reads++;
+	if (sfm_parse_n(line, len, &e.letter, &e.uid) || !e.uid)
+	{
+		scan_bad++;
+		printf("ERR bad code '%.*s'\n", (len < 64) ? (int)len : 64, line);
+		return;
+	}
+	e.parent = 0;
+	e.parent_letter = 0;
+	switch (e.letter)
+	{
+	case 'L':
+		location = e;
+		container.uid = 0;
+		break;
+	case 'C':
+		e.parent = location.uid;
+		e.parent_letter = location.letter;
+		container = e;
+		break;
+	default:
+		{
+			const struct scan_event *p = container.uid ? &container : &location;
+			e.parent = p->uid;
+			e.parent_letter = p->letter;
+		}
+		break;
+	}
+	scan_queue(&e);
+}
+
+
+// splits the input into lines, CR, LF or TAB end a code. Returns at the end of the input.
+static void scan_read(int fd)
+{
+	char buf[4096];
+	char line[SCAN_LINE_MAX];
+	unsigned len = 0;
+
+	while (!scan_stop)
+	{
+		int n = read(fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		for (int i = 0; i < n; i++)
+		{
+			char c = buf[i];
+			if (c == '\n' || c == '\r' || c == '\t')
+			{
+				if (len)
+					scan_line(line, len);
+				len = 0;
+			}
+			else
+			{
+				if (len < SCAN_LINE_MAX)
+					line[len] = c;
+				len++;
+			}
+		}
+	}
+	if (len)
+		scan_line(line, len);
+}
+
+
+static unsigned scan_format(char *out, const struct scan_event *e)
+{
+	sfm_format(out, e->letter, e->uid);
+	if (!e->parent)
+	{
+		out[SFM_PAYLOAD_LEN] = '\n';
+		return SFM_PAYLOAD_LEN + 1;
+	}
+	out[SFM_PAYLOAD_LEN] = ' ';
+	sfm_format(out + SFM_PAYLOAD_LEN + 1, e->parent_letter, e->parent);
+	out[SCAN_LOG_LINE - 1] = '\n';
+	return SCAN_LOG_LINE;
+}
+
+
+struct scan_stats {
+	unsigned long scans, groups, max_group;
+	double max_commit;		// seconds of the slowest write and sync
+};
+
+
+// commits groups of scans until the input ends. Returns its struct scan_stats.
+static void *scan_writer(void *arg)
+{
+	int fd = *(int *)arg;
+	static struct scan_event group[SCAN_QUEUE_LEN];
+	static char out[SCAN_QUEUE_LEN * SCAN_LOG_LINE];
+	static struct scan_stats st;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&scan.lock);
+		while (!scan.count && !scan.done)
+			pthread_cond_wait(&scan.more, &scan.lock);
+		unsigned n = scan.count;
+		if (!n)
+		{
+			pthread_mutex_unlock(&scan.lock);
+			break;
+		}
+		for (unsigned i = 0; i < n; i++)
+			group[i] = scan.queue[(scan.head + i) % SCAN_QUEUE_LEN];
+		scan.head = (scan.head + n) % SCAN_QUEUE_LEN;
+		scan.count = 0;
+		pthread_cond_signal(&scan.room);
+		pthread_mutex_unlock(&scan.lock);
+
+		unsigned len = 0;
+		for (unsigned i = 0; i < n; i++)
+			len += scan_format(out + len, group + i);
+
+		double t0 = scan_now();
+		unsigned o = 0;
+		while (o < len)
+		{
+			int w = write(fd, out + o, len - o);
+			if (w < 0 && errno == EINTR)
+				continue;
+			if (w <= 0)
+				break;
+			o += w;
+		}
+		if (o < len || fdatasync(fd))
+		{
+			printf("ERROR: cannot write the scan log: errno=%d, %u scans not committed\n", errno, n);
+			pthread_mutex_lock(&scan.lock);
+			scan.failed = 1;
+			pthread_cond_signal(&scan.room);
+			pthread_mutex_unlock(&scan.lock);
+			break;
+		}
+		double dt = scan_now() - t0;
+
+		// durable now
+		for (unsigned i = 0, k = 0; i < n; i++)
+		{
+			unsigned l = group[i].parent ? SCAN_LOG_LINE : SFM_PAYLOAD_LEN + 1;
+			printf("OK %.*s", (int)l, out + k);
+			k += l;
+		}
+		fflush(stdout);
+		st.scans += n;
+		st.groups++;
+		if (n > st.max_group)
+			st.max_group = n;
+		if (dt > st.max_commit)
+			st.max_commit = dt;
+	}
+	return &st;
+}
+
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-f scans.log] [-t tty [-b baud]]\n", prog);
+	printf("  reads the codes of a handheld scanner, one per line, from stdin or a serial port.\n");
+	printf("  Scan a location, then what is in it: containers and items go into the location,\n");
+	printf("  items after a container into the container. Each scan is committed to the log as\n");
+	printf("  'uid [parent]' and acknowledged with 'OK uid [parent]', bad codes give 'ERR'.\n");
+	printf("  -f: the log, appended to. Default: %s. Apply it with 'shelfman-index import < %s'\n",
+		SCAN_DEFAULT_LOG, SCAN_DEFAULT_LOG);
+	printf("  -t: serial port of the scanner, e.g. /dev/ttyACM0\n");
+	printf("  -b: its baud rate: 9600, 19200, 38400, 57600 or 115200 (default: 9600)\n");
+}
+
+
+int main(int ac, char **av)
+{
+	const char *log_path = SCAN_DEFAULT_LOG, *tty = NULL;
+	unsigned baud = 9600;
+	int opt;
+
+	while ((opt = getopt(ac, av, "b:f:t:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b': baud = atoi(optarg); break;
+		case 'f': log_path = optarg; break;
+		case 't': tty = optarg; break;
+		default: usage(av[0]); return 1;
+		}
+	}
+	if (optind < ac || scan_baud(baud) == B0)
+	{
+		usage(av[0]);
+		return 1;
+	}
+
+	int in = tty ? scan_open_tty(tty, baud) : 0;
+	if (in < 0)
+		return 1;
+	int fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0)
+	{
+		printf("ERROR: cannot open %s: errno=%d\n", log_path, errno);
+		return 1;
+	}
+
+	// ^C ends the session, what was scanned is still committed.
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = scan_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	pthread_t writer;
+	pthread_mutex_init(&scan.lock, NULL);
+	pthread_cond_init(&scan.more, NULL);
+	pthread_cond_init(&scan.room, NULL);
+	pthread_create(&writer, NULL, scan_writer, &fd);
+
+	double t0 = scan_now();
+	scan_read(in);
+
+	pthread_mutex_lock(&scan.lock);
+	scan.done = 1;
+	pthread_cond_signal(&scan.more);
+	pthread_mutex_unlock(&scan.lock);
+	struct scan_stats *st;
+	pthread_join(writer, (void **)&st);
+	double elapsed = scan_now() - t0;
+
+	printf("# %lu reads, %lu bad, %lu committed in %lu groups (max %lu scans, slowest %.1f ms), %.0f scans/s\n",
+		scan_reads, scan_bad, st->scans, st->groups, st->max_group, st->max_commit * 1000,
+		elapsed > 0 ? st->scans / elapsed : 0);
+	close(fd);
+	if (tty)
+		close(in);
+	pthread_cond_destroy(&scan.more);
+	pthread_cond_destroy(&scan.room);
+	pthread_mutex_destroy(&scan.lock);
+	return scan.failed ? 1 : 0;
+}